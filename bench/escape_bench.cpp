@@ -0,0 +1,118 @@
+// throughput of each escape kernel, lm::escape() against a loop taking
+// one byte at a time, on text with nothing, some and much to escape.
+// the outputs must be the same bytes.
+//
+// escape_bench [megabytes per run], 16 by default
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <string>
+#include "lemon_escape.hpp"
+
+template<class K>
+static void scalar(const char *data, size_t len, std::string &buffer)
+{
+    size_t i = 0;
+    while (i < len)
+    {
+        if (K::special((unsigned char)data[i]))
+            i = K::put(data, i, len, buffer);
+        else
+            buffer.push_back(data[i++]);
+    }
+}
+typedef void (*kernel_t)(const char *data, size_t len, std::string &buffer);
+
+struct kernel
+{
+    lm::escape_t kind_;
+    kernel_t scalar_;
+};
+static const kernel kernels[] =
+{
+    {lm::e_escape_html, scalar<lm::esc::html>},
+    {lm::e_escape, scalar<lm::esc::attr>},
+    {lm::e_escape_unquoted, scalar<lm::esc::unquoted>},
+    {lm::e_escape_url, scalar<lm::esc::url>},
+    {lm::e_escape_url_path, scalar<lm::esc::url>},
+    {lm::e_escape_query, scalar<lm::esc::query>},
+    {lm::e_escape_js, scalar<lm::esc::js>},
+    {lm::e_escape_css, scalar<lm::esc::css>}
+};
+
+//64k of words, of markup, and of chinese text with some ascii
+static std::string corpus(int kind)
+{
+    static const char *words[] = {"lorem", "ipsum", "dolor", "sit", "amet", "consectetur"};
+    static const char *markup[] =
+    {
+        "<a href=\"/item?id=42&amp;tab=1\">", "it's", "</a>", "{color: red;}",
+        "x = \"y\";\n", "a+b/c", "(1)"
+    };
+    static const char *chinese[] = {"\xe4\xbd\xa0\xe5\xa5\xbd", "\xe4\xb8\x96\xe7\x95\x8c", "ok", "\xe2\x80\xa8"};
+    std::string text;
+    unsigned int seed = 1;
+    while (text.size() < 65536)
+    {
+        seed = seed * 1103515245 + 12345;
+        unsigned int i = (seed >> 16) & 0x7fff;
+        if (kind == 0)
+            text += words[i % 6];
+        else if (kind == 1)
+            text += markup[i % 7];
+        else
+            text += chinese[i % 4];
+        text += kind == 0 ? " " : "";
+    }
+    return text;
+}
+static double run(lm::escape_t kind, kernel_t scalar, const std::string &text,
+                  int reps, std::string &buffer)
+{
+    clock_t begin = clock();
+    for (int i = 0; i < reps; ++i)
+    {
+        buffer.clear();
+        if (scalar)
+            scalar(text.data(), text.size(), buffer);
+        else
+            lm::escape(kind, text.data(), text.size(), buffer);
+    }
+    double seconds = double(clock() - begin) / CLOCKS_PER_SEC;
+    if (seconds <= 0)
+        seconds = 1e-9;
+    return double(text.size()) * reps / seconds / 1e6;
+}
+int main(int argc, char *argv[])
+{
+    double megabytes = argc > 1 ? atof(argv[1]) : 16;
+    static const char *corpora[] = {"words", "markup", "chinese"};
+    int fails = 0;
+
+#ifdef LM_SSE2
+    printf("%-18s%-10s%12s%12s\n", "kernel", "text", "sse2 MB/s", "scalar MB/s");
+#else
+    printf("%-18s%-10s%12s%12s\n", "kernel", "text", "MB/s", "scalar MB/s");
+#endif
+    for (int c = 0; c < 3; ++c)
+    {
+        std::string text = corpus(c);
+        int reps = (int)(megabytes * 1e6 / text.size()) + 1;
+        for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); ++k)
+        {
+            std::string fast, slow;
+            fast.reserve(text.size() * 6);
+            slow.reserve(text.size() * 6);
+            double a = run(kernels[k].kind_, NULL, text, reps, fast);
+            double b = run(kernels[k].kind_, kernels[k].scalar_, text, reps, slow);
+            printf("%-18s%-10s%12.0f%12.0f\n", lm::escape_name(kernels[k].kind_),
+                   corpora[c], a, b);
+            if (fast != slow)
+            {
+                printf("%s differs from the scalar loop\n", lm::escape_name(kernels[k].kind_));
+                fails++;
+            }
+        }
+    }
+    return fails ? 1 : 0;
+}
@@ -0,0 +1,71 @@
+// renders a 16 branch string chain and a 16 branch int chain, compiled
+// by switch-dispatch into switches (switch.lm), and written as nested
+// ifs the pass leaves alone (chain.lm). the outputs must be the same.
+//
+// switch_bench [renders], 3000000 by default
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <vector>
+#include "model.h"
+#include "switch.lm.h"
+#include "chain.lm.h"
+
+static const char *methods[] =
+{
+    "GET", "PUT", "POST", "HEAD", "PATCH", "TRACE", "DELETE", "OPTIONS",
+    "CONNECT", "LINK", "UNLINK", "PURGE", "LOCK", "UNLOCK", "MKCOL", "COPY",
+    "BREW"
+};
+static const int codes[] =
+{
+    200, 201, 204, 301, 302, 304, 400, 401, 403, 404, 405, 409, 410, 429,
+    500, 503, 418
+};
+static const int count = sizeof(codes) / sizeof(codes[0]);
+
+//every method with every status, the ones matching no branch too
+static std::vector<bench::request> requests()
+{
+    std::vector<bench::request> list;
+    for (int i = 0; i < count; ++i)
+    {
+        for (int j = 0; j < count; ++j)
+        {
+            bench::request r;
+            r.method = methods[i];
+            r.status = codes[(i + j) % count];
+            list.push_back(r);
+        }
+    }
+    return list;
+}
+static double run(std::string (*render)(const bench::request &),
+                  const std::vector<bench::request> &list, long renders,
+                  size_t &bytes)
+{
+    clock_t begin = clock();
+    for (long i = 0; i < renders; ++i)
+        bytes += render(list[i % list.size()]).size();
+    return double(clock() - begin) / CLOCKS_PER_SEC;
+}
+int main(int argc, char *argv[])
+{
+    long renders = argc > 1 ? atol(argv[1]) : 3000000;
+    std::vector<bench::request> list = requests();
+    for (size_t i = 0; i < list.size(); ++i)
+    {
+        if (dispatch_switch(list[i]) != dispatch_chain(list[i]))
+        {
+            printf("%s %d differs\n", list[i].method.c_str(), list[i].status);
+            return 1;
+        }
+    }
+
+    size_t bytes = 0;
+    double chain = run(dispatch_chain, list, renders, bytes);
+    double dispatch = run(dispatch_switch, list, renders, bytes);
+    printf("%ld renders: if chain %.2fs, switch %.2fs (%lu bytes)\n",
+           renders, chain, dispatch, (unsigned long)bytes);
+    return 0;
+}
@@ -0,0 +1,12 @@
+#pragma once
+#include <string>
+#include "lemon.hpp"
+
+namespace bench
+{
+    struct request
+    {
+        std::string method;
+        int status;
+    };
+}
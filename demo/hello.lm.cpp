@@ -1,24 +1,52 @@
 #include "lemon.hpp"
+#include "hello.lm.h"
+
+//other.lm
+#ifndef LM_INCLUDE_BBE730F91D0DB237
+#define LM_INCLUDE_BBE730F91D0DB237
+inline void lm_include_bbe730f91d0db237(std::string &code, const std::string &name, const std::string &hello)
+{
+	if(!name.empty())
+	{
+		code += "<p>";
+		code += hello;
+		code += ",I am ";
+		code += name;
+		code += " other.lm</p>";
+	}
+}
+#endif
+
+//other.lm
+#ifndef LM_INCLUDE_B1ABE5042B6318C1
+#define LM_INCLUDE_B1ABE5042B6318C1
+inline void lm_include_b1abe5042b6318c1(std::string &code, const std::string &name, const std::string &hello)
+{
+	if(!name.empty())
+	{
+		code += "<p>";
+		code += lm::$escape_html(hello);
+		code += ",I am ";
+		code += lm::$escape_html(name);
+		code += " other.lm</p>";
+	}
+}
+#endif
 
 std::string hello(const std::string &hello,const std::string &name, const std::vector<std::vector<std::string> > &table)
 {
 	std::string code;
-	code += "<HTML>";
-	code += "<HEAD>";
-	code += "<META NAME=\"GENERATOR\" Content=\"Microsoft Visual Studio\">";
-	code += "<TITLE></TITLE>";
-	code += "</HEAD>";
-	code += "<BODY>";
-	code += "---- ";
-	code += "hello ";
-	code += lm::$default(lm::$escape(hello), "hello is empty!!!!");
+	code += "<HTML><HEAD><META NAME=\"GENERATOR\" Content=\"Microsoft Visual Studio\"><TITLE></TITLE></HEAD><BODY> ---- hello ";
+	code += lm::$default(lm::$escape_html(hello), "hello is empty!!!!");
+	code += " ";
 	if(lm::$length(name)>0)
 	{
 		code += "name:";
 		code += name;
+		code += " ";
 	}
-	code += "<p> - - - - - - - - - </p>";
-	code += "<table>";
+	code += "<p> - - - - - - - - - </p><table>";
+	const std::string &lm_v1 = lm::$escape_html(name);
 	std::vector<std::vector<std::string> >::const_iterator it1 = table.begin();
 	for (; it1 != table.end(); ++it1)
 	{
@@ -28,40 +56,29 @@ std::string hello(const std::string &hello,const std::string &name, const std::v
 		for (; it2 != items.end(); ++it2)
 		{
 			const std::string &item = *it2;
-			code += "<td>";
-			code += "hello:";
+			code += "<td> hello:";
 			code += hello;
-			code += "name: ";
-			code += lm::$escape(name);
-			code += "item: ";
+			code += " name: ";
+			code += lm_v1;
+			code += " item: ";
 			code += item;
-			code += "</td>";
-		}
-		if(!name.empty())
-		{
-			code += "<p>";
-			code += hello;
-			code += ",I am ";
-			code += name;
-			code += "other.lm</p>";
+			code += " </td>";
 		}
+		lm_include_bbe730f91d0db237(code, name, hello);
 		code += "</tr>";
 	}
-	code += "</table>";
-	code += "<p>";
-	code += lm::$escape(hello);
-	code += lm::$escape(name);
-	code += "</p>";
-	code += "<p> - - - - - - - - - </p>";
-	if(!name.empty())
-	{
-		code += "<p>";
-		code += lm::$escape(hello);
-		code += ",I am ";
-		code += lm::$escape(name);
-		code += "other.lm</p>";
-	}
-	code += "</BODY>";
-	code += "</HTML>";
+	code += "</table><p>";
+	code += lm::$escape_html(hello);
+	code += lm_v1;
+	code += "</p><p> - - - - - - - - - </p>";
+	lm_include_b1abe5042b6318c1(code, name, hello);
+	code += "</BODY></HTML>";
 	return code;
 }
+
+extern "C" LM_EXPORT const lm::export_t lm_template_hello =
+{
+	"hello",
+	"std::string hello(const std::string &hello,const std::string &name, const std::vector<std::vector<std::string> > &table)",
+	(lm::function_t)&hello
+};
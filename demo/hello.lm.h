@@ -1,2 +1,5 @@
 #pragma once
-std::string hello(const std::string &hello, const std::string &name, std::vector<std::vector<std::string> > &table);
+#include <string>
+#include <vector>
+
+std::string hello(const std::string &hello,const std::string &name, const std::vector<std::vector<std::string> > &table);
@@ -1,8 +1,22 @@
 #pragma once
 #include <set>
+#include <map>
+#include <list>
 #include <string>
 #include <vector>
 #include <fstream>
+
+#define LEMON_VERSION "0.4.5"
+
+class source_cache;
+class code_cache;
+struct expr_t;
+struct node_t;
+typedef std::vector<node_t> nodes_t;
+
+// headers are parsed once into the lemon object, templates are compiled
+// in a private per-compilation context, so parse_template() may be
+// called from many threads at once after the headers are loaded.
 class lemon
 {
 private:
@@ -57,6 +71,17 @@ private:
             e_extends,         //  extends
             e_autoescape,      //  autoescape
             e_endautoescape,   //  endautoescape
+            e_macro,           //  macro
+            e_endmacro,        //  endmacro
+            e_call,            //  call
+            e_cold,            //  cold
+            e_endcold,         //  endcold
+            e_spaceless,       //  spaceless
+            e_endspaceless,    //  endspaceless
+            e_inline_file,     //  inline_file
+            e_trans,           //  trans
+            e_blocktrans,      //  blocktrans
+            e_endblocktrans,   //  endblocktrans
 
             //filters
             e_length,          //  length filter
@@ -110,6 +135,7 @@ private:
             e_const,           //  const
             e_std_string,      //  std::list
             e_acl_string,      //  acl::string
+            e_safe_string,     //  lm::safe_string
             e_std_vector,      //  std::vector
             e_std_list,        //  std::list
             e_std_map,         //  std::map
@@ -133,6 +159,7 @@ private:
         typedef enum type
         {
             e_void,
+            e_bool,
             e_char,
             e_unsigned_char,
             e_short,
@@ -146,6 +173,7 @@ private:
 
             e_std_string,
             e_acl_string,
+            e_safe_string,
 
             e_float,
             e_double,
@@ -185,10 +213,30 @@ private:
         std::string name_;
         interface_t interface_;
     };
+    //<name>_<variant_>, a render function with parameters bound
+    struct variant_t
+    {
+        std::string name_;
+        std::vector<std::pair<std::string, std::string> > constants_;
+    };
+    //counters of a template function, see lemon_profile.hpp
+    struct profile_t
+    {
+        profile_t()
+            :renders_(0),
+             bytes_(0)
+        {
+
+        }
+        std::string hash_;
+        unsigned long long renders_;
+        unsigned long long bytes_;
+        std::vector<unsigned long long> counts_;
+    };
     struct lexer
     {
         token_t token_;
-        std::ifstream *file_;
+        std::istream *file_;
         std::string file_path_;
         std::string current_line_;
         std::string line_buffer_;
@@ -202,7 +250,7 @@ private:
         std::string current_line_;
         std::string line_buffer_;
         int line_;
-        std::ifstream *file_;
+        std::istream *file_;
     };
     struct stack
     {
@@ -218,15 +266,95 @@ private:
 
     void read_line();
 public:
+    typedef enum backend_t
+    {
+        e_cpp,             // <template>.cpp, compiled into the server
+        e_vm               // <template>.lmc, rendered by lemon_vm.hpp
+    } backend_t;
+
     lemon();
     ~lemon();
     bool parse_cpp_header(const std::string &file_path);
-    bool parse_template(const std::string &file_path);
+    bool parse_template(const std::string &file_path) const;
+    bool parse_template(const std::string &file_path, std::string &code) const;
+    bool parse_templates(const std::vector<std::string> &file_paths,
+                         int threads) const;
+    bool parse_manifest(const std::string &file_path, int threads);
+    bool load_manifest(const std::string &file_path,
+                       std::vector<std::string> &templates);
+    //rebuild templates whenever they or their dependencies change
+    bool watch(const std::vector<std::string> &templates, int threads);
+    void set_backend(backend_t backend);
+    //includes of up to `nodes` nodes are pasted in place
+    void set_inline_threshold(size_t nodes);
+    //branch and loop bodies of more than `nodes` nodes become functions
+    //of their own, 0 for {% cold %} regions only
+    void set_outline_threshold(size_t nodes);
+    //write <template>.ir, the tree after the parser and each pass
+    void set_dump_ir(bool dump);
+    //count branches and loop trips at run time, for lm::write_profile()
+    void set_instrument(bool instrument);
+    //counts written by an instrumented build, added to the ones read
+    //before. templates whose tree changed since are compiled without.
+    bool load_profile(const std::string &file_path);
+    //long literals are slices of the blob written by gen_literal_pool()
+    void set_literal_pool(bool pool);
+    //html whitespace of the text collapsed at compile time, on by
+    //default. {% spaceless %} blocks are minified either way.
+    void set_minify(bool minify);
+    //render in charset instead of utf-8, gbk or gb18030 or another
+    //superset of ascii: literals converted at compile time, values by
+    //lm::transcoder at run time. for every template without one of its
+    //own when file_path is empty.
+    bool set_charset(const std::string &charset, const std::string &file_path = "");
+    //also generate <name>_<variant>() of the template, with parameters
+    //bound to constants: `debug=false locale="en" langs=["en", "fr"]`
+    bool add_variant(const std::string &file_path, const std::string &variant,
+                     const std::string &constants);
+    //also generate <name>_<locale>() of the templates with a translation
+    //in the .po catalog, and <name>_locale(locale, ...) picking one
+    bool add_locale(const std::string &locale, const std::string &po_path);
+    //lm::vm::reflect<> of every parsed class, for the vm backend
+    bool gen_reflect(const std::string &file_path) const;
+    //lm::find_template() over the templates, see lemon_registry.hpp
+    bool gen_registry(const std::vector<std::string> &templates,
+                      const std::string &file_path) const;
+    //the literals of the templates, deduplicated into one blob, for
+    //templates compiled with set_literal_pool(). read from the
+    //<output>.literals files parse_templates() leaves.
+    bool gen_literal_pool(const std::vector<std::string> &templates,
+                          const std::string &file_path) const;
+    //unity translation units including the generated templates
+    bool gen_unity(const std::vector<std::string> &templates,
+                   const std::string &prefix, int parts) const;
 
 private:
+    lemon(const std::vector<class_t> &classes, source_cache *sources,
+          backend_t backend);
+    std::string output_ext() const;
+    std::string output_path(const std::string &file_path) const;
+    std::string header_path(const std::string &file_path) const;
+    bool compile(const std::string &file_path, std::string &code);
+    bool load_interface(const std::string &file_path);
+    std::string inputs_hash(const std::vector<std::string> &inputs) const;
+    bool up_to_date(const std::string &file_path) const;
+    bool write_outputs(const std::string &file_path,
+                       const std::string &code,
+                       const std::string &header,
+                       const std::string &literals,
+                       const std::vector<std::string> &inputs) const;
+    void add_input(const std::string &file_path);
+    bool reload_headers();
+    bool resolve_inputs(const std::string &file_path,
+                        std::vector<std::string> &inputs) const;
+    std::string metadata() const;
+    std::string options(const std::string &file_path) const;
+    void copy_options(lemon &ctx, const std::string &file_path) const;
+    std::string cache_key(const std::vector<std::string> &inputs) const;
+    std::string tab();
     lexer *new_lexer(const std::string &file_path);
     int line();
-    void print_lexer_status();
+    void print_lexer_status(const std::string &error);
     void assert_not_eof(const token_t &t);
     token_t get_next_token(const std::string &skipstr=" \r\n\t");
     void clear_line_buffer();
@@ -238,7 +366,7 @@ private:
     token_t::type_t pop_status();
     token_t::type_t get_status();
     std::string get_status_str();
-    std::string parse_open_block();
+    token_t::type_t parse_open_block(nodes_t &nodes);
     void pop_stack();
     void push_stack(const std::string &name, const std::string &type);
     void push_stack_size(int size);
@@ -247,35 +375,70 @@ private:
     field::type get_field_type(const token_t &token);
     void init_filter();
     bool check_filter(const std::string &name);
-    std::string gen_bool_code(const std::string &item);
+    expr_t gen_test(const expr_t &item);
     std::string get_type(const std::string &name);
-    std::string get_code();
-    std::string parse_if();
+    expr_t parse_operand(bool &raw);
+    expr_t parse_compare();
+    expr_t parse_condition();
+    void parse_if(nodes_t &nodes);
     std::string get_for_items();
-    std::string parse_for();
+    void parse_for(nodes_t &nodes);
     std::string get_variable();
-    std::string to_string(const std::string &name,const std::string &type);
-    std::string parse_variable();
+    expr_t variable(const std::string &path);
+    void parse_variable(nodes_t &nodes);
     std::string get_include_filepath();
-    std::string parse_html_include();
+    void parse_html_include(nodes_t &nodes);
     std::string get_default_string();
-    std::string parse_block();
-    std::string parse_extends();
-    std::string parse_html();
+    void parse_block(nodes_t &nodes);
+    void parse_extends(nodes_t &nodes);
+    void parse_macro(nodes_t &nodes);
+    void parse_call(nodes_t &nodes);
+    void parse_cold(nodes_t &nodes);
+    void parse_spaceless(nodes_t &nodes);
+    void parse_inline_file(nodes_t &nodes);
+    void parse_trans(nodes_t &nodes);
+    void parse_blocktrans(nodes_t &nodes);
+    static bool is_numeric(field::type type);
+    token_t::type_t parse_html(nodes_t &nodes);
     block get_block(const std::string &name);
     bool block_exist(const std::string &name);
-    void parse_template();
+    void parse_template(nodes_t &nodes);
+    static interface_t variant_interface(const interface_t &interface,
+                                         const variant_t &variant);
+    static std::string locale_interface(const interface_t &interface);
+    void bind_constants(nodes_t &nodes, const variant_t &variant);
+    std::string gen_template(const nodes_t &nodes,
+                             const std::vector<nodes_t> &variants,
+                             const std::vector<nodes_t> &localized);
+    void use_profile(const std::string &name, nodes_t &nodes);
+    std::string gen_function(const interface_t &interface, const nodes_t &nodes);
+    std::string gen_header(const interface_t &interface,
+                           const std::vector<variant_t> &variants,
+                           const std::vector<std::string> &translated) const;
+    std::string gen_cpp(const nodes_t &nodes);
+    std::string gen_switch(const node_t &node);
+    std::string gen_body(const nodes_t &nodes);
+    std::string gen_count(int site, size_t index);
+    std::string gen_transcoder(const std::string &text);
+    std::string gen_literal(const std::string &str);
+    std::string gen_outline(const nodes_t &nodes, const std::string &prefix,
+                            const std::string &attributes,
+                            const std::string &comment);
+    std::string gen_macro(const node_t &node);
+    std::string add_function(const std::string &prefix,
+                             const std::string &comment,
+                             const std::string &code,
+                             const std::string &attributes = "");
+    std::string gen_expr(const expr_t &expr);
+    std::string gen_program(const nodes_t &nodes);
 
     std::string get_iterator();
 
-    void pop_for_item();
-    void add_for_item(const std::string &item);
-    std::string get_for_item();
 
     ///c++
     typedef std::vector<field> fields_t;
     typedef std::vector<std::string> namespaces_t;
-    std::string to_string(const namespaces_t &namespaces);
+    std::string to_string(const namespaces_t &namespaces) const;
     field parse_return();
     field parse_param();
     void parse_interface();
@@ -293,6 +456,15 @@ private:
     field parse_field_type();
     void skip_function();
     class_t *get_class(const std::string &name, const namespaces_t &nsp);
+    //the parse trees of included and base templates, see source_cache
+    static void write_fields(std::string &out, const fields_t &fields);
+    static fields_t read_fields(std::istream &in);
+    std::string bindings() const;
+    bool cached_tree(const std::string &key, nodes_t &nodes);
+    void cache_tree(const std::string &key, const nodes_t &nodes,
+                    std::vector<std::string> inputs, size_t reads,
+                    const std::map<std::string, fields_t> &macros,
+                    int iterators);
 private:
     std::vector<block>  blocks_;
     std::vector<lexer*> lexers_;
@@ -307,11 +479,53 @@ private:
 
     template_t template_;
     int iterators_;
+    int tab_;
+    //includes of more nodes become functions
+    size_t inline_threshold_;
+    //bodies of more nodes are outlined, 0 is off
+    size_t outline_threshold_;
+    bool dump_ir_;
+    bool instrument_;
+    //by template function name
+    std::map<std::string, profile_t> profiles_;
+    //counter arrays of an instrumented build, and the one of the
+    //function being generated
+    std::string counters_;
+    std::string counter_array_;
+    bool literal_pool_;
+    bool minify_;
+    //by template path, "" for all. charset_ of the template compiled,
+    //empty for utf-8
+    std::map<std::string, std::string> charsets_;
+    std::string charset_;
+    //pooled literals, and the declarations of their slices
+    std::set<std::string> literals_;
+    std::string literal_decls_;
+    //by template path
+    std::map<std::string, std::vector<variant_t> > variants_;
+    //msgid to msgstr by locale, and the locales with a translation
+    //in the template compiled
+    std::map<std::string, std::map<std::string, std::string> > locales_;
+    std::vector<std::string> translated_;
+    std::set<std::string> function_names_;
+    std::string functions_;
+    //macro parameters by name, and the functions they compile to
+    std::map<std::string, fields_t> macros_;
+    std::map<std::string, std::string> macro_functions_;
     bool is_base_;
 
     std::set<std::string> filters_;
-    std::vector<std::string> for_items_;
     ///c++
     std::vector<std::string> analyzed_files_;
+    std::vector<std::string> headers_;
+    //template, includes and base templates read by a compilation, and
+    //every read in order, for the inputs of the cached parse trees
+    std::vector<std::string> inputs_;
+    std::vector<std::string> reads_;
     std::vector<namespaces_t> namespaces_;
+
+    source_cache *sources_;
+    bool own_sources_;
+    code_cache *cache_;
+    backend_t backend_;
 };
\ No newline at end of file
@@ -1,11 +1,85 @@
 #pragma once
 #include <string>
 #include <vector>
+#include <list>
 #include <map>
 #include <set>
+#include <sstream>
+#include "lemon_escape.hpp"
+
+#ifdef _WIN32
+#define LM_EXPORT __declspec(dllexport)
+#else
+#define LM_EXPORT __attribute__((visibility("default")))
+#endif
+
+//regions of a template compiled out of line, away from the hot code
+#ifdef _MSC_VER
+#define LM_NOINLINE __declspec(noinline)
+#define LM_COLD __declspec(noinline)
+#else
+#define LM_NOINLINE __attribute__((noinline))
+#define LM_COLD __attribute__((cold, noinline))
+#endif
+
+//conditions a profile says are nearly always, or nearly never, true
+#ifdef _MSC_VER
+#define LM_LIKELY(x) (x)
+#define LM_UNLIKELY(x) (x)
+#else
+#define LM_LIKELY(x) __builtin_expect(!!(x), 1)
+#define LM_UNLIKELY(x) __builtin_expect(!!(x), 0)
+#endif
 
 namespace lm
 {
+    typedef void (*function_t)();
+    //every generated template exports one as lm_template_<name>,
+    //lemon_reload.hpp finds the templates of a shared object by them.
+    struct export_t
+    {
+        const char *name_;
+        const char *signature_;
+        function_t function_;
+    };
+
+    //a run of the literal pool, `lemon --literal-pool`. a literal is an
+    //array of them ending with an empty one, the (pointer, length) pairs
+    //writev() takes.
+    struct slice_t
+    {
+        const char *data_;
+        size_t size_;
+    };
+
+    inline void append_literal(std::string &out, const slice_t *slices)
+    {
+        for (; slices->size_; ++slices)
+            out.append(slices->data_, slices->size_);
+    }
+
+    //text that is escaped, or html, already. {{ }} of a view model field
+    //of this type writes it as it is, no |safe needed.
+    class safe_string : public std::string
+    {
+    public:
+        safe_string()
+        {
+        }
+        explicit safe_string(const std::string &str)
+            :std::string(str)
+        {
+        }
+        explicit safe_string(const char *str)
+            :std::string(str)
+        {
+        }
+        safe_string(const char *str, size_t len)
+            :std::string(str, len)
+        {
+        }
+    };
+
     inline size_t $length(const std::string &str)
     {
         return str.size();
@@ -16,8 +90,13 @@ namespace lm
     {
         return obj.size();
     }
+    template<class K, class V>
+    inline size_t $length(const std::map<K, V> &obj)
+    {
+        return obj.size();
+    }
     template<class T>
-    inline size_t $length(const std::map<T> &obj)
+    inline size_t $length(const std::set<T> &obj)
     {
         return obj.size();
     }
@@ -26,32 +105,17 @@ namespace lm
     {
         return obj.size();
     }
+    template<class T>
+    inline std::string $to_string(const T &data)
+    {
+        std::ostringstream buffer;
+        buffer << data;
+        return buffer.str();
+    }
     inline std::string $default(const std::string &data,const std::string &def)
     {
         if(data.empty())
             return def;
         return data;
     }
-    inline std::string $escape(const std::string &data)
-    {
-        std::string buffer;
-
-        for (size_t i = 0; i < data.size(); ++i)
-        {
-            char ch = data[i];
-            if(ch == '<')
-                buffer.append("&lt;");
-            else if(ch == '>')
-                buffer.append("&gt;");
-            else if(ch == '\"')
-                buffer.append("&#39;");
-            else if(ch == '\'')
-                buffer.append("&quot;");
-            else if(ch == '&')
-                buffer.append("&amp;");
-            else
-                buffer.push_back(ch);
-        }
-        return buffer;
-    }
-}
\ No newline at end of file
+}
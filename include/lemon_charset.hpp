@@ -0,0 +1,253 @@
+#pragma once
+#include <string>
+#include <set>
+#include <vector>
+#include <cstring>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+#include "acl_cpp/lib_acl.hpp"
+#include "lemon_escape.hpp"
+
+// the values of templates compiled with `lemon --charset gbk`, utf-8
+// converted into the output charset as they are written. the literals
+// were converted by lemon. ascii is copied as it is, only from the first
+// to the last other byte goes through acl::charset_conv. each thread keeps
+// a transcoder per charset, so the converter is opened once. they are
+// freed when the thread ends, or with the templates when a .so of them
+// is unloaded, so the templates may be hot reloaded. link acl with them.
+namespace lm
+{
+    class transcoder
+    {
+    public:
+        explicit transcoder(const char *charset)
+            :charset_(charset),
+             open_(false),
+             failed_(false)
+        {
+        }
+        const std::string &charset() const
+        {
+            return charset_;
+        }
+        void append(std::string &out, const std::string &str)
+        {
+            append(out, str.data(), str.size());
+        }
+        void append(std::string &out, const char *str)
+        {
+            append(out, str, strlen(str));
+        }
+        //the charset is a superset of ascii, so the ascii between other
+        //bytes goes through the converter with them, in one call
+        void append(std::string &out, const char *data, size_t len)
+        {
+            size_t first = 0;
+            while (first < len && (unsigned char)data[first] < 0x80)
+                ++first;
+            out.append(data, first);
+            if (first == len)
+                return;
+            size_t last = len;
+            while ((unsigned char)data[last - 1] < 0x80)
+                --last;
+            convert(out, data + first, last - first);
+            out.append(data + last, len - last);
+        }
+        //str escaped straight into out. the escapers keep the bytes
+        //>= 0x80 as they are, so only from the first of them on is
+        //taken back out and converted
+        void escape(std::string &out, escape_t kind, const std::string &str)
+        {
+            size_t start = out.size();
+            lm::escape(kind, str.data(), str.size(), out);
+            while (start < out.size() && (unsigned char)out[start] < 0x80)
+                ++start;
+            if (start == out.size())
+                return;
+            tail_.assign(out, start, std::string::npos);
+            out.resize(start);
+            append(out, tail_.data(), tail_.size());
+        }
+    private:
+        //bytes the charset lacks or that aren't utf-8 are kept
+        void convert(std::string &out, const char *data, size_t len)
+        {
+            if (!open_ && !failed_)
+            {
+                conv_.set_add_invalid(true);
+                open_ = conv_.update_begin("utf-8", charset_.c_str());
+                failed_ = !open_;
+            }
+            buffer_.clear();
+            if (failed_ || !conv_.update(data, len, &buffer_))
+                out.append(data, len);
+            else
+                out.append(buffer_.c_str(), buffer_.length());
+        }
+
+        std::string charset_;
+        bool open_;
+        bool failed_;
+        acl::charset_conv conv_;
+        acl::string buffer_;
+        std::string tail_;
+
+        transcoder(const transcoder &);
+        transcoder &operator =(const transcoder &);
+    };
+
+    namespace detail
+    {
+        typedef std::vector<transcoder *> transcoders_t;
+
+        inline void free_transcoders(transcoders_t *list)
+        {
+            for (size_t i = 0; i < list->size(); ++i)
+                delete (*list)[i];
+            delete list;
+        }
+        inline void free_thread(void *data);
+#ifdef _WIN32
+        inline void WINAPI free_fls(void *data)
+        {
+            if (data)
+                free_thread(data);
+        }
+#endif
+
+        //the lists of the threads. a list is freed when its thread ends,
+        //the others when the image of these templates is unloaded or
+        //the process exits: the key goes first, so a reloaded .so
+        //leaves no thread exit callback pointing into it.
+        class thread_transcoders
+        {
+        public:
+            thread_transcoders()
+            {
+#ifdef _WIN32
+                key_ = FlsAlloc(free_fls);
+                InitializeCriticalSection(&lock_);
+#else
+                pthread_key_create(&key_, free_thread);
+                pthread_mutex_init(&lock_, NULL);
+#endif
+            }
+            ~thread_transcoders()
+            {
+                //FlsFree may call free_fls, which takes the lock
+#ifdef _WIN32
+                FlsFree(key_);
+#else
+                pthread_key_delete(key_);
+#endif
+                lock();
+                std::set<transcoders_t *>::iterator it;
+                for (it = lists_.begin(); it != lists_.end(); ++it)
+                    free_transcoders(*it);
+                lists_.clear();
+                unlock();
+#ifdef _WIN32
+                DeleteCriticalSection(&lock_);
+#else
+                pthread_mutex_destroy(&lock_);
+#endif
+            }
+            transcoders_t *get()
+            {
+#ifdef _WIN32
+                return static_cast<transcoders_t *>(FlsGetValue(key_));
+#else
+                return static_cast<transcoders_t *>(pthread_getspecific(key_));
+#endif
+            }
+            void set(transcoders_t *list)
+            {
+                lock();
+                lists_.insert(list);
+                unlock();
+#ifdef _WIN32
+                FlsSetValue(key_, list);
+#else
+                pthread_setspecific(key_, list);
+#endif
+            }
+            //the list of a thread that ended, unless already freed
+            void release(transcoders_t *list)
+            {
+                lock();
+                bool found = lists_.erase(list) != 0;
+                unlock();
+                if (found)
+                    free_transcoders(list);
+            }
+        private:
+#ifdef _WIN32
+            void lock() { EnterCriticalSection(&lock_); }
+            void unlock() { LeaveCriticalSection(&lock_); }
+            DWORD key_;
+            CRITICAL_SECTION lock_;
+#else
+            void lock() { pthread_mutex_lock(&lock_); }
+            void unlock() { pthread_mutex_unlock(&lock_); }
+            pthread_key_t key_;
+            pthread_mutex_t lock_;
+#endif
+            std::set<transcoders_t *> lists_;
+
+            thread_transcoders(const thread_transcoders &);
+            thread_transcoders &operator =(const thread_transcoders &);
+        };
+#ifdef _WIN32
+        inline thread_transcoders &transcoders()
+        {
+            static thread_transcoders list;
+            return list;
+        }
+#else
+        inline thread_transcoders *&transcoders_ptr()
+        {
+            static thread_transcoders *list = NULL;
+            return list;
+        }
+        //a static of its own, destroyed with the image
+        inline void make_transcoders()
+        {
+            static thread_transcoders list;
+            transcoders_ptr() = &list;
+        }
+        inline thread_transcoders &transcoders()
+        {
+            static pthread_once_t once = PTHREAD_ONCE_INIT;
+            pthread_once(&once, make_transcoders);
+            return *transcoders_ptr();
+        }
+#endif
+        inline void free_thread(void *data)
+        {
+            transcoders().release(static_cast<transcoders_t *>(data));
+        }
+    }
+
+    //the transcoder of this thread for charset, freed when the thread ends
+    inline transcoder &thread_transcoder(const char *charset)
+    {
+        detail::thread_transcoders &lists = detail::transcoders();
+        detail::transcoders_t *list = lists.get();
+        if (!list)
+        {
+            list = new detail::transcoders_t;
+            lists.set(list);
+        }
+        for (size_t i = 0; i < list->size(); ++i)
+        {
+            if ((*list)[i]->charset() == charset)
+                return *(*list)[i];
+        }
+        list->push_back(new transcoder(charset));
+        return *list->back();
+    }
+}
@@ -0,0 +1,458 @@
+#pragma once
+#include <string>
+
+// the escapers of {{ }} values. lemon tracks the html context of each
+// value while compiling and picks the one it needs:
+//
+//   $escape_html      element text and comments, & < >
+//   $escape           quoted attribute values, & < > " '
+//   $escape_unquoted  unquoted attribute values and tags, also spaces
+//                     and = `
+//   $escape_url       url attributes while their scheme is open, %XX but
+//                     for the url syntax. javascript:, vbscript: and
+//                     data: urls become about:invalid
+//   $escape_url_path  url attributes past the scheme, as $escape_url
+//                     without the check
+//   $escape_query     url attributes after ? or #, %XX but for letters,
+//                     digits and - . _ ~
+//   $escape_js        javascript strings and event handler attributes
+//   $escape_css       <style> and style attributes
+//
+// runs of bytes needing none are found 16 at a time with sse2, where
+// there is sse2, and appended at once.
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#define LM_SSE2
+#endif
+
+namespace lm
+{
+    namespace esc
+    {
+        static const char hex[] = "0123456789abcdef";
+        static const char HEX[] = "0123456789ABCDEF";
+
+#ifdef LM_SSE2
+        inline __m128i eq(__m128i v, char ch)
+        {
+            return _mm_cmpeq_epi8(v, _mm_set1_epi8(ch));
+        }
+        //bytes from lo to hi
+        inline __m128i in(__m128i v, unsigned char lo, unsigned char hi)
+        {
+            __m128i t = _mm_sub_epi8(v, _mm_set1_epi8((char)lo));
+            return _mm_cmpeq_epi8(_mm_min_epu8(t, _mm_set1_epi8((char)(hi - lo))), t);
+        }
+        inline __m128i any(__m128i a, __m128i b)
+        {
+            return _mm_or_si128(a, b);
+        }
+        inline size_t first_bit(int mask)
+        {
+#ifdef _MSC_VER
+            unsigned long i;
+            _BitScanForward(&i, (unsigned long)mask);
+            return i;
+#else
+            return __builtin_ctz(mask);
+#endif
+        }
+#endif
+
+        //K says which bytes need escaping, special() one at a time and
+        //specials() 16 at a time, and writes them with put(), which
+        //returns where to go on
+        template<class K>
+        inline void escape(const char *data, size_t len, std::string &buffer)
+        {
+            size_t i = 0;
+            while (i < len)
+            {
+                //runs of bytes to escape don't pay for a scan
+                if (K::special((unsigned char)data[i]))
+                {
+                    i = K::put(data, i, len, buffer);
+                    continue;
+                }
+                size_t start = i;
+#ifdef LM_SSE2
+                while (i + 16 <= len)
+                {
+                    __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+                    int mask = _mm_movemask_epi8(K::specials(v));
+                    if (mask)
+                    {
+                        i += first_bit(mask);
+                        break;
+                    }
+                    i += 16;
+                }
+#endif
+                while (i < len && !K::special((unsigned char)data[i]))
+                    ++i;
+                buffer.append(data + start, i - start);
+                if (i < len)
+                    i = K::put(data, i, len, buffer);
+            }
+        }
+
+        struct html
+        {
+            static bool special(unsigned char ch)
+            {
+                return ch == '&' || ch == '<' || ch == '>';
+            }
+#ifdef LM_SSE2
+            static __m128i specials(__m128i v)
+            {
+                return any(eq(v, '&'), any(eq(v, '<'), eq(v, '>')));
+            }
+#endif
+            static size_t put(const char *data, size_t i, size_t, std::string &buffer)
+            {
+                char ch = data[i];
+                if (ch == '&')
+                    buffer.append("&amp;");
+                else if (ch == '<')
+                    buffer.append("&lt;");
+                else
+                    buffer.append("&gt;");
+                return i + 1;
+            }
+        };
+
+        struct attr
+        {
+            static bool special(unsigned char ch)
+            {
+                return html::special(ch) || ch == '"' || ch == '\'';
+            }
+#ifdef LM_SSE2
+            static __m128i specials(__m128i v)
+            {
+                return any(html::specials(v), any(eq(v, '"'), eq(v, '\'')));
+            }
+#endif
+            static size_t put(const char *data, size_t i, size_t len, std::string &buffer)
+            {
+                char ch = data[i];
+                if (ch == '"')
+                    buffer.append("&quot;");
+                else if (ch == '\'')
+                    buffer.append("&#39;");
+                else
+                    return html::put(data, i, len, buffer);
+                return i + 1;
+            }
+        };
+
+        struct unquoted
+        {
+            static bool special(unsigned char ch)
+            {
+                return attr::special(ch) || ch == '`' || ch == '=' || ch == ' ' ||
+                       (ch >= '\t' && ch <= '\r');
+            }
+#ifdef LM_SSE2
+            static __m128i specials(__m128i v)
+            {
+                return any(attr::specials(v), any(any(eq(v, '`'), eq(v, '=')),
+                                                  any(eq(v, ' '), in(v, '\t', '\r'))));
+            }
+#endif
+            static size_t put(const char *data, size_t i, size_t len, std::string &buffer)
+            {
+                unsigned char ch = (unsigned char)data[i];
+                if (attr::special(ch))
+                    return attr::put(data, i, len, buffer);
+                buffer.append("&#");
+                if (ch >= 10)
+                    buffer.push_back((char)('0' + ch / 10));
+                buffer.push_back((char)('0' + ch % 10));
+                buffer.push_back(';');
+                return i + 1;
+            }
+        };
+
+        inline size_t percent(const char *data, size_t i, std::string &buffer)
+        {
+            unsigned char ch = (unsigned char)data[i];
+            buffer.push_back('%');
+            buffer.push_back(HEX[ch >> 4]);
+            buffer.push_back(HEX[ch & 15]);
+            return i + 1;
+        }
+
+        //what a url keeps: printable ascii, but for quotes, & < > and
+        //the chars rfc 3986 doesn't allow
+        struct url
+        {
+            static bool special(unsigned char ch)
+            {
+                return ch <= ' ' || ch >= 0x7f || ch == '"' || ch == '&' ||
+                       ch == '\'' || ch == '<' || ch == '>' || ch == '\\' ||
+                       ch == '^' || ch == '`' || ch == '{' || ch == '|' || ch == '}';
+            }
+#ifdef LM_SSE2
+            static __m128i specials(__m128i v)
+            {
+                __m128i quotes = any(eq(v, '"'), any(eq(v, '&'), eq(v, '\'')));
+                __m128i tags = any(eq(v, '<'), eq(v, '>'));
+                __m128i rest = any(any(eq(v, '\\'), eq(v, '^')),
+                                   any(eq(v, '`'), in(v, '{', '}')));
+                __m128i printable = in(v, '!', '~');
+                return any(_mm_andnot_si128(printable, _mm_set1_epi8(-1)),
+                           any(quotes, any(tags, rest)));
+            }
+#endif
+            static size_t put(const char *data, size_t i, size_t, std::string &buffer)
+            {
+                if (data[i] != '&')
+                    return percent(data, i, buffer);
+                buffer.append("&amp;");
+                return i + 1;
+            }
+        };
+
+        //javascript:, vbscript: and data: urls. browsers skip leading
+        //spaces and controls, drop tabs and newlines anywhere and take
+        //schemes in any case
+        inline bool unsafe_scheme(const char *data, size_t len)
+        {
+            static const char *schemes[] = {"javascript:", "vbscript:", "data:"};
+            size_t start = 0;
+            while (start < len && (unsigned char)data[start] <= ' ')
+                ++start;
+            for (size_t i = 0; i < sizeof(schemes) / sizeof(schemes[0]); ++i)
+            {
+                const char *scheme = schemes[i];
+                size_t j = start;
+                while (*scheme && j < len)
+                {
+                    char ch = data[j++];
+                    if (ch == '\t' || ch == '\n' || ch == '\r')
+                        continue;
+                    if (ch >= 'A' && ch <= 'Z')
+                        ch = (char)(ch - 'A' + 'a');
+                    if (ch != *scheme)
+                        break;
+                    ++scheme;
+                }
+                if (!*scheme)
+                    return true;
+            }
+            return false;
+        }
+        inline void url_start(const char *data, size_t len, std::string &buffer)
+        {
+            if (unsafe_scheme(data, len))
+                buffer.append("about:invalid");
+            else
+                escape<url>(data, len, buffer);
+        }
+
+        //a query parameter keeps the unreserved chars only
+        struct query
+        {
+            static bool special(unsigned char ch)
+            {
+                return !((ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') ||
+                         (ch >= '0' && ch <= '9') || ch == '-' || ch == '.' ||
+                         ch == '_' || ch == '~');
+            }
+#ifdef LM_SSE2
+            static __m128i specials(__m128i v)
+            {
+                __m128i alnum = any(any(in(v, 'a', 'z'), in(v, 'A', 'Z')), in(v, '0', '9'));
+                __m128i keep = any(alnum, any(any(eq(v, '-'), eq(v, '.')),
+                                              any(eq(v, '_'), eq(v, '~'))));
+                return _mm_andnot_si128(keep, _mm_set1_epi8(-1));
+            }
+#endif
+            static size_t put(const char *data, size_t i, size_t, std::string &buffer)
+            {
+                return percent(data, i, buffer);
+            }
+        };
+
+        //\xHH, and \u2028 \u2029, which end a line in javascript
+        struct js
+        {
+            static bool special(unsigned char ch)
+            {
+                return ch < ' ' || ch == 0x7f || ch == '"' || ch == '\'' ||
+                       ch == '`' || ch == '\\' || ch == '<' || ch == '>' ||
+                       ch == '&' || ch == 0xe2;
+            }
+#ifdef LM_SSE2
+            static __m128i specials(__m128i v)
+            {
+                __m128i quotes = any(eq(v, '"'), any(eq(v, '\''), eq(v, '`')));
+                __m128i rest = any(any(eq(v, '\\'), eq(v, '&')),
+                                   any(eq(v, '<'), eq(v, '>')));
+                __m128i control = any(in(v, 0, 0x1f), eq(v, 0x7f));
+                return any(any(quotes, rest), any(control, eq(v, (char)0xe2)));
+            }
+#endif
+            static size_t put(const char *data, size_t i, size_t len, std::string &buffer)
+            {
+                unsigned char ch = (unsigned char)data[i];
+                if (ch == 0xe2)
+                {
+                    if (i + 2 < len && (unsigned char)data[i + 1] == 0x80 &&
+                        ((unsigned char)data[i + 2] | 1) == 0xa9)
+                    {
+                        buffer.append((unsigned char)data[i + 2] == 0xa8 ? "\\u2028" : "\\u2029");
+                        return i + 3;
+                    }
+                    buffer.push_back(data[i]);
+                    return i + 1;
+                }
+                buffer.append("\\x");
+                buffer.push_back(hex[ch >> 4]);
+                buffer.push_back(hex[ch & 15]);
+                return i + 1;
+            }
+        };
+
+        //\HH followed by a space, which ends the escape
+        struct css
+        {
+            static bool special(unsigned char ch)
+            {
+                return ch < ' ' || ch == 0x7f || ch == '"' || ch == '&' ||
+                       ch == '\'' || ch == '(' || ch == ')' || ch == '+' ||
+                       ch == '/' || ch == ':' || ch == ';' || ch == '<' ||
+                       ch == '>' || ch == '\\' || ch == '{' || ch == '}';
+            }
+#ifdef LM_SSE2
+            static __m128i specials(__m128i v)
+            {
+                __m128i quotes = any(eq(v, '"'), any(eq(v, '&'), eq(v, '\'')));
+                __m128i punct = any(any(in(v, '(', ')'), eq(v, '+')),
+                                    any(eq(v, '/'), in(v, ':', ';')));
+                __m128i rest = any(any(eq(v, '<'), eq(v, '>')),
+                                   any(eq(v, '\\'), any(eq(v, '{'), eq(v, '}'))));
+                __m128i control = any(in(v, 0, 0x1f), eq(v, 0x7f));
+                return any(any(quotes, punct), any(rest, control));
+            }
+#endif
+            static size_t put(const char *data, size_t i, size_t, std::string &buffer)
+            {
+                unsigned char ch = (unsigned char)data[i];
+                buffer.push_back('\\');
+                buffer.push_back(hex[ch >> 4]);
+                buffer.push_back(hex[ch & 15]);
+                buffer.push_back(' ');
+                return i + 1;
+            }
+        };
+    }
+
+    //the escapers by number, as the vm's escape instructions name them
+    typedef enum escape_t
+    {
+        e_escape,
+        e_escape_html,
+        e_escape_unquoted,
+        e_escape_url,
+        e_escape_query,
+        e_escape_js,
+        e_escape_css,
+        e_escape_url_path
+    } escape_t;
+
+    inline const char *escape_name(escape_t kind)
+    {
+        static const char *names[] =
+        {
+            "escape", "escape_html", "escape_unquoted", "escape_url",
+            "escape_query", "escape_js", "escape_css", "escape_url_path"
+        };
+        return names[kind];
+    }
+    inline bool find_escape(const std::string &name, escape_t &kind)
+    {
+        for (int i = e_escape; i <= e_escape_url_path; ++i)
+        {
+            if (name == escape_name((escape_t)i))
+            {
+                kind = (escape_t)i;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    //appends to buffer, saves a temporary per variable
+    inline void escape(escape_t kind, const char *data, size_t len, std::string &buffer)
+    {
+        switch (kind)
+        {
+            case e_escape_html:
+                esc::escape<esc::html>(data, len, buffer);
+                break;
+            case e_escape_unquoted:
+                esc::escape<esc::unquoted>(data, len, buffer);
+                break;
+            case e_escape_url:
+                esc::url_start(data, len, buffer);
+                break;
+            case e_escape_url_path:
+                esc::escape<esc::url>(data, len, buffer);
+                break;
+            case e_escape_query:
+                esc::escape<esc::query>(data, len, buffer);
+                break;
+            case e_escape_js:
+                esc::escape<esc::js>(data, len, buffer);
+                break;
+            case e_escape_css:
+                esc::escape<esc::css>(data, len, buffer);
+                break;
+            default:
+                esc::escape<esc::attr>(data, len, buffer);
+                break;
+        }
+    }
+    inline std::string escape(escape_t kind, const std::string &data)
+    {
+        std::string buffer;
+        escape(kind, data.data(), data.size(), buffer);
+        return buffer;
+    }
+
+    inline void $escape(const char *data, size_t len, std::string &buffer)
+    {
+        esc::escape<esc::attr>(data, len, buffer);
+    }
+    inline std::string $escape(const std::string &data)
+    {
+        std::string buffer;
+        $escape(data.data(), data.size(), buffer);
+        return buffer;
+    }
+#define LM_ESCAPER(name, kernel)                                    \
+    inline std::string name(const std::string &data)                \
+    {                                                               \
+        std::string buffer;                                         \
+        esc::escape<esc::kernel>(data.data(), data.size(), buffer); \
+        return buffer;                                              \
+    }
+    LM_ESCAPER($escape_html, html)
+    LM_ESCAPER($escape_unquoted, unquoted)
+    LM_ESCAPER($escape_url_path, url)
+    LM_ESCAPER($escape_query, query)
+    LM_ESCAPER($escape_js, js)
+    LM_ESCAPER($escape_css, css)
+#undef LM_ESCAPER
+    inline std::string $escape_url(const std::string &data)
+    {
+        std::string buffer;
+        esc::url_start(data.data(), data.size(), buffer);
+        return buffer;
+    }
+}
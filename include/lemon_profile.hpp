@@ -0,0 +1,60 @@
+#pragma once
+#include <string>
+#include <cstdio>
+
+// branch counters of templates compiled with `lemon --instrument`. run
+// the instrumented build under load and write the counts:
+//
+//   lm::write_profile("templates.profile");
+//
+// then compile again with `lemon --profile templates.profile`. several
+// profiles are added up. the counts are not atomic, a few updates lost
+// between threads don't change what the profile says.
+namespace lm
+{
+    //the counters of one template function
+    struct profile_t
+    {
+        const char *name_;
+        //the tree the counters belong to, checked by lemon
+        const char *hash_;
+        unsigned long long renders_;
+        unsigned long long bytes_;
+        unsigned long long *counts_;
+        size_t size_;
+        profile_t *next_;
+    };
+
+    inline profile_t *&profiles()
+    {
+        static profile_t *head = NULL;
+        return head;
+    }
+
+    //links a template's counters, at static initialization
+    struct profile_link
+    {
+        profile_link(profile_t &profile)
+        {
+            profile.next_ = profiles();
+            profiles() = &profile;
+        }
+    };
+
+    //a line per template: name hash renders bytes size counts...
+    inline bool write_profile(const std::string &file_path)
+    {
+        FILE *file = fopen(file_path.c_str(), "w");
+        if (!file)
+            return false;
+        for (profile_t *p = profiles(); p; p = p->next_)
+        {
+            fprintf(file, "%s %s %llu %llu %lu", p->name_, p->hash_,
+                    p->renders_, p->bytes_, (unsigned long)p->size_);
+            for (size_t i = 0; i < p->size_; ++i)
+                fprintf(file, " %llu", p->counts_[i]);
+            fprintf(file, "\n");
+        }
+        return fclose(file) == 0;
+    }
+}
@@ -0,0 +1,69 @@
+#pragma once
+#include <string>
+#include <cstring>
+
+// templates by name, from the translation unit written by
+// `lemon --registry registry.cpp`. link it with the generated templates:
+//
+//   const lm::entry_t *page = lm::find_template("page_a");
+//   const void *args[] = {&user, &title};
+//   std::string html;
+//   if (page && page->size_ == 2)
+//       page->render_(args, html);
+//
+// args point to the parameters in interface order, params_ names their
+// types. the lookup is one hash into a perfect hash table that lemon
+// builds for the template names, and one string compare.
+namespace lm
+{
+    typedef void (*render_t)(const void *const *args, std::string &out);
+
+    struct param_t
+    {
+        const char *name_;
+        const char *type_;
+    };
+
+    struct entry_t
+    {
+        const char *name_;
+        const char *signature_;
+        render_t render_;
+        const param_t *params_;
+        size_t size_;
+    };
+
+    //NULL for an unknown name
+    const entry_t *find_template(const char *name, size_t len);
+    //every template, in table order
+    const entry_t *templates(size_t &size);
+
+    inline const entry_t *find_template(const std::string &name)
+    {
+        return find_template(name.c_str(), name.size());
+    }
+
+    //the hash and slot functions lemon builds the table with
+    inline unsigned long long name_hash(const char *name, size_t len,
+                                        unsigned int seed)
+    {
+        unsigned long long hash = 14695981039346656037ULL ^ seed;
+        for (size_t i = 0; i < len; ++i)
+        {
+            hash ^= (unsigned char)name[i];
+            hash *= 1099511628211ULL;
+        }
+        return hash;
+    }
+    inline size_t name_slot(unsigned long long hash, unsigned int displace,
+                            size_t size)
+    {
+        unsigned int x = (unsigned int)(hash >> 32) ^ (displace * 0x9e3779b9u);
+        x ^= x >> 16;
+        x *= 0x85ebca6bu;
+        x ^= x >> 13;
+        x *= 0xc2b2ae35u;
+        x ^= x >> 16;
+        return x % size;
+    }
+}
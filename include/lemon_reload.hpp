@@ -0,0 +1,381 @@
+#pragma once
+#include <map>
+#include <string>
+#include <cstdio>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#include <pthread.h>
+#include <unistd.h>
+#endif
+#include "lemon.hpp"
+
+// templates compiled into a shared object that can be replaced at run
+// time. build one from the generated code, eg
+//
+//   g++ -shared -fPIC -o templates.so *.lm.cpp
+//
+// and render through a reader:
+//
+//   lm::reloader templates("templates.so");
+//   templates.reload();
+//   ...
+//   lm::reloader::reader r(templates);
+//   page_fn page = r.get<page_fn>("page");
+//   std::string html = page(user, title);
+//
+// reload() loads a newer object and swaps it in. the old one is closed
+// once the readers that may still use it are gone, like RCU: readers
+// never block and never see a half loaded object. the view model
+// headers of the object and of the process have to be the same.
+namespace lm
+{
+    class reloader
+    {
+    public:
+        //a loaded object and the templates resolved from it
+        struct version
+        {
+            version()
+                :handle_(NULL)
+            {
+                init_lock();
+            }
+            ~version()
+            {
+                if (handle_)
+                {
+#ifdef _WIN32
+                    FreeLibrary((HMODULE)handle_);
+                    DeleteFileA(path_.c_str());
+#else
+                    dlclose(handle_);
+#endif
+                }
+                free_lock();
+            }
+            const export_t *find(const std::string &name)
+            {
+                lock();
+                const export_t *e = NULL;
+                std::map<std::string, const export_t *>::iterator it;
+                it = exports_.find(name);
+                if (it != exports_.end())
+                    e = it->second;
+                else
+                {
+                    std::string symbol = "lm_template_" + name;
+#ifdef _WIN32
+                    e = (const export_t *)GetProcAddress((HMODULE)handle_,
+                                                         symbol.c_str());
+#else
+                    e = (const export_t *)dlsym(handle_, symbol.c_str());
+#endif
+                    exports_[name] = e;
+                }
+                unlock();
+                return e;
+            }
+
+            void *handle_;
+            std::string path_;
+            std::map<std::string, const export_t *> exports_;
+        private:
+#ifdef _WIN32
+            void init_lock() { InitializeCriticalSection(&lock_); }
+            void free_lock() { DeleteCriticalSection(&lock_); }
+            void lock() { EnterCriticalSection(&lock_); }
+            void unlock() { LeaveCriticalSection(&lock_); }
+            CRITICAL_SECTION lock_;
+#else
+            void init_lock() { pthread_mutex_init(&lock_, NULL); }
+            void free_lock() { pthread_mutex_destroy(&lock_); }
+            void lock() { pthread_mutex_lock(&lock_); }
+            void unlock() { pthread_mutex_unlock(&lock_); }
+            pthread_mutex_t lock_;
+#endif
+            version(const version &);
+            version &operator =(const version &);
+        };
+
+        //read side critical section, the version it sees stays
+        //loaded until the reader is destroyed.
+        class reader
+        {
+        public:
+            reader(reloader &r)
+                :reloader_(r)
+            {
+                index_ = r.read_lock();
+                version_ = (version *)atomic_load((void *const *)&r.current_);
+            }
+            ~reader()
+            {
+                reloader_.read_unlock(index_);
+            }
+            //NULL when nothing is loaded or the object has no such template
+            template<class F>
+            F get(const std::string &name) const
+            {
+                if (!version_)
+                    return NULL;
+                const export_t *e = version_->find(name);
+                if (!e)
+                    return NULL;
+                return (F)e->function_;
+            }
+            //the interface line of the template, to check against F
+            std::string signature(const std::string &name) const
+            {
+                if (!version_)
+                    return std::string();
+                const export_t *e = version_->find(name);
+                return e ? e->signature_ : std::string();
+            }
+        private:
+            reader(const reader &);
+            reader &operator =(const reader &);
+
+            reloader &reloader_;
+            version *version_;
+            int index_;
+        };
+
+        reloader(const std::string &file_path)
+            :file_path_(file_path),
+             current_(NULL),
+             index_(0),
+             loads_(0),
+             mtime_(0),
+             size_(0)
+        {
+            readers_[0] = 0;
+            readers_[1] = 0;
+#ifdef _WIN32
+            InitializeCriticalSection(&writer_);
+#else
+            pthread_mutex_init(&writer_, NULL);
+#endif
+        }
+        //no reader may be left
+        ~reloader()
+        {
+            delete current_;
+#ifdef _WIN32
+            DeleteCriticalSection(&writer_);
+#else
+            pthread_mutex_destroy(&writer_);
+#endif
+        }
+        //load the object if it changed since the last load, false when
+        //it can't be loaded, the current version stays in use then.
+        bool reload()
+        {
+            writer_lock();
+            bool ok = true;
+            long long mtime = 0;
+            long long size = 0;
+            if (!stat_file(mtime, size))
+                ok = false;
+            else if (!current_ || mtime != mtime_ || size != size_)
+            {
+                version *v = open();
+                if (!v)
+                    ok = false;
+                else
+                {
+                    mtime_ = mtime;
+                    size_ = size;
+                    version *old = (version *)atomic_swap((void **)&current_, v);
+                    synchronize();
+                    delete old;
+                }
+            }
+            writer_unlock();
+            return ok;
+        }
+    private:
+        reloader(const reloader &);
+        reloader &operator =(const reloader &);
+
+        static void *atomic_load(void *const *ptr)
+        {
+#ifdef _WIN32
+            return InterlockedCompareExchangePointer((void **)ptr, NULL, NULL);
+#else
+            return __sync_val_compare_and_swap((void **)ptr, (void *)NULL,
+                                               (void *)NULL);
+#endif
+        }
+        static void *atomic_swap(void **ptr, void *value)
+        {
+#ifdef _WIN32
+            return InterlockedExchangePointer(ptr, value);
+#else
+            void *old;
+            do
+            {
+                old = *ptr;
+            } while (!__sync_bool_compare_and_swap(ptr, old, value));
+            return old;
+#endif
+        }
+        static long atomic_add(volatile long *value, long delta)
+        {
+#ifdef _WIN32
+            return InterlockedExchangeAdd(value, delta) + delta;
+#else
+            return __sync_add_and_fetch(value, delta);
+#endif
+        }
+        int read_lock()
+        {
+            int index = (int)atomic_add(&index_, 0) & 1;
+            atomic_add(&readers_[index], 1);
+            return index;
+        }
+        void read_unlock(int index)
+        {
+            atomic_add(&readers_[index], -1);
+        }
+        //wait for the readers that may have seen the old version. new
+        //readers count on the other side of the flip and see the new
+        //one. flipping twice also drains readers that read the index
+        //before an earlier flip and counted late.
+        void synchronize()
+        {
+            for (int i = 0; i < 2; ++i)
+            {
+                long index = atomic_add(&index_, 1) - 1;
+                while (atomic_add(&readers_[index & 1], 0) != 0)
+                {
+#ifdef _WIN32
+                    Sleep(1);
+#else
+                    usleep(1000);
+#endif
+                }
+            }
+        }
+        bool stat_file(long long &mtime, long long &size)
+        {
+#ifdef _WIN32
+            struct _stat st;
+            if (_stat(file_path_.c_str(), &st) != 0)
+                return false;
+#else
+            struct stat st;
+            if (stat(file_path_.c_str(), &st) != 0)
+                return false;
+#endif
+            mtime = (long long)st.st_mtime;
+            size = (long long)st.st_size;
+            return true;
+        }
+        //a private copy, the loader would hand out the loaded object
+        //again for the same path, and the build may rewrite the file
+        //while it is mapped.
+        version *open()
+        {
+            char suffix[64];
+            snprintf(suffix, sizeof(suffix), ".%d.%d", (int)getpid_(), ++loads_);
+            std::string path = file_path_ + suffix;
+            if (!copy_file(file_path_, path))
+                return NULL;
+
+            version *v = new version;
+            v->path_ = path;
+#ifdef _WIN32
+            v->handle_ = LoadLibraryA(path.c_str());
+            if (!v->handle_)
+            {
+                DeleteFileA(path.c_str());
+                delete v;
+                return NULL;
+            }
+#else
+            //without a slash dlopen searches the library path
+            if (path.find('/') == std::string::npos)
+                path = "./" + path;
+            v->handle_ = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+            //the mapping stays valid, nothing to clean up later
+            unlink(path.c_str());
+            if (!v->handle_)
+            {
+                delete v;
+                return NULL;
+            }
+#endif
+            return v;
+        }
+        static long getpid_()
+        {
+#ifdef _WIN32
+            return (long)GetCurrentProcessId();
+#else
+            return (long)getpid();
+#endif
+        }
+        static bool copy_file(const std::string &from, const std::string &to)
+        {
+            FILE *in = fopen(from.c_str(), "rb");
+            if (!in)
+                return false;
+            FILE *out = fopen(to.c_str(), "wb");
+            if (!out)
+            {
+                fclose(in);
+                return false;
+            }
+            char buffer[64 * 1024];
+            size_t len;
+            bool ok = true;
+            while ((len = fread(buffer, 1, sizeof(buffer), in)) > 0)
+            {
+                if (fwrite(buffer, 1, len, out) != len)
+                {
+                    ok = false;
+                    break;
+                }
+            }
+            fclose(in);
+            if (fclose(out) != 0)
+                ok = false;
+            if (!ok)
+                remove(to.c_str());
+            return ok;
+        }
+        void writer_lock()
+        {
+#ifdef _WIN32
+            EnterCriticalSection(&writer_);
+#else
+            pthread_mutex_lock(&writer_);
+#endif
+        }
+        void writer_unlock()
+        {
+#ifdef _WIN32
+            LeaveCriticalSection(&writer_);
+#else
+            pthread_mutex_unlock(&writer_);
+#endif
+        }
+
+        std::string file_path_;
+        version *volatile current_;
+        volatile long index_;
+        volatile long readers_[2];
+        int loads_;
+        long long mtime_;
+        long long size_;
+#ifdef _WIN32
+        CRITICAL_SECTION writer_;
+#else
+        pthread_mutex_t writer_;
+#endif
+    };
+}
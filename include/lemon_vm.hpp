@@ -0,0 +1,1362 @@
+#pragma once
+#include <map>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include "lemon.hpp"
+
+// bytecode backend. `lemon --vm` lowers a template to a program instead
+// of C++, vm::program renders it against the view model through the
+// reflection tables `lemon --reflect` generates from the same headers.
+// the program calls the lm::$ functions of lemon.hpp, so its output
+// is byte for byte the output of the compiled template.
+namespace lm
+{
+namespace vm
+{
+    typedef enum kind_t
+    {
+        k_int,
+        k_uint,
+        k_double,
+        k_string,
+        k_object,
+        k_list,
+        k_map
+    } kind_t;
+
+    struct type_t;
+    struct accessor
+    {
+        virtual ~accessor() {}
+        virtual const void *get(const void *obj) const = 0;
+    };
+    //types are looked up on first use, a class may hold a
+    //container of itself.
+    typedef const type_t *(*type_fn)();
+
+    struct field_t
+    {
+        const char *name_;
+        type_fn type_;
+        const accessor *get_;
+    };
+
+    struct type_t
+    {
+        std::string name_;
+        kind_t kind_;
+
+        //k_int, k_uint, k_double
+        long long (*int_)(const void *obj);
+        unsigned long long (*uint_)(const void *obj);
+        double (*double_)(const void *obj);
+        //every scalar, lm::$to_string for numbers
+        void (*to_string_)(const void *obj, std::string &buffer);
+
+        //k_string
+        const char *(*data_)(const void *obj);
+        //k_string, k_list, k_map
+        size_t (*size_)(const void *obj);
+
+        //k_list, k_map. value of map is the mapped value
+        type_fn key_;
+        type_fn value_;
+        void *(*begin_)(const void *obj);
+        bool (*next_)(void *it, const void **key, const void **value);
+        void (*free_)(void *it);
+
+        //k_object
+        std::vector<field_t> fields_;
+
+        const field_t *field(const std::string &name) const
+        {
+            for (size_t i = 0; i < fields_.size(); ++i)
+            {
+                if (name == fields_[i].name_)
+                    return &fields_[i];
+            }
+            return NULL;
+        }
+    };
+
+    inline type_t make_type(const std::string &name, kind_t kind)
+    {
+        type_t t;
+        t.name_ = name;
+        t.kind_ = kind;
+        t.int_ = NULL;
+        t.uint_ = NULL;
+        t.double_ = NULL;
+        t.to_string_ = NULL;
+        t.data_ = NULL;
+        t.size_ = NULL;
+        t.key_ = NULL;
+        t.value_ = NULL;
+        t.begin_ = NULL;
+        t.next_ = NULL;
+        t.free_ = NULL;
+        return t;
+    }
+
+    //specialized for every type a template can reach,
+    //lemon --reflect writes the ones of the view model classes.
+    template<class T>
+    struct reflect;
+
+    template<class C, class B, class F>
+    struct member_accessor: accessor
+    {
+        member_accessor(F B::*member)
+            :member_(member)
+        {
+
+        }
+        virtual const void *get(const void *obj) const
+        {
+            return &(static_cast<const C *>(obj)->*member_);
+        }
+        F B::*member_;
+    };
+    //field of C, B is C or the base class declaring it
+    template<class C, class B, class F>
+    inline field_t make_field(const char *name, F B::*member)
+    {
+        field_t f;
+        f.name_ = name;
+        f.type_ = reflect<F>::type;
+        f.get_ = new member_accessor<C, B, F>(member);
+        return f;
+    }
+
+    template<class T>
+    struct scalar
+    {
+        static long long int_(const void *obj)
+        {
+            return (long long)*static_cast<const T *>(obj);
+        }
+        static unsigned long long uint_(const void *obj)
+        {
+            return (unsigned long long)*static_cast<const T *>(obj);
+        }
+        static double double_(const void *obj)
+        {
+            return (double)*static_cast<const T *>(obj);
+        }
+        static void to_string_(const void *obj, std::string &buffer)
+        {
+            buffer.append(lm::$to_string(*static_cast<const T *>(obj)));
+        }
+        static type_t make(const char *name, kind_t kind)
+        {
+            type_t t = make_type(name, kind);
+            t.int_ = int_;
+            t.uint_ = uint_;
+            t.double_ = double_;
+            t.to_string_ = to_string_;
+            return t;
+        }
+        static const type_t *type(const char *name, kind_t kind)
+        {
+            static const type_t t = make(name, kind);
+            return &t;
+        }
+    };
+
+#define LM_VM_SCALAR(T, KIND)                       \
+    template<>                                      \
+    struct reflect<T>                               \
+    {                                               \
+        static const type_t *type()                 \
+        {                                           \
+            static const type_t *t =                \
+                scalar<T>::type(#T, KIND);          \
+            return t;                               \
+        }                                           \
+    };
+
+    LM_VM_SCALAR(bool, k_int)
+    LM_VM_SCALAR(char, k_int)
+    LM_VM_SCALAR(unsigned char, k_uint)
+    LM_VM_SCALAR(short, k_int)
+    LM_VM_SCALAR(unsigned short, k_uint)
+    LM_VM_SCALAR(int, k_int)
+    LM_VM_SCALAR(unsigned int, k_uint)
+    LM_VM_SCALAR(long, k_int)
+    LM_VM_SCALAR(unsigned long, k_uint)
+    LM_VM_SCALAR(long long, k_int)
+    LM_VM_SCALAR(unsigned long long, k_uint)
+    LM_VM_SCALAR(float, k_double)
+    LM_VM_SCALAR(double, k_double)
+
+#undef LM_VM_SCALAR
+
+    template<>
+    struct reflect<std::string>
+    {
+        static const char *data_(const void *obj)
+        {
+            return static_cast<const std::string *>(obj)->c_str();
+        }
+        static size_t size_(const void *obj)
+        {
+            return static_cast<const std::string *>(obj)->size();
+        }
+        static type_t make()
+        {
+            type_t t = make_type("std::string", k_string);
+            t.data_ = data_;
+            t.size_ = size_;
+            return t;
+        }
+        static const type_t *type()
+        {
+            static const type_t t = make();
+            return &t;
+        }
+    };
+
+    template<>
+    struct reflect<lm::safe_string>
+    {
+        static const char *data_(const void *obj)
+        {
+            return static_cast<const lm::safe_string *>(obj)->c_str();
+        }
+        static size_t size_(const void *obj)
+        {
+            return static_cast<const lm::safe_string *>(obj)->size();
+        }
+        static type_t make()
+        {
+            type_t t = make_type("lm::safe_string", k_string);
+            t.data_ = data_;
+            t.size_ = size_;
+            return t;
+        }
+        static const type_t *type()
+        {
+            static const type_t t = make();
+            return &t;
+        }
+    };
+
+    //value of a list or set entry, key and value of a map entry
+    template<bool MAP>
+    struct entry
+    {
+        template<class I>
+        static void get(const I &it, const void **k, const void **v)
+        {
+            *k = NULL;
+            *v = &*it;
+        }
+    };
+    template<>
+    struct entry<true>
+    {
+        template<class I>
+        static void get(const I &it, const void **k, const void **v)
+        {
+            *k = &it->first;
+            *v = &it->second;
+        }
+    };
+
+    //std::vector, std::list, std::set and std::map
+    template<class T, class K, class V, bool MAP>
+    struct container
+    {
+        typedef typename T::const_iterator iterator;
+        struct cursor
+        {
+            iterator it_;
+            iterator end_;
+        };
+        static size_t size_(const void *obj)
+        {
+            return static_cast<const T *>(obj)->size();
+        }
+        static void *begin_(const void *obj)
+        {
+            const T *items = static_cast<const T *>(obj);
+            cursor *c = new cursor;
+            c->it_ = items->begin();
+            c->end_ = items->end();
+            return c;
+        }
+        static bool next_(void *it, const void **k, const void **v)
+        {
+            cursor *c = static_cast<cursor *>(it);
+            if (c->it_ == c->end_)
+                return false;
+            entry<MAP>::get(c->it_, k, v);
+            ++c->it_;
+            return true;
+        }
+        static void free_(void *it)
+        {
+            delete static_cast<cursor *>(it);
+        }
+        static type_t make(const std::string &name)
+        {
+            type_t t = make_type(name, MAP ? k_map : k_list);
+            t.size_ = size_;
+            t.key_ = MAP ? reflect<K>::type : NULL;
+            t.value_ = reflect<V>::type;
+            t.begin_ = begin_;
+            t.next_ = next_;
+            t.free_ = free_;
+            return t;
+        }
+        static const type_t *type(const std::string &name)
+        {
+            static const type_t t = make(name);
+            return &t;
+        }
+    };
+
+    template<class T>
+    struct reflect<std::vector<T> >
+    {
+        static const type_t *type()
+        {
+            static const type_t *t = container<std::vector<T>, T, T, false>::
+                type("std::vector<" + reflect<T>::type()->name_ + ">");
+            return t;
+        }
+    };
+    template<class T>
+    struct reflect<std::list<T> >
+    {
+        static const type_t *type()
+        {
+            static const type_t *t = container<std::list<T>, T, T, false>::
+                type("std::list<" + reflect<T>::type()->name_ + ">");
+            return t;
+        }
+    };
+    template<class T>
+    struct reflect<std::set<T> >
+    {
+        static const type_t *type()
+        {
+            static const type_t *t = container<std::set<T>, T, T, false>::
+                type("std::set<" + reflect<T>::type()->name_ + ">");
+            return t;
+        }
+    };
+    template<class K, class V>
+    struct reflect<std::map<K, V> >
+    {
+        static const type_t *type()
+        {
+            static const type_t *t = container<std::map<K, V>, K, V, true>::
+                type("std::map<" + reflect<K>::type()->name_ + "," +
+                     reflect<V>::type()->name_ + ">");
+            return t;
+        }
+    };
+
+    //view model classes by name, for linking programs
+    inline std::map<std::string, const type_t *> &types()
+    {
+        static std::map<std::string, const type_t *> types;
+        return types;
+    }
+    inline void add_type(const type_t *type)
+    {
+        types()[type->name_] = type;
+    }
+    inline const type_t *find_type(const std::string &name)
+    {
+        std::map<std::string, const type_t *>::const_iterator it;
+        it = types().find(name);
+        if (it == types().end())
+            return NULL;
+        return it->second;
+    }
+
+    //an argument of render(), the object has to outlive the call
+    struct arg_t
+    {
+        const type_t *type_;
+        const void *ptr_;
+    };
+    template<class T>
+    inline arg_t arg(const T &obj)
+    {
+        arg_t a;
+        a.type_ = reflect<T>::type();
+        a.ptr_ = &obj;
+        return a;
+    }
+
+    typedef enum op_t
+    {
+        op_text,           // out += literal c
+        op_emit,           // out += a
+        op_emit_escape,    // out += escape c(a), c an lm::escape_t
+        op_field,          // a = b.symbol c
+        op_str,            // a = literal c
+        op_num,            // a = number c
+        op_escape,         // a = escape c(b)
+        op_default,        // a = default(b, literal c)
+        op_length,         // a = length(b)
+        op_to_string,      // a = to_string(b)
+        op_test_empty,     // a = !b.empty()
+        op_test_zero,      // a = b != 0
+        op_cmp,            // a = b (c >> 16) c & 0xffff
+        op_not,            // a = !b
+        op_and,            // a = b && c
+        op_or,             // a = b || c
+        op_jump,           // goto c
+        op_jump_false,     // if !a goto c
+        op_jump_true,      // if a goto c
+        op_iter,           // a = cursor over b
+        op_next,           // b = next value of a, at the end goto c
+        op_next_kv,        // b, b+1 = next key, value of a, at the end goto c
+        op_end,            // free cursor a
+        op_ret
+    } op_t;
+
+    typedef enum cmp_t
+    {
+        cmp_eq,
+        cmp_neq,
+        cmp_less,
+        cmp_le,
+        cmp_gt,
+        cmp_ge
+    } cmp_t;
+
+    struct instr_t
+    {
+        unsigned char op_;
+        unsigned char a_;
+        unsigned short b_;
+        unsigned int c_;
+    };
+
+    // .lmc artifact, rendered in place from a read-only mapping:
+    //
+    // header_t
+    // instr_t   code[]
+    // number_t  numbers[]
+    // str_t     params[], literals[]
+    // symbol_t  symbols[]   fields linked by name at load time
+    // dep_t     deps[]      inputs and their hashes when compiled
+    // char      strings[]   every str_t points in here
+    //
+    // sections are 8 byte aligned, integers in the byte order of the
+    // compiling machine, which endian_ records.
+    struct str_t
+    {
+        unsigned int offset_;
+        unsigned int len_;
+    };
+    struct number_t
+    {
+        long long int_;
+        double double_;
+        unsigned int is_double_;
+        unsigned int pad_;
+    };
+    struct symbol_t
+    {
+        str_t type_;
+        str_t field_;
+    };
+    struct dep_t
+    {
+        str_t path_;
+        //64 bit FNV-1a of the file
+        unsigned long long hash_;
+    };
+    struct section_t
+    {
+        unsigned int offset_;
+        unsigned int count_;
+    };
+    struct header_t
+    {
+        char magic_[4];
+        unsigned int version_;
+        unsigned int endian_;
+        unsigned int size_;
+        unsigned int registers_;
+        str_t name_;
+        section_t code_;
+        section_t numbers_;
+        section_t params_;
+        section_t literals_;
+        section_t symbols_;
+        section_t deps_;
+        section_t strings_;
+    };
+    static const unsigned int lmc_version = 2;
+    static const unsigned int lmc_endian = 0x01020304;
+
+    inline unsigned long long fnv1a(const char *data, size_t len,
+                                    unsigned long long hash = 14695981039346656037ULL)
+    {
+        for (size_t i = 0; i < len; ++i)
+        {
+            hash ^= (unsigned char)data[i];
+            hash *= 1099511628211ULL;
+        }
+        return hash;
+    }
+
+    //the compiler side, lays a program out as an artifact
+    class builder
+    {
+    public:
+        builder()
+            :registers_(0)
+        {
+
+        }
+        str_t str(const std::string &data)
+        {
+            std::map<std::string, str_t>::iterator it = strings_.find(data);
+            if (it != strings_.end())
+                return it->second;
+            str_t s;
+            s.offset_ = (unsigned int)blob_.size();
+            s.len_ = (unsigned int)data.size();
+            blob_.append(data);
+            strings_[data] = s;
+            return s;
+        }
+        unsigned int literal(const std::string &data)
+        {
+            return index(literals_index_, literals_, data);
+        }
+        unsigned int number(const std::string &data)
+        {
+            number_t n;
+            memset(&n, 0, sizeof(n));
+            if (data.find('.') != std::string::npos)
+            {
+                n.is_double_ = 1;
+                n.double_ = strtod(data.c_str(), NULL);
+            }
+            else
+                n.int_ = strtoll(data.c_str(), NULL, 10);
+            numbers_.push_back(n);
+            return (unsigned int)numbers_.size() - 1;
+        }
+        unsigned int symbol(const std::string &type, const std::string &field)
+        {
+            std::string key = type + "::" + field;
+            std::map<std::string, unsigned int>::iterator it;
+            it = symbols_index_.find(key);
+            if (it != symbols_index_.end())
+                return it->second;
+            symbol_t sym;
+            sym.type_ = str(type);
+            sym.field_ = str(field);
+            symbols_.push_back(sym);
+            symbols_index_[key] = (unsigned int)symbols_.size() - 1;
+            return symbols_index_[key];
+        }
+        void param(const std::string &type)
+        {
+            params_.push_back(str(type));
+        }
+        void dep(const std::string &path, unsigned long long hash)
+        {
+            dep_t d;
+            d.path_ = str(path);
+            d.hash_ = hash;
+            deps_.push_back(d);
+        }
+        void save(std::string &data) const
+        {
+            header_t h;
+            memset(&h, 0, sizeof(h));
+            memcpy(h.magic_, "LMC", 4);
+            h.version_ = lmc_version;
+            h.endian_ = lmc_endian;
+            //ops without operands still name register 0
+            h.registers_ = registers_ ? (unsigned int)registers_ : 1;
+            h.name_ = name_;
+
+            data.assign(sizeof(h), '\0');
+            append(data, h.code_, code_);
+            append(data, h.numbers_, numbers_);
+            append(data, h.params_, params_);
+            append(data, h.literals_, literals_);
+            append(data, h.symbols_, symbols_);
+            append(data, h.deps_, deps_);
+            align(data);
+            h.strings_.offset_ = (unsigned int)data.size();
+            h.strings_.count_ = (unsigned int)blob_.size();
+            data.append(blob_);
+            h.size_ = (unsigned int)data.size();
+            memcpy(&data[0], &h, sizeof(h));
+        }
+
+        str_t name_;
+        int registers_;
+        std::vector<instr_t> code_;
+    private:
+        static void align(std::string &data)
+        {
+            data.append((8 - data.size() % 8) % 8, '\0');
+        }
+        template<class T>
+        static void append(std::string &data, section_t &section,
+                           const std::vector<T> &items)
+        {
+            align(data);
+            section.offset_ = (unsigned int)data.size();
+            section.count_ = (unsigned int)items.size();
+            if (!items.empty())
+                data.append((const char *)&items[0], items.size() * sizeof(T));
+        }
+        unsigned int index(std::map<std::string, unsigned int> &index,
+                           std::vector<str_t> &items, const std::string &data)
+        {
+            std::map<std::string, unsigned int>::iterator it = index.find(data);
+            if (it != index.end())
+                return it->second;
+            items.push_back(str(data));
+            index[data] = (unsigned int)items.size() - 1;
+            return index[data];
+        }
+
+        std::string blob_;
+        std::map<std::string, str_t> strings_;
+        std::vector<number_t> numbers_;
+        std::vector<str_t> params_;
+        std::vector<str_t> literals_;
+        std::map<std::string, unsigned int> literals_index_;
+        std::vector<symbol_t> symbols_;
+        std::map<std::string, unsigned int> symbols_index_;
+        std::vector<dep_t> deps_;
+    };
+
+    //a register, an object of the view model or a computed value
+    struct value_t
+    {
+        value_t()
+            :type_(NULL),
+             ptr_(NULL),
+             kind_(k_int),
+             int_(0),
+             double_(0),
+             it_(NULL),
+             iter_type_(NULL)
+        {
+
+        }
+        ~value_t()
+        {
+            if (it_)
+                iter_type_->free_(it_);
+        }
+        void set_int(long long value)
+        {
+            type_ = NULL;
+            kind_ = k_int;
+            int_ = value;
+        }
+        void set_uint(unsigned long long value)
+        {
+            type_ = NULL;
+            kind_ = k_uint;
+            int_ = (long long)value;
+        }
+        void set_string()
+        {
+            type_ = NULL;
+            kind_ = k_string;
+            str_.clear();
+        }
+
+        //NULL for computed values
+        const type_t *type_;
+        const void *ptr_;
+        kind_t kind_;
+        long long int_;
+        double double_;
+        std::string str_;
+
+        void *it_;
+        const type_t *iter_type_;
+    private:
+        value_t(const value_t &);
+        value_t &operator =(const value_t &);
+    };
+
+    class program
+    {
+    public:
+        program()
+            :header_(NULL),
+             map_(NULL),
+             map_size_(0)
+        {
+
+        }
+        ~program()
+        {
+            unmap();
+        }
+        //data is used in place and has to outlive the program
+        bool load(const char *data, size_t len)
+        {
+            unmap();
+            fields_.clear();
+            header_ = NULL;
+            if (len < sizeof(header_t) || (size_t)data % 8)
+                return false;
+            const header_t *h = (const header_t *)data;
+            if (memcmp(h->magic_, "LMC", 4) != 0 ||
+                h->version_ != lmc_version ||
+                h->endian_ != lmc_endian ||
+                h->size_ != len)
+                return false;
+            base_ = data;
+            header_ = h;
+            if (!section(h->code_, sizeof(instr_t)) ||
+                !section(h->numbers_, sizeof(number_t)) ||
+                !section(h->params_, sizeof(str_t)) ||
+                !section(h->literals_, sizeof(str_t)) ||
+                !section(h->symbols_, sizeof(symbol_t)) ||
+                !section(h->deps_, sizeof(dep_t)) ||
+                !section(h->strings_, 1) ||
+                !verify())
+            {
+                header_ = NULL;
+                return false;
+            }
+            code_ = (const instr_t *)(data + h->code_.offset_);
+            numbers_ = (const number_t *)(data + h->numbers_.offset_);
+            params_ = (const str_t *)(data + h->params_.offset_);
+            literals_ = (const str_t *)(data + h->literals_.offset_);
+            symbols_ = (const symbol_t *)(data + h->symbols_.offset_);
+            deps_ = (const dep_t *)(data + h->deps_.offset_);
+            strings_ = data + h->strings_.offset_;
+            return true;
+        }
+        //maps the artifact read-only, processes share its pages
+        bool open(const std::string &file_path)
+        {
+            unmap();
+            const char *data = NULL;
+            size_t len = 0;
+#ifdef _WIN32
+            HANDLE file = CreateFileA(file_path.c_str(), GENERIC_READ,
+                                      FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                                      FILE_ATTRIBUTE_NORMAL, NULL);
+            if (file == INVALID_HANDLE_VALUE)
+                return false;
+            len = (size_t)GetFileSize(file, NULL);
+            HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY,
+                                                0, 0, NULL);
+            CloseHandle(file);
+            if (!mapping)
+                return false;
+            data = (const char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(mapping);
+            if (!data)
+                return false;
+#else
+            int fd = ::open(file_path.c_str(), O_RDONLY);
+            if (fd < 0)
+                return false;
+            struct stat st;
+            if (fstat(fd, &st) != 0 || st.st_size == 0)
+            {
+                close(fd);
+                return false;
+            }
+            len = (size_t)st.st_size;
+            void *addr = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+            close(fd);
+            if (addr == MAP_FAILED)
+                return false;
+            data = (const char *)addr;
+#endif
+            if (!load(data, len))
+            {
+                map_ = (void *)data;
+                map_size_ = len;
+                unmap();
+                return false;
+            }
+            map_ = (void *)data;
+            map_size_ = len;
+            return true;
+        }
+        bool link(std::string &error)
+        {
+            fields_.clear();
+            if (!header_)
+            {
+                error = "no program loaded";
+                return false;
+            }
+            for (unsigned int i = 0; i < header_->symbols_.count_; ++i)
+            {
+                std::string type = str(symbols_[i].type_);
+                std::string name = str(symbols_[i].field_);
+                const type_t *t = find_type(type);
+                if (!t)
+                {
+                    error = "unknown type " + type;
+                    return false;
+                }
+                const field_t *f = t->field(name);
+                if (!f)
+                {
+                    error = "unknown field " + type + "::" + name;
+                    return false;
+                }
+                fields_.push_back(f);
+            }
+            return true;
+        }
+        //args in the order of the template interface
+        bool render(const std::vector<arg_t> &args, std::string &out) const;
+
+        std::string name() const
+        {
+            return header_ ? str(header_->name_) : std::string();
+        }
+        size_t deps() const
+        {
+            return header_ ? header_->deps_.count_ : 0;
+        }
+        std::string dep_path(size_t index) const
+        {
+            return str(deps_[index].path_);
+        }
+        unsigned long long dep_hash(size_t index) const
+        {
+            return deps_[index].hash_;
+        }
+        //an input changed since the artifact was compiled
+        bool stale() const
+        {
+            for (size_t i = 0; i < deps(); ++i)
+            {
+                std::ifstream file(dep_path(i).c_str(),
+                                   std::ios::in | std::ios::binary);
+                if (!file.good())
+                    return true;
+                std::ostringstream buffer;
+                buffer << file.rdbuf();
+                std::string data = buffer.str();
+                if (fnv1a(data.c_str(), data.size()) != dep_hash(i))
+                    return true;
+            }
+            return false;
+        }
+    private:
+        program(const program &);
+        program &operator =(const program &);
+
+        void unmap()
+        {
+            if (!map_)
+                return;
+#ifdef _WIN32
+            UnmapViewOfFile(map_);
+#else
+            munmap(map_, map_size_);
+#endif
+            map_ = NULL;
+            map_size_ = 0;
+            header_ = NULL;
+        }
+        bool section(const section_t &s, size_t size) const
+        {
+            size_t len = header_->size_;
+            if (s.offset_ % 8 && size != 1)
+                return false;
+            return s.offset_ <= len && s.count_ <= (len - s.offset_) / size;
+        }
+        bool check(const str_t &s) const
+        {
+            return s.offset_ <= header_->strings_.count_ &&
+                   s.len_ <= header_->strings_.count_ - s.offset_;
+        }
+        //bounds of every operand, render() trusts them afterwards
+        bool verify() const
+        {
+            const header_t *h = header_;
+            const char *data = base_;
+            const instr_t *code = (const instr_t *)(data + h->code_.offset_);
+            const str_t *strs[2];
+            strs[0] = (const str_t *)(data + h->params_.offset_);
+            strs[1] = (const str_t *)(data + h->literals_.offset_);
+            const symbol_t *syms = (const symbol_t *)(data + h->symbols_.offset_);
+            const dep_t *deps = (const dep_t *)(data + h->deps_.offset_);
+
+            if (!check(h->name_) || h->registers_ > 256 ||
+                h->params_.count_ > h->registers_)
+                return false;
+            for (unsigned int i = 0; i < h->params_.count_; ++i)
+                if (!check(strs[0][i]))
+                    return false;
+            for (unsigned int i = 0; i < h->literals_.count_; ++i)
+                if (!check(strs[1][i]))
+                    return false;
+            for (unsigned int i = 0; i < h->symbols_.count_; ++i)
+                if (!check(syms[i].type_) || !check(syms[i].field_))
+                    return false;
+            for (unsigned int i = 0; i < h->deps_.count_; ++i)
+                if (!check(deps[i].path_))
+                    return false;
+
+            unsigned int n = h->code_.count_;
+            if (!n || code[n - 1].op_ != op_ret)
+                return false;
+            //registers opened as cursors
+            std::vector<bool> cursors(h->registers_);
+            for (unsigned int i = 0; i < n; ++i)
+            {
+                if (code[i].op_ == op_iter && code[i].a_ < h->registers_)
+                    cursors[code[i].a_] = true;
+            }
+            for (unsigned int i = 0; i < n; ++i)
+            {
+                const instr_t &in = code[i];
+                unsigned int limit = 0;
+                if (in.op_ > op_ret || in.a_ >= h->registers_ ||
+                    in.b_ >= h->registers_)
+                    return false;
+                switch (in.op_)
+                {
+                    case op_text:
+                    case op_str:
+                    case op_default:
+                        limit = h->literals_.count_;
+                        break;
+                    case op_num:
+                        limit = h->numbers_.count_;
+                        break;
+                    case op_field:
+                        limit = h->symbols_.count_;
+                        break;
+                    case op_and:
+                    case op_or:
+                        limit = h->registers_;
+                        break;
+                    case op_escape:
+                    case op_emit_escape:
+                        limit = lm::e_escape_url_path + 1;
+                        break;
+                    case op_end:
+                        if (!cursors[in.a_])
+                            return false;
+                        continue;
+                    case op_cmp:
+                        if ((in.c_ >> 16) > cmp_ge)
+                            return false;
+                        if ((in.c_ & 0xffff) >= h->registers_)
+                            return false;
+                        continue;
+                    case op_next_kv:
+                        if (in.b_ + 1u >= h->registers_ || !cursors[in.a_])
+                            return false;
+                        limit = n;
+                        break;
+                    case op_next:
+                        if (!cursors[in.a_])
+                            return false;
+                        limit = n;
+                        break;
+                    case op_jump:
+                    case op_jump_false:
+                    case op_jump_true:
+                        limit = n;
+                        break;
+                    default:
+                        continue;
+                }
+                if (in.c_ >= limit)
+                    return false;
+            }
+            return true;
+        }
+        std::string str(const str_t &s) const
+        {
+            return std::string(strings_ + s.offset_, s.len_);
+        }
+        const char *literal(unsigned int index, size_t &len) const
+        {
+            len = literals_[index].len_;
+            return strings_ + literals_[index].offset_;
+        }
+        //a type name against a parameter, ignoring spaces
+        bool same_type(const std::string &a, const str_t &b) const
+        {
+            const char *x = a.c_str();
+            const char *y = strings_ + b.offset_;
+            const char *end = y + b.len_;
+            do
+            {
+                while (*x == ' ')
+                    x++;
+                while (y < end && *y == ' ')
+                    y++;
+                if (!*x || y == end)
+                    return !*x && y == end;
+                if (*x++ != *y++)
+                    return false;
+            } while (true);
+        }
+
+        const header_t *header_;
+        const char *base_;
+        const instr_t *code_;
+        const number_t *numbers_;
+        const str_t *params_;
+        const str_t *literals_;
+        const symbol_t *symbols_;
+        const dep_t *deps_;
+        const char *strings_;
+
+        std::vector<const field_t *> fields_;
+        void *map_;
+        size_t map_size_;
+    };
+
+    inline const char *str_data(const value_t &v, size_t &len)
+    {
+        if (v.type_)
+        {
+            len = v.type_->size_(v.ptr_);
+            return v.type_->data_(v.ptr_);
+        }
+        len = v.str_.size();
+        return v.str_.c_str();
+    }
+    //computed numbers have no type, their kind says how to print them
+    inline void append_string(const value_t &v, std::string &out)
+    {
+        if (v.type_ && v.type_->to_string_)
+            v.type_->to_string_(v.ptr_, out);
+        else if (v.type_)
+            out.append(v.type_->data_(v.ptr_), v.type_->size_(v.ptr_));
+        else if (v.kind_ == k_uint)
+            out += lm::$to_string((size_t)v.int_);
+        else if (v.kind_ == k_double)
+            out += lm::$to_string(v.double_);
+        else if (v.kind_ == k_int)
+            out += lm::$to_string(v.int_);
+        else
+            out += v.str_;
+    }
+    inline kind_t kind_of(const value_t &v)
+    {
+        return v.type_ ? v.type_->kind_ : v.kind_;
+    }
+    inline long long int_of(const value_t &v)
+    {
+        if (!v.type_)
+            return v.kind_ == k_double ? (long long)v.double_ : v.int_;
+        if (v.type_->kind_ == k_uint)
+            return (long long)v.type_->uint_(v.ptr_);
+        return v.type_->int_(v.ptr_);
+    }
+    inline unsigned long long uint_of(const value_t &v)
+    {
+        if (!v.type_)
+            return v.kind_ == k_double ? (unsigned long long)v.double_
+                                       : (unsigned long long)v.int_;
+        return v.type_->uint_(v.ptr_);
+    }
+    inline double double_of(const value_t &v)
+    {
+        if (!v.type_)
+        {
+            if (v.kind_ == k_double)
+                return v.double_;
+            if (v.kind_ == k_uint)
+                return (double)(unsigned long long)v.int_;
+            return (double)v.int_;
+        }
+        return v.type_->double_(v.ptr_);
+    }
+    template<class T>
+    inline bool compare(const T &a, const T &b, int op)
+    {
+        switch (op)
+        {
+            case cmp_eq:
+                return a == b;
+            case cmp_neq:
+                return a != b;
+            case cmp_less:
+                return a < b;
+            case cmp_le:
+                return a <= b;
+            case cmp_gt:
+                return a > b;
+            case cmp_ge:
+                return a >= b;
+        }
+        return false;
+    }
+    //the usual arithmetic conversions of the compiled comparison
+    inline bool compare(const value_t &a, const value_t &b, int op)
+    {
+        kind_t x = kind_of(a);
+        kind_t y = kind_of(b);
+        if (x == k_string && y == k_string)
+        {
+            size_t alen, blen;
+            const char *adata = str_data(a, alen);
+            const char *bdata = str_data(b, blen);
+            return compare(std::string(adata, alen),
+                           std::string(bdata, blen), op);
+        }
+        if (x == k_double || y == k_double)
+            return compare(double_of(a), double_of(b), op);
+        if (x == k_uint || y == k_uint)
+            return compare(uint_of(a), uint_of(b), op);
+        return compare(int_of(a), int_of(b), op);
+    }
+    inline bool truth(const value_t &v)
+    {
+        kind_t kind = kind_of(v);
+        if (kind == k_double)
+            return double_of(v) != 0;
+        if (kind == k_string)
+        {
+            size_t len;
+            str_data(v, len);
+            return len != 0;
+        }
+        return int_of(v) != 0;
+    }
+    inline size_t size_of(const value_t &v)
+    {
+        if (!v.type_)
+            return v.str_.size();
+        if (!v.type_->size_)
+            throw std::runtime_error("no length: " + v.type_->name_);
+        return v.type_->size_(v.ptr_);
+    }
+
+    struct frame
+    {
+        frame(int size)
+            :r_(new value_t[size])
+        {
+
+        }
+        ~frame()
+        {
+            delete [] r_;
+        }
+        value_t *r_;
+    };
+
+    inline bool program::render(const std::vector<arg_t> &args,
+                                std::string &out) const
+    {
+        if (!header_ || fields_.size() != header_->symbols_.count_ ||
+            args.size() != header_->params_.count_)
+            return false;
+        for (size_t i = 0; i < args.size(); ++i)
+        {
+            if (!same_type(args[i].type_->name_, params_[i]))
+                return false;
+        }
+
+        frame f(header_->registers_);
+        value_t *r = f.r_;
+        for (size_t i = 0; i < args.size(); ++i)
+        {
+            r[i].type_ = args[i].type_;
+            r[i].ptr_ = args[i].ptr_;
+        }
+
+        const instr_t *code = code_;
+        size_t pc = 0;
+        do
+        {
+            const instr_t &in = code[pc++];
+            value_t &a = r[in.a_];
+            size_t len;
+            const char *data;
+            switch (in.op_)
+            {
+                case op_text:
+                    data = literal(in.c_, len);
+                    out.append(data, len);
+                    break;
+                case op_emit:
+                    if (a.type_ ? a.type_->to_string_ != NULL : a.kind_ != k_string)
+                    {
+                        append_string(a, out);
+                        break;
+                    }
+                    data = str_data(a, len);
+                    out.append(data, len);
+                    break;
+                case op_emit_escape:
+                    data = str_data(a, len);
+                    lm::escape((lm::escape_t)in.c_, data, len, out);
+                    break;
+                case op_field:
+                {
+                    const field_t *f = fields_[in.c_];
+                    const value_t &b = r[in.b_];
+                    a.ptr_ = f->get_->get(b.ptr_);
+                    a.type_ = f->type_();
+                    break;
+                }
+                case op_str:
+                    data = literal(in.c_, len);
+                    a.set_string();
+                    a.str_.assign(data, len);
+                    break;
+                case op_num:
+                {
+                    const number_t &num = numbers_[in.c_];
+                    if (num.is_double_)
+                    {
+                        a.type_ = NULL;
+                        a.kind_ = k_double;
+                        a.double_ = num.double_;
+                    }
+                    else
+                        a.set_int(num.int_);
+                    break;
+                }
+                case op_escape:
+                {
+                    std::string buffer;
+                    data = str_data(r[in.b_], len);
+                    lm::escape((lm::escape_t)in.c_, data, len, buffer);
+                    a.set_string();
+                    a.str_.swap(buffer);
+                    break;
+                }
+                case op_default:
+                {
+                    const value_t &b = r[in.b_];
+                    data = str_data(b, len);
+                    if (len)
+                    {
+                        std::string buffer(data, len);
+                        a.set_string();
+                        a.str_.swap(buffer);
+                        break;
+                    }
+                    data = literal(in.c_, len);
+                    a.set_string();
+                    a.str_.assign(data, len);
+                    break;
+                }
+                case op_length:
+                    a.set_uint(size_of(r[in.b_]));
+                    break;
+                case op_to_string:
+                {
+                    std::string buffer;
+                    append_string(r[in.b_], buffer);
+                    a.set_string();
+                    a.str_.swap(buffer);
+                    break;
+                }
+                case op_test_empty:
+                    a.set_int(size_of(r[in.b_]) != 0);
+                    break;
+                case op_test_zero:
+                    a.set_int(truth(r[in.b_]));
+                    break;
+                case op_cmp:
+                    a.set_int(compare(r[in.b_], r[in.c_ & 0xffff], in.c_ >> 16));
+                    break;
+                case op_not:
+                    a.set_int(!truth(r[in.b_]));
+                    break;
+                case op_and:
+                    a.set_int(truth(r[in.b_]) && truth(r[in.c_]));
+                    break;
+                case op_or:
+                    a.set_int(truth(r[in.b_]) || truth(r[in.c_]));
+                    break;
+                case op_jump:
+                    pc = in.c_;
+                    break;
+                case op_jump_false:
+                    if (!truth(a))
+                        pc = in.c_;
+                    break;
+                case op_jump_true:
+                    if (truth(a))
+                        pc = in.c_;
+                    break;
+                case op_iter:
+                {
+                    //a list or map, whatever the registers held before
+                    const value_t &b = r[in.b_];
+                    if (!b.type_ || !b.type_->begin_ || &b == &a)
+                        throw std::runtime_error("not a list or map");
+                    if (a.it_)
+                        a.iter_type_->free_(a.it_);
+                    a.it_ = NULL;
+                    a.iter_type_ = b.type_;
+                    a.it_ = b.type_->begin_(b.ptr_);
+                    break;
+                }
+                case op_next:
+                case op_next_kv:
+                {
+                    const void *key = NULL;
+                    const void *value = NULL;
+                    if (!a.it_ || (in.op_ == op_next_kv && !a.iter_type_->key_))
+                        throw std::runtime_error("no cursor");
+                    if (!a.iter_type_->next_(a.it_, &key, &value))
+                    {
+                        pc = in.c_;
+                        break;
+                    }
+                    value_t &v = r[in.b_ + (in.op_ == op_next_kv)];
+                    v.type_ = a.iter_type_->value_();
+                    v.ptr_ = value;
+                    if (in.op_ == op_next_kv)
+                    {
+                        r[in.b_].type_ = a.iter_type_->key_();
+                        r[in.b_].ptr_ = key;
+                    }
+                    break;
+                }
+                case op_end:
+                    if (a.it_)
+                        a.iter_type_->free_(a.it_);
+                    a.it_ = NULL;
+                    break;
+                case op_ret:
+                    return true;
+                default:
+                    throw std::runtime_error("bad instruction");
+            }
+        } while (true);
+        return true;
+    }
+}
+}
@@ -0,0 +1,248 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <algorithm>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef _WIN32
+#include <io.h>
+#include <direct.h>
+#include <process.h>
+#include <sys/utime.h>
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <unistd.h>
+#include <utime.h>
+#endif
+#include "acl_cpp/lib_acl.hpp"
+#include "code_cache.h"
+
+static acl::thread_mutex g_tmp_mutex;
+static unsigned long g_tmp_count;
+static unsigned long long g_added;
+
+static bool make_dir(const std::string &path)
+{
+#ifdef _WIN32
+    int ret = _mkdir(path.c_str());
+#else
+    int ret = mkdir(path.c_str(), 0755);
+#endif
+    return ret == 0 || errno == EEXIST;
+}
+static bool replace_file(const std::string &from, const std::string &to)
+{
+#ifdef _WIN32
+    return MoveFileExA(from.c_str(), to.c_str(),
+                       MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    return rename(from.c_str(), to.c_str()) == 0;
+#endif
+}
+static int process_id()
+{
+#ifdef _WIN32
+    return _getpid();
+#else
+    return (int)getpid();
+#endif
+}
+
+struct cache_file
+{
+    std::string path_;
+    unsigned long long size_;
+    time_t mtime_;
+
+    bool operator <(const cache_file &other) const
+    {
+        return mtime_ < other.mtime_;
+    }
+};
+
+static void list_files(const std::string &dir, std::vector<cache_file> &files)
+{
+#ifdef _WIN32
+    struct _finddata_t data;
+    intptr_t handle = _findfirst((dir + "\\*").c_str(), &data);
+    if (handle == -1)
+        return;
+    do
+    {
+        std::string name = data.name;
+        if (name == "." || name == "..")
+            continue;
+        std::string path = dir + "/" + name;
+        if (data.attrib & _A_SUBDIR)
+        {
+            list_files(path, files);
+            continue;
+        }
+        cache_file f;
+        f.path_ = path;
+        f.size_ = data.size;
+        f.mtime_ = data.time_write;
+        files.push_back(f);
+    } while (_findnext(handle, &data) == 0);
+    _findclose(handle);
+#else
+    DIR *d = opendir(dir.c_str());
+    if (!d)
+        return;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL)
+    {
+        std::string name = entry->d_name;
+        if (name == "." || name == "..")
+            continue;
+        std::string path = dir + "/" + name;
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0)
+            continue;
+        if (S_ISDIR(st.st_mode))
+        {
+            list_files(path, files);
+            continue;
+        }
+        cache_file f;
+        f.path_ = path;
+        f.size_ = (unsigned long long)st.st_size;
+        f.mtime_ = st.st_mtime;
+        files.push_back(f);
+    }
+    closedir(d);
+#endif
+}
+
+static unsigned long long parse_size(const char *str)
+{
+    char *end = NULL;
+    unsigned long long size = strtoull(str, &end, 10);
+    if (end && *end)
+    {
+        switch (*end)
+        {
+            case 'k': case 'K':
+                size <<= 10;
+                break;
+            case 'm': case 'M':
+                size <<= 20;
+                break;
+            case 'g': case 'G':
+                size <<= 30;
+                break;
+            default:
+                break;
+        }
+    }
+    return size;
+}
+
+code_cache::code_cache(const std::string &dir, unsigned long long max_size)
+    :dir_(dir),
+     max_size_(max_size)
+{
+
+}
+code_cache *code_cache::from_env()
+{
+    const char *dir = getenv("LEMON_CACHE_DIR");
+    if (!dir || !*dir)
+        return NULL;
+
+    unsigned long long max_size = 1ULL << 30;
+    const char *size = getenv("LEMON_CACHE_SIZE");
+    if (size && *size)
+        max_size = parse_size(size);
+
+    if (!make_dir(dir))
+        return NULL;
+    return new code_cache(dir, max_size);
+}
+std::string code_cache::entry_path(const std::string &key,
+                                   const std::string &ext)
+{
+    return dir_ + "/" + key.substr(0, 2) + "/" + key + ext;
+}
+bool code_cache::get(const std::string &key, const std::string &ext,
+                     std::string &data)
+{
+    std::string path = entry_path(key, ext);
+    std::ifstream file(path.c_str(), std::ios::in | std::ios::binary);
+    if (!file.good())
+        return false;
+    std::ostringstream buffer;
+    buffer << file.rdbuf();
+    data = buffer.str();
+
+    //a hit refreshes the entry for the LRU trimming
+#ifdef _WIN32
+    _utime(path.c_str(), NULL);
+#else
+    utime(path.c_str(), NULL);
+#endif
+    return true;
+}
+bool code_cache::put(const std::string &key, const std::string &ext,
+                     const std::string &data)
+{
+    if (!make_dir(dir_ + "/" + key.substr(0, 2)))
+        return false;
+
+    std::string path = entry_path(key, ext);
+
+    g_tmp_mutex.lock();
+    unsigned long count = ++g_tmp_count;
+    g_added += data.size();
+    g_tmp_mutex.unlock();
+
+    char suffix[64];
+    snprintf(suffix, sizeof(suffix), ".tmp.%d.%lu", process_id(), count);
+    std::string tmp_path = path + suffix;
+
+    //readers never see a partly written entry,
+    //the complete file is renamed into place.
+    std::ofstream file(tmp_path.c_str(), std::ios::out | std::ios::binary);
+    file.write(data.c_str(), data.size());
+    file.close();
+    if (!file.good() || !replace_file(tmp_path, path))
+    {
+        remove(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+void code_cache::trim()
+{
+    //nothing published by this process, leave it to the writers
+    g_tmp_mutex.lock();
+    unsigned long long added = g_added;
+    g_added = 0;
+    g_tmp_mutex.unlock();
+    if (!added)
+        return;
+
+    std::vector<cache_file> files;
+    list_files(dir_, files);
+
+    unsigned long long total = 0;
+    for (size_t i = 0; i < files.size(); ++i)
+        total += files[i].size_;
+    if (total <= max_size_)
+        return;
+
+    //trim to 90% so the next few builds don't trim again
+    unsigned long long limit = max_size_ / 10 * 9;
+    std::sort(files.begin(), files.end());
+    for (size_t i = 0; i < files.size() && total > limit; ++i)
+    {
+        //a concurrent trim may have removed it already
+        if (remove(files[i].path_.c_str()) == 0)
+            total -= files[i].size_;
+    }
+}
@@ -0,0 +1,30 @@
+#pragma once
+#include <string>
+
+// ccache style store of generated code shared by every build dir.
+// entries live in <dir>/<key[0..1]>/<key>.<ext>, are published with
+// a rename and the least recently used ones are removed once the
+// cache grows past its size limit.
+//
+// LEMON_CACHE_DIR  cache directory, no caching when unset
+// LEMON_CACHE_SIZE size limit, eg 500M or 2G. default 1G
+class code_cache
+{
+public:
+    code_cache(const std::string &dir, unsigned long long max_size);
+
+    //NULL when LEMON_CACHE_DIR is not set
+    static code_cache *from_env();
+
+    bool get(const std::string &key, const std::string &ext,
+             std::string &data);
+    bool put(const std::string &key, const std::string &ext,
+             const std::string &data);
+    //drop least recently used entries, if the cache is too large
+    void trim();
+private:
+    std::string entry_path(const std::string &key, const std::string &ext);
+
+    std::string dir_;
+    unsigned long long max_size_;
+};
@@ -0,0 +1,25 @@
+#pragma once
+#include <string>
+#include <cstdio>
+
+// 64-bit FNV-1a, used to fingerprint compiler inputs.
+// chain calls by passing the previous result as `hash`.
+static const unsigned long long fnv1a_offset = 14695981039346656037ULL;
+
+inline unsigned long long fnv1a(const std::string &data,
+                                unsigned long long hash = fnv1a_offset)
+{
+    for (size_t i = 0; i < data.size(); ++i)
+    {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+inline std::string to_hex(unsigned long long hash)
+{
+    char buffer[17];
+    snprintf(buffer, sizeof(buffer), "%016llx", hash);
+    return std::string(buffer);
+}
@@ -0,0 +1,117 @@
+#pragma once
+#include <string>
+#include <vector>
+
+// parse tree of a template. includes, blocks and extends are already
+// resolved by the parser, so every backend walks one self contained
+// tree: gen_cpp() writes C++, vm_gen lowers it to bytecode.
+
+struct expr_t
+{
+    typedef enum type_t
+    {
+        e_variable,        // a.b.c           str_ path, type_str_ C++ type
+        e_string,          // "text"          str_ text
+        e_number,          // 42              str_ digits
+        e_call,            // lm::$str_(args_)  escape, default, length, to_string
+        e_test,            // args_[0] is not empty/zero, str_ "empty" or "zero"
+        e_compare,         // args_[0] str_ args_[1]
+        e_and,             // args_[0] && args_[1] ...
+        e_or,              // args_[0] || args_[1] ...
+        e_not              // !args_[0]
+    } type_t;
+
+    expr_t()
+        :type_(e_variable)
+    {
+
+    }
+    expr_t(type_t type, const std::string &str)
+        :type_(type),
+         str_(str)
+    {
+
+    }
+
+    type_t type_;
+    std::string str_;
+    std::string type_str_;
+    //e_variable, types of a, a.b, ... for field lookups
+    std::vector<std::string> types_;
+    std::vector<expr_t> args_;
+};
+
+struct node_t;
+typedef std::vector<node_t> nodes_t;
+
+struct node_t
+{
+    typedef enum type_t
+    {
+        e_literal,         // str_ static text
+        e_emit,            // code += expr_
+        e_if,              // conds_[i] => bodies_[i], an extra body is else
+        e_for,             // bodies_[0] loop, bodies_[1] empty
+        e_block,           // str_ block name, bodies_[0]
+        e_include,         // str_ file path, bodies_[0]
+        e_macro,           // str_ macro name, args_ parameters, bodies_[0]
+        e_call,            // str_ macro name, args_ arguments
+        e_let,             // value_ of value_type_ = expr_, to the end of the body
+        e_switch,          // expr_ == a constant of conds_[i].args_ => bodies_[i],
+                           // an extra body is default
+        e_cold,            // bodies_[0] rarely renders, compiled out of line
+        e_trans            // str_ message, bodies_[0] its source text. replaced
+                           // by translate() before the passes
+    } type_t;
+
+    typedef enum loop_t
+    {
+        e_loop_list,       // {% for v in list %}
+        e_loop_map_value,  // {% for v in map %}
+        e_loop_map         // {% for k, v in map %}
+    } loop_t;
+
+    node_t()
+        :type_(e_literal),
+         loop_(e_loop_list),
+         site_(-1),
+         line_(0)
+    {
+
+    }
+    explicit node_t(type_t type)
+        :type_(type),
+         loop_(e_loop_list),
+         site_(-1),
+         line_(0)
+    {
+
+    }
+
+    type_t type_;
+    std::string str_;
+    expr_t expr_;
+    std::vector<expr_t> conds_;
+    std::vector<nodes_t> bodies_;
+    //e_macro parameters, e_variable with str_ name and type_str_ type.
+    //e_call arguments
+    std::vector<expr_t> args_;
+
+    //e_for, value_ and value_type_ also e_let
+    loop_t loop_;
+    std::string iterator_;
+    std::string items_type_;
+    std::string key_;
+    std::string key_type_;
+    std::string value_;
+    std::string value_type_;
+
+    //e_if, e_switch and e_for, the first of their profile counters: the
+    //times the node was reached, then the times each body ran. counts_
+    //holds them when a profile was read.
+    int site_;
+    std::vector<unsigned long long> counts_;
+
+    std::string file_path_;
+    int line_;
+};
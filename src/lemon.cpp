@@ -1,11 +1,23 @@
 #define _CRT_SECURE_NO_WARNINGS
 #include <set>
+#include <algorithm>
+#include <cctype>
+#include <cstring>
 #include <stdexcept>
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include "lib_acl.h"
 #include "acl_cpp/lib_acl.hpp"
 #include "lemon.h"
+#include "lemon_escape.hpp"
+#include "lemon_registry.hpp"
+#include "work_pool.h"
+#include "source_cache.h"
+#include "code_cache.h"
+#include "hash.h"
+#include "ir.h"
+#include "passes.h"
 
 #define br std::string("\n")
 
@@ -72,10 +84,46 @@ static inline void skip(std::string &line,
     }
 }
 
+static std::string number(unsigned long long value)
+{
+    char buffer[32];
+    sprintf(buffer, "%llu", value);
+    return buffer;
+}
 lemon::lemon()
 {
     lexer_ = NULL;
     iterators_ = 0;
+    tab_ = 0;
+    sources_ = new source_cache;
+    own_sources_ = true;
+    cache_ = code_cache::from_env();
+    backend_ = e_cpp;
+    inline_threshold_ = 4;
+    outline_threshold_ = 0;
+    dump_ir_ = false;
+    instrument_ = false;
+    literal_pool_ = false;
+    minify_ = true;
+    init_filter();
+}
+lemon::lemon(const std::vector<class_t> &classes, source_cache *sources,
+             backend_t backend)
+    :classes_(classes)
+{
+    lexer_ = NULL;
+    iterators_ = 0;
+    tab_ = 0;
+    sources_ = sources;
+    own_sources_ = false;
+    cache_ = NULL;
+    backend_ = backend;
+    inline_threshold_ = 4;
+    outline_threshold_ = 0;
+    dump_ir_ = false;
+    instrument_ = false;
+    literal_pool_ = false;
+    minify_ = true;
     init_filter();
 }
 lemon::~lemon()
@@ -84,12 +132,12 @@ lemon::~lemon()
     {
         lexer *l = lexers_[i];
         if(l->file_)
-        {
-            l->file_->close();
             delete l->file_;
-        }
         delete l;
     }
+    if (own_sources_)
+        delete sources_;
+    delete cache_;
 }
 void lemon::init_filter()
 {
@@ -99,276 +147,1240 @@ void lemon::init_filter()
 }
 bool lemon::parse_cpp_header(const std::string &file_path)
 {
+    //shared headers of a batch are only parsed once
+    if (check_file_done(file_path))
+        return true;
     lexer_ = new_lexer(file_path);
     if(!lexer_)
         return false;
+
+    bool ok = true;
+    size_t depth = lexers_.size();
     try
     {
+        lexers_.push_back(lexer_);
         parse_cpp_header();
+        analyzed_files_.push_back(file_path);
+        headers_.push_back(file_path);
     }
     catch (std::exception &e)
     {
-        std::cout << e.what() << std::endl;
-        print_lexer_status();
-        return false;
+        print_lexer_status(e.what());
+        ok = false;
     }
-    return true;
+    //the object may live long in watch mode, don't keep header lexers
+    while (lexers_.size() > depth)
+    {
+        delete lexers_.back()->file_;
+        delete lexers_.back();
+        lexers_.pop_back();
+    }
+    lexer_ = NULL;
+    return ok;
+}
+//parse the headers again after one of them changed
+bool lemon::reload_headers()
+{
+    std::vector<std::string> headers;
+    headers.swap(headers_);
+    for (size_t i = 0; i < analyzed_files_.size(); ++i)
+        sources_->erase(analyzed_files_[i]);
+    analyzed_files_.clear();
+    sources_->clear_trees();
+    classes_.clear();
+
+    bool ok = true;
+    for (size_t i = 0; i < headers.size(); ++i)
+        ok = parse_cpp_header(headers[i]) && ok;
+    //a broken header stays on the list, it's parsed again once fixed
+    headers_ = headers;
+    return ok;
 }
 
 lemon::lexer *lemon::new_lexer(const std::string &file_path)
 {
+    std::string data;
+    if (!sources_->get(file_path, data))
+    {
+        std::cout << "open file error. "<<file_path << std::endl;
+        return NULL;
+    }
     lexer *l = new lexer;
 
     l->line_ = 0;
-    l->file_ = new std::ifstream;
-    l->file_->clear();
-    l->file_->open(file_path.c_str());
+    l->file_ = new std::istringstream(data);
     l->file_path_ = file_path;
-
-    if (!l->file_->good())
+    add_input(file_path);
+    return l;
+}
+void lemon::add_input(const std::string &file_path)
+{
+    reads_.push_back(file_path);
+    for (size_t i = 0; i < inputs_.size(); ++i)
     {
-        std::cout << "open file error. "<<file_path << std::endl;
-        delete l->file_;
-        delete l;
-        return NULL;
+        if (inputs_[i] == file_path)
+            return;
     }
-    return l;
+    inputs_.push_back(file_path);
 }
-void lemon::print_lexer_status()
+void lemon::print_lexer_status(const std::string &error)
 {
-    std::cout << "file:" << lexer_->file_path_<< std::endl;
-    std::cout << "line:" << lexer_->line_ << std::endl;
-    std::cout<< lexer_->current_line_ << std::endl;
-    std::cout <<">>>> "<<lexer_->line_buffer_ << std::endl;
+    //one write, so reports of parallel compilations don't interleave
+    std::ostringstream status;
+    status << error << std::endl;
+    status << "file:" << lexer_->file_path_<< std::endl;
+    status << "line:" << lexer_->line_ << std::endl;
+    status << lexer_->current_line_ << std::endl;
+    status <<">>>> "<<lexer_->line_buffer_ << std::endl;
+    std::cout << status.str() << std::flush;
 }
-bool lemon::parse_template(const std::string &file_path)
+static bool read_file(const std::string &file_path, std::string &data)
 {
-    lexer_ = new_lexer(file_path);
-    if(!lexer_)
-    {
-        return false;
-    }
-    try
-    {
-        lexers_.push_back(lexer_);
-        parse_template();
-    }
-    catch (const std::exception& e)
-    {
-        std::cout << e.what() << std::endl;
-        print_lexer_status();
+    std::ifstream file(file_path.c_str(), std::ios::in | std::ios::binary);
+    if (!file.good())
         return false;
-    }
+    std::ostringstream buffer;
+    buffer << file.rdbuf();
+    data = buffer.str();
     return true;
 }
-void lemon::read_line()
-{
-    if (std::getline(*(lexer_->file_), lexer_->line_buffer_).good())
-    {
-        lexer_->line_buffer_ += "\r\n";
-        lexer_->current_line_ = lexer_->line_buffer_;
-        lexer_->line_++;
-        return;
-    }
-    lexer_->line_buffer_.clear();
-}
-void lemon::move_buffer(int offset)
+//keep the mtime of outputs whose bytes did not change,
+//so the generated code is not recompiled.
+static bool write_if_changed(const std::string &file_path,
+                             const std::string &data)
 {
-    lexer_->line_buffer_ = lexer_->line_buffer_.substr(offset);
+    std::string old;
+    if (read_file(file_path, old) && old == data)
+        return true;
+
+    std::fstream file;
+    file.open(file_path.c_str(), std::ios::out | std::ios::binary);
+    file.write(data.c_str(), data.size());
+    return file.good();
 }
-std::string lemon::get_string(const std::string &delimiters)
+static std::string escape_dep(const std::string &file_path)
 {
     std::string buffer;
-    if (delimiters.empty())
-        return lexer_->line_buffer_;
-
-    for (size_t i = 0; i < lexer_->line_buffer_.size(); i++)
+    for (size_t i = 0; i < file_path.size(); ++i)
     {
-        char ch = lexer_->line_buffer_[i];
-        if (delimiters[0] != ch)
-        {
-            buffer.push_back(ch);
-        }
-        else 
-        {
-            int k = 0;
-            bool ok = true;
-            for (size_t j = i; j < lexer_->line_buffer_.size() &&
-                 k < delimiters.size(); j++,k++)
-            {
-                if (lexer_->line_buffer_[j] != delimiters[k])
-                {
-                    ok = false;
-                    break;
-                }
-            }
-            if (ok)
-                return buffer;
-        }
+        char ch = file_path[i];
+        if (ch == ' ' || ch == '#')
+            buffer.push_back('\\');
+        else if (ch == '$')
+            buffer.push_back('$');
+        buffer.push_back(ch);
     }
     return buffer;
 }
-std::string lemon::get_string(size_t len)
+//hash of the compiler version, the parsed headers and
+//every template file a compilation read.
+std::string lemon::inputs_hash(const std::vector<std::string> &inputs) const
 {
-    if (len > lexer_->line_buffer_.size())
-        len = lexer_->line_buffer_.size();
-
-    return std::string (lexer_->line_buffer_.c_str(),len);
+    unsigned long long hash = fnv1a(LEMON_VERSION);
+    //the template comes first
+    hash = fnv1a(options(inputs.empty() ? "" : inputs[0]) + '\0', hash);
+    std::vector<std::string> files(analyzed_files_);
+    files.insert(files.end(), inputs.begin(), inputs.end());
+
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        //through the cache, so the hash covers the bytes compiled
+        std::string data;
+        if (!sources_->get(files[i], data))
+            return std::string();
+        hash = fnv1a(files[i] + '\0', hash);
+        hash = fnv1a(data + '\0', hash);
+    }
+    return to_hex(hash);
 }
-std::string lemon::next_token(const std::string &delimiters, const std::string &skips)
+void lemon::set_backend(backend_t backend)
 {
-    std::string buffer;
-
-    do
-    {
-        if (lexer_->line_buffer_.empty())
-            read_line();
-        if (lexer_->line_buffer_.empty())
-            return buffer;
-        if(skips.size())
-            skip(lexer_->line_buffer_,skips);
-        if (!lexer_->line_buffer_.empty())
-            break;
-    } while (true);
-    
-
-    for (size_t i = 0; i < lexer_->line_buffer_.size(); i++)
-    {
-        char ch = lexer_->line_buffer_[i];
-        if (delimiters.find(ch) == std::string::npos)
-        {
-            buffer.push_back(ch);
-        }
-        else
-        {
-            if(buffer.empty())
-                buffer.push_back(ch);
-            break;
-        }
-    }
-    lexer_->line_buffer_ = lexer_->line_buffer_.substr(buffer.size());
-    return buffer;
+    backend_ = backend;
 }
-void lemon::push_back(const lemon::token_t &value)
+void lemon::set_inline_threshold(size_t nodes)
 {
-    tokens_.push_back(value);
+    inline_threshold_ = nodes;
 }
-int lemon::line()
+void lemon::set_outline_threshold(size_t nodes)
 {
-    return lexer_->line_;
+    outline_threshold_ = nodes;
 }
-void lemon::assert_not_eof(const token_t &t)
+void lemon::set_dump_ir(bool dump)
 {
-    if(t.type_ == token_t::e_eof)
-        throw syntax_error("end of file error");
+    dump_ir_ = dump;
 }
-#define eof_assert(T)  assert_not_eof(T)
-lemon::token_t lemon::curr_token()
+void lemon::set_instrument(bool instrument)
 {
-    return lexer_->token_;
+    instrument_ = instrument;
 }
-void lemon::clear_line_buffer()
+void lemon::set_literal_pool(bool pool)
 {
-    lexer_->line_buffer_.clear();
+    literal_pool_ = pool;
 }
-
-lemon::token_t lemon::get_next_token(const std::string &skip_str)
+void lemon::set_minify(bool minify)
 {
-
-    static std::string delimiters = " <>{}()[]%&!?:;|,\\/.\r\t\n\"'`=-";
-
-    token_t t;
-    std::string str;
-    if (tokens_.size())
+    minify_ = minify;
+}
+//utf-8 and its aliases render as they are
+static bool is_utf8(const std::string &charset)
+{
+    std::string name;
+    for (size_t i = 0; i < charset.size(); ++i)
     {
-        t = tokens_.front();
-        tokens_.pop_front();
-        return t;
+        if (charset[i] != '-' && charset[i] != '_')
+            name += (char)tolower(charset[i]);
     }
-    else
+    return name == "utf8";
+}
+//the charset of a template, its own or the one for all
+static std::string find_charset(const std::map<std::string, std::string> &charsets,
+                                const std::string &file_path)
+{
+    std::map<std::string, std::string>::const_iterator it = charsets.find(file_path);
+    if (it == charsets.end())
+        it = charsets.find("");
+    if (it == charsets.end() || is_utf8(it->second))
+        return "";
+    return it->second;
+}
+//the charset has to keep ascii as it is, the generated code writes it
+//through unconverted
+bool lemon::set_charset(const std::string &charset, const std::string &file_path)
+{
+    bool named = !charset.empty();
+    for (size_t i = 0; i < charset.size(); ++i)
     {
-        if (skip_str.size())
-        {
-            skip(lexer_->line_buffer_, skip_str);
-        }
-        str = next_token(delimiters,skip_str);
-        t.str_ = str;
+        if (!isalnum((unsigned char)charset[i]) && !strchr("-_.:", charset[i]))
+            named = false;
     }
-
-    if (str == " ")
+    if (!named)
     {
-        t.type_ = token_t::e_space;
+        std::cout << "charset `" << charset << "`: bad name" << std::endl;
+        return false;
     }
-    else if (str == "\t")
+    std::string ascii = "\t\r\n";
+    for (char ch = 0x20; ch < 0x7f; ++ch)
+        ascii += ch;
+    acl::charset_conv conv;
+    conv.set_add_invalid(false);
+    acl::string out;
+    if (!is_utf8(charset) &&
+        (!conv.convert("utf-8", charset.c_str(), ascii.data(), ascii.size(), &out) ||
+         std::string(out.c_str(), out.length()) != ascii))
+    {
+        std::cout << "charset " << charset << ": unknown, or not a superset "
+                  << "of ascii" << std::endl;
+        return false;
+    }
+    charsets_[file_path] = charset;
+    return true;
+}
+//lines of lm::write_profile(), `name hash renders bytes size counts...`.
+//a different hash is a newer build of the template and replaces the
+//counts read before.
+bool lemon::load_profile(const std::string &file_path)
+{
+    std::ifstream file(file_path.c_str());
+    if (!file.good())
     {
-        t.type_ = token_t::e_$t;
+        std::cout << "open file error. " << file_path << std::endl;
+        return false;
     }
-    else if (str == "\r")
+    std::string line;
+    int line_no = 0;
+    while (std::getline(file, line))
     {
-        t.type_ = token_t::e_$r;
+        line_no++;
+        std::istringstream in(line);
+        std::string name;
+        if (!(in >> name))
+            continue;
+        profile_t profile;
+        unsigned long size = 0;
+        bool ok = !!(in >> profile.hash_ >> profile.renders_ >> profile.bytes_ >> size);
+        //counts read one by one, a bad size can't allocate more than
+        //the line holds
+        unsigned long long count;
+        while (ok && profile.counts_.size() < size && in >> count)
+            profile.counts_.push_back(count);
+        ok = ok && profile.counts_.size() == size;
+        std::map<std::string, profile_t>::const_iterator it = profiles_.find(name);
+        if (ok && it != profiles_.end() && it->second.hash_ == profile.hash_)
+            ok = it->second.counts_.size() == size;
+        if (!ok)
+        {
+            std::cout << file_path << ":" << line_no << ": bad profile line"
+                      << std::endl;
+            return false;
+        }
+        profile_t &sum = profiles_[name];
+        if (sum.hash_ != profile.hash_)
+        {
+            sum = profile;
+            continue;
+        }
+        sum.renders_ += profile.renders_;
+        sum.bytes_ += profile.bytes_;
+        for (size_t i = 0; i < size; ++i)
+            sum.counts_[i] += profile.counts_[i];
     }
-    else if (str == "\n")
+    return true;
+}
+//the "..." on a line of a .po file
+static bool po_string(const std::string &line, size_t pos, std::string &str)
+{
+    pos = line.find('"', pos);
+    size_t end = line.rfind('"');
+    if (pos == std::string::npos || end == pos)
+        return false;
+    for (size_t i = pos + 1; i < end; ++i)
     {
-        t.type_ = token_t::e_$n;
+        char ch = line[i];
+        if (ch == '\\' && i + 1 < end)
+        {
+            ch = line[++i];
+            if (ch == 'n')
+                ch = '\n';
+            else if (ch == 't')
+                ch = '\t';
+            else if (ch == 'r')
+                ch = '\r';
+        }
+        str += ch;
     }
-   
-    else if (str == "")
+    return true;
+}
+struct po_entry
+{
+    po_entry()
+        :translated_(false),
+         fuzzy_(false)
     {
-        t.type_ = token_t::e_eof;
+
     }
-    else if (str == "<")
+    std::string context_;
+    std::string msgid_;
+    std::string msgstr_;
+    bool translated_;
+    bool fuzzy_;
+};
+//fuzzy, untranslated and msgctxt entries are left out, {% trans %}
+//has no context. the header entry has an empty msgid.
+static void add_entry(std::map<std::string, std::string> &messages, po_entry &entry)
+{
+    if (!entry.fuzzy_ && entry.context_.empty() && !entry.msgid_.empty() &&
+        !entry.msgstr_.empty())
+        messages[entry.msgid_] = entry.msgstr_;
+    entry = po_entry();
+}
+//msgid "..." msgstr "..." entries of a gettext catalog, a string goes on
+//over "..." lines. a plural translates with msgstr[0]. catalogs of the
+//same locale add up.
+bool lemon::add_locale(const std::string &locale, const std::string &po_path)
+{
+    bool ok = !locale.empty();
+    for (size_t i = 0; ok && i < locale.size(); ++i)
+        ok = isalnum((unsigned char)locale[i]) || locale[i] == '_';
+    if (!ok)
     {
-        t.type_ = token_t::e_less;
-        if (get_string(1) == "=")
+        std::cout << "bad locale name `" << locale << "`" << std::endl;
+        return false;
+    }
+    std::ifstream file(po_path.c_str());
+    if (!file.good())
+    {
+        std::cout << "open file error. " << po_path << std::endl;
+        return false;
+    }
+    std::map<std::string, std::string> &messages = locales_[locale];
+    po_entry entry;
+    std::string ignored;
+    std::string *str = NULL;
+    std::string line;
+    int line_no = 0;
+    while (std::getline(file, line))
+    {
+        line_no++;
+        size_t pos = line.find_first_not_of(" \t\r");
+        if (pos == std::string::npos)
+            continue;
+        //a keyword, or the " of a string going on
+        size_t end = line.find_first_of(" \t\"", pos);
+        std::string word = line.substr(pos, end == pos ? 1 : end - pos);
+        if (word[0] == '#')
         {
-            move_buffer(1);
-            t.type_ = token_t::e_le;
-            t.str_ = "<=";
+            if (word == "#," && line.find("fuzzy") != std::string::npos)
+            {
+                if (entry.translated_)
+                    add_entry(messages, entry);
+                entry.fuzzy_ = true;
+            }
+            continue;
         }
-        else if (get_string(3) == "!--")
+        if (word == "msgctxt" || word == "msgid")
         {
-            move_buffer(3);
-            t.str_ = "<!--";
-            t.type_ = token_t::e_html_comment_begin;
+            if (entry.translated_)
+                add_entry(messages, entry);
+            str = word == "msgid" ? &entry.msgid_ : &entry.context_;
         }
-    }
-    else if (str == "-")
-    {
-        t.type_ = token_t::e_sub;
-        if (get_string(2) == "->")
+        else if (word == "msgstr" || word == "msgstr[0]")
         {
-            move_buffer(2);
-            t.str_ = "-->";
-            t.type_ = token_t::e_html_comment_end;
+            entry.translated_ = true;
+            str = &entry.msgstr_;
         }
-    }
-    else if (str == ">")
-    {
-        t.type_ = token_t::e_gt;
-        if (get_string(1) == "=")
+        else if (word == "msgid_plural" || word.compare(0, 7, "msgstr[") == 0)
         {
-            move_buffer(1);
-            t.type_ = token_t::e_ge;
-            t.str_ = ">=";
+            ignored.clear();
+            str = &ignored;
         }
-    }
-    else if (str == "{")
-    {
-        t.type_ = token_t::e_open_brace;
-        if (get_string(1) == "{")
+        else if (word[0] != '"' || !str)
         {
-            t.type_ = token_t::e_open_variable;
-            t.str_ = "{{";
-            move_buffer(1);
+            str = NULL;
         }
-        else if (get_string(1) == "%")
+        if (!str || !po_string(line, pos, *str))
         {
-            t.type_ = token_t::e_open_block;
-            t.str_  = "{%";
-            move_buffer(1);
+            std::cout << po_path << ":" << line_no << ": bad catalog line"
+                      << std::endl;
+            return false;
         }
     }
-    else if (str == "}")
+    add_entry(messages, entry);
+    return true;
+}
+//`name=value ...`, a value is a number, true, false, "text" or
+//a list ["text", ...]. checked against the interface at compile time.
+bool lemon::add_variant(const std::string &file_path, const std::string &variant,
+                        const std::string &constants)
+{
+    variant_t v;
+    v.name_ = variant;
+    bool ok = !variant.empty();
+    for (size_t i = 0; ok && i < variant.size(); ++i)
+        ok = isalnum((unsigned char)variant[i]) || variant[i] == '_';
+    if (!ok)
+    {
+        std::cout << "bad variant name `" << variant << "`" << std::endl;
+        return false;
+    }
+
+    size_t pos = 0;
+    while ((pos = constants.find_first_not_of(" \t\r\n", pos)) != std::string::npos)
+    {
+        size_t eq = constants.find('=', pos);
+        std::string name;
+        size_t end = std::string::npos;
+        bool quoted = false;
+        if (eq != std::string::npos && eq + 1 < constants.size())
+        {
+            name = constants.substr(pos, eq - pos);
+            //a value ends at its closing quote or bracket, else at a space
+            char open = constants[eq + 1];
+            quoted = open == '"' || open == '[';
+            if (quoted)
+                end = constants.find(open == '"' ? '"' : ']', eq + 2);
+            else
+                end = constants.find_first_of(" \t\r\n", eq + 1);
+            if (quoted && end != std::string::npos)
+                end++;
+        }
+        if (name.empty() || name.find_first_of(" \t") != std::string::npos ||
+            (quoted && end == std::string::npos))
+        {
+            std::cout << "variant " << variant << ": expect `name=value` in `"
+                      << constants.substr(pos) << "`" << std::endl;
+            return false;
+        }
+        if (end == std::string::npos)
+            end = constants.size();
+        v.constants_.push_back(std::make_pair(name, constants.substr(eq + 1, end - eq - 1)));
+        pos = end;
+    }
+
+    std::vector<variant_t> &variants = variants_[file_path];
+    for (size_t i = 0; i < variants.size(); ++i)
+    {
+        //a manifest read again
+        if (variants[i].name_ == variant)
+        {
+            variants[i] = v;
+            return true;
+        }
+    }
+    variants.push_back(v);
+    return true;
+}
+//compiler options that change the generated code
+std::string lemon::options(const std::string &file_path) const
+{
+    char buffer[64];
+    sprintf(buffer, "inline %lu outline %lu", (unsigned long)inline_threshold_,
+            (unsigned long)outline_threshold_);
+    std::string options = buffer;
+
+    std::map<std::string, std::vector<variant_t> >::const_iterator it;
+    it = variants_.find(file_path);
+    for (size_t i = 0; it != variants_.end() && i < it->second.size(); ++i)
+    {
+        const variant_t &variant = it->second[i];
+        options += br + "variant " + variant.name_;
+        for (size_t j = 0; j < variant.constants_.size(); ++j)
+        {
+            options += " " + variant.constants_[j].first;
+            options += "=" + variant.constants_[j].second;
+        }
+    }
+    if (instrument_)
+        options += br + "instrument";
+    if (literal_pool_)
+        options += br + "literal pool";
+    if (!minify_)
+        options += br + "no minify";
+    std::string charset = find_charset(charsets_, file_path);
+    if (!charset.empty())
+        options += br + "charset " + charset;
+    std::map<std::string, std::map<std::string, std::string> >::const_iterator l;
+    for (l = locales_.begin(); l != locales_.end(); ++l)
+    {
+        unsigned long long hash = fnv1a_offset;
+        std::map<std::string, std::string>::const_iterator m;
+        for (m = l->second.begin(); m != l->second.end(); ++m)
+            hash = fnv1a(m->first + '\0' + m->second + '\0', hash);
+        options += br + "locale " + l->first + " " + to_hex(hash);
+    }
+    if (!profiles_.empty())
+    {
+        unsigned long long hash = fnv1a_offset;
+        std::map<std::string, profile_t>::const_iterator p;
+        for (p = profiles_.begin(); p != profiles_.end(); ++p)
+        {
+            hash = fnv1a(p->first + ' ' + p->second.hash_ + ' ', hash);
+            hash = fnv1a(number(p->second.renders_) + ' ', hash);
+            hash = fnv1a(number(p->second.bytes_) + ' ', hash);
+            for (size_t i = 0; i < p->second.counts_.size(); ++i)
+                hash = fnv1a(number(p->second.counts_[i]) + ' ', hash);
+        }
+        options += br + "profile " + to_hex(hash);
+    }
+    return options;
+}
+//settings of a compilation, into its private context
+void lemon::copy_options(lemon &ctx, const std::string &file_path) const
+{
+    ctx.inline_threshold_ = inline_threshold_;
+    ctx.outline_threshold_ = outline_threshold_;
+    ctx.dump_ir_ = dump_ir_;
+    ctx.instrument_ = instrument_;
+    ctx.literal_pool_ = literal_pool_;
+    ctx.minify_ = minify_;
+    ctx.charset_ = find_charset(charsets_, file_path);
+    ctx.locales_ = locales_;
+    ctx.profiles_ = profiles_;
+    std::map<std::string, std::vector<variant_t> >::const_iterator it;
+    it = variants_.find(file_path);
+    if (it != variants_.end())
+        ctx.variants_[file_path] = it->second;
+}
+std::string lemon::output_ext() const
+{
+    return backend_ == e_vm ? ".lmc" : ".cpp";
+}
+std::string lemon::output_path(const std::string &file_path) const
+{
+    return file_path + output_ext();
+}
+//<template>.h, the declaration of the generated function
+std::string lemon::header_path(const std::string &file_path) const
+{
+    return file_path + ".h";
+}
+// <output>.stamp:
+// <inputs hash>
+// <template>
+// <include or base template>...
+bool lemon::up_to_date(const std::string &file_path) const
+{
+    std::string stamp;
+    std::string code;
+    if (!read_file(output_path(file_path) + ".stamp", stamp) ||
+        !read_file(output_path(file_path), code))
+        return false;
+
+    std::vector<std::string> lines = split(stamp, "\r\n");
+    if (lines.size() < 2 || lines[1] != file_path)
+        return false;
+
+    std::string hash = lines[0];
+    lines.erase(lines.begin());
+    if (backend_ == e_cpp && !read_file(header_path(file_path), code))
+        return false;
+    if (literal_pool_ && !read_file(output_path(file_path) + ".literals", code))
+        return false;
+    return inputs_hash(lines) == hash;
+}
+// <output>.literals, the literals gen_literal_pool() needs of a template:
+// <size>\n<bytes>\n...
+static std::string pack_literals(const std::set<std::string> &literals)
+{
+    std::string data;
+    std::set<std::string>::const_iterator it;
+    for (it = literals.begin(); it != literals.end(); ++it)
+        data += number(it->size()) + br + *it + br;
+    return data;
+}
+static bool unpack_literals(const std::string &data, std::set<std::string> &literals)
+{
+    size_t pos = 0;
+    while (pos < data.size())
+    {
+        size_t end = data.find('\n', pos);
+        if (end == std::string::npos)
+            return false;
+        size_t size = (size_t)strtoul(data.c_str() + pos, NULL, 10);
+        if (size > data.size() - end - 1)
+            return false;
+        literals.insert(data.substr(end + 1, size));
+        pos = end + 1 + size + 1;
+    }
+    return true;
+}
+bool lemon::write_outputs(const std::string &file_path,
+                          const std::string &code,
+                          const std::string &header,
+                          const std::string &literals,
+                          const std::vector<std::string> &inputs) const
+{
+    std::string cpp_path = output_path(file_path);
+    if (!write_if_changed(cpp_path, code))
+        return false;
+    if (!header.empty() && !write_if_changed(header_path(file_path), header))
+        return false;
+    if (literal_pool_ && !write_if_changed(cpp_path + ".literals", literals))
+        return false;
+
+    std::string depfile = escape_dep(cpp_path) + ":";
+    std::vector<std::string> deps(inputs);
+    deps.insert(deps.end(), analyzed_files_.begin(), analyzed_files_.end());
+    for (size_t i = 0; i < deps.size(); ++i)
+        depfile += " \\" + br + "  " + escape_dep(deps[i]);
+    depfile += br;
+    if (!write_if_changed(cpp_path + ".d", depfile))
+        return false;
+
+    std::string stamp = inputs_hash(inputs) + br;
+    for (size_t i = 0; i < inputs.size(); ++i)
+        stamp += inputs[i] + br;
+    return write_if_changed(cpp_path + ".stamp", stamp);
+}
+//the include/extends closure of a template, found without compiling it
+bool lemon::resolve_inputs(const std::string &file_path,
+                           std::vector<std::string> &inputs) const
+{
+    for (size_t i = 0; i < inputs.size(); ++i)
+    {
+        if (inputs[i] == file_path)
+            return true;
+    }
+    std::string data;
+    if (!sources_->get(file_path, data))
+        return false;
+    inputs.push_back(file_path);
+
+    size_t pos = 0;
+    while ((pos = data.find("{%", pos)) != std::string::npos)
+    {
+        pos += 2;
+        size_t end = data.find("%}", pos);
+        if (end == std::string::npos)
+            break;
+        std::vector<std::string> tokens =
+            split(data.substr(pos, end - pos), " \r\n\t");
+        pos = end + 2;
+        if (tokens.empty())
+            continue;
+
+        std::string target;
+        if (tokens[0] == "include" && tokens.size() > 1)
+        {
+            //{% include "file" %}
+            target = tokens[1];
+            if (target.size() > 1 &&
+                (target[0] == '"' || target[0] == '\''))
+                target = target.substr(1, target.size() - 2);
+        }
+        else if (tokens[0] == "extends")
+        {
+            //{% extends file %}, the parser joins the tokens
+            for (size_t i = 1; i < tokens.size(); ++i)
+                target += tokens[i];
+        }
+        else if (tokens[0] == "inline_file" && tokens.size() > 1)
+        {
+            //{% inline_file "file" %}, an asset, not scanned for tags
+            std::string asset = tokens[1];
+            if (asset.size() > 1 && (asset[0] == '"' || asset[0] == '\''))
+                asset = asset.substr(1, asset.size() - 2);
+            std::string bytes;
+            if (!sources_->get(asset, bytes))
+                return false;
+            if (std::find(inputs.begin(), inputs.end(), asset) == inputs.end())
+                inputs.push_back(asset);
+        }
+        if (!target.empty() && !resolve_inputs(target, inputs))
+            return false;
+    }
+    return true;
+}
+//the parsed class table, so comment or method edits
+//in headers don't change cache keys.
+std::string lemon::metadata() const
+{
+    std::string buffer;
+    for (size_t i = 0; i < classes_.size(); ++i)
+    {
+        const class_t &cls = classes_[i];
+        for (size_t j = 0; j < cls.namespaces_.size(); ++j)
+            buffer += cls.namespaces_[j] + "::";
+        buffer += cls.name_ + "{";
+        for (size_t j = 0; j < cls.variables_.size(); ++j)
+        {
+            const field &f = cls.variables_[j];
+            for (size_t k = 0; k < f.namespaces_.size(); ++k)
+                buffer += f.namespaces_[k] + "::";
+            buffer += f.type_str_ + " " + f.name_ + ";";
+        }
+        buffer += "}" + br;
+    }
+    return buffer;
+}
+//the outputs name their inputs: the .cpp includes the header of the
+//template, cold functions and the .lmc dependencies keep the paths. so
+//the paths go in as given; relative ones, as build systems pass them,
+//still let checkouts in other places share entries.
+std::string lemon::cache_key(const std::vector<std::string> &inputs) const
+{
+    unsigned long long hash = fnv1a(LEMON_VERSION);
+    //the template comes first
+    hash = fnv1a(options(inputs.empty() ? "" : inputs[0]) + '\0', hash);
+    hash = fnv1a(metadata() + '\0', hash);
+    for (size_t i = 0; i < inputs.size(); ++i)
+    {
+        std::string data;
+        if (!sources_->get(inputs[i], data))
+            return std::string();
+        hash = fnv1a(inputs[i] + '\0', hash);
+        hash = fnv1a(data + '\0', hash);
+    }
+    return to_hex(hash);
+}
+bool lemon::parse_template(const std::string &file_path) const
+{
+    //a dump needs the passes to run
+    if (!dump_ir_ && up_to_date(file_path))
+        return true;
+
+    std::string key;
+    std::string code;
+    std::string header;
+    std::string literals;
+    std::vector<std::string> inputs;
+    if (cache_ && !dump_ir_ && resolve_inputs(file_path, inputs))
+    {
+        key = cache_key(inputs);
+        if (!key.empty() && cache_->get(key, output_ext(), code) &&
+            (backend_ != e_cpp || cache_->get(key, ".h", header)) &&
+            (!literal_pool_ || cache_->get(key, ".literals", literals)))
+            return write_outputs(file_path, code, header, literals, inputs);
+    }
+
+    lemon ctx(classes_, sources_, backend_);
+    copy_options(ctx, file_path);
+    if (!ctx.compile(file_path, code))
+        return false;
+    if (backend_ == e_cpp)
+        header = gen_header(ctx.template_.interface_, ctx.variants_[file_path],
+                            ctx.translated_);
+    literals = pack_literals(ctx.literals_);
+    if (!key.empty())
+    {
+        cache_->put(key, output_ext(), code);
+        if (!header.empty())
+            cache_->put(key, ".h", header);
+        if (literal_pool_)
+            cache_->put(key, ".literals", literals);
+    }
+    return write_outputs(file_path, code, header, literals, ctx.inputs_);
+}
+bool lemon::parse_template(const std::string &file_path,
+                           std::string &code) const
+{
+    //all compilation state lives in a private context,
+    //only the parsed headers are shared.
+    lemon ctx(classes_, sources_, backend_);
+    copy_options(ctx, file_path);
+    return ctx.compile(file_path, code);
+}
+//the literals of a tree from utf-8 into charset, once at compile time
+static void transcode(nodes_t &nodes, const std::string &charset)
+{
+    for (size_t i = 0; i < nodes.size(); ++i)
+    {
+        node_t &node = nodes[i];
+        for (size_t j = 0; j < node.bodies_.size(); ++j)
+            transcode(node.bodies_[j], charset);
+        if (node.type_ != node_t::e_literal || node.str_.empty())
+            continue;
+        acl::charset_conv conv;
+        conv.set_add_invalid(false);
+        acl::string out;
+        if (!conv.convert("utf-8", charset.c_str(), node.str_.data(),
+                          node.str_.size(), &out))
+        {
+            throw std::runtime_error("text not utf-8, or not in charset " +
+                                     charset + ": " + node.str_.substr(0, 40));
+        }
+        node.str_.assign(out.c_str(), out.length());
+    }
+}
+bool lemon::compile(const std::string &file_path, std::string &code)
+{
+    lexer_ = new_lexer(file_path);
+    if(!lexer_)
+    {
+        return false;
+    }
+    try
+    {
+        lexers_.push_back(lexer_);
+        nodes_t nodes;
+        parse_template(nodes);
+        //a function per locale translating some text of the template,
+        //the template itself keeps the source text
+        std::vector<nodes_t> localized;
+        std::map<std::string, std::map<std::string, std::string> >::const_iterator l;
+        for (l = locales_.begin(); backend_ == e_cpp && l != locales_.end(); ++l)
+        {
+            localized.push_back(nodes);
+            size_t count = 0;
+            try
+            {
+                count = translate(localized.back(), l->second);
+            }
+            catch (const std::runtime_error &e)
+            {
+                throw std::runtime_error("locale " + l->first + ": " + e.what());
+            }
+            if (count)
+                translated_.push_back(l->first);
+            else
+                localized.pop_back();
+        }
+        translate(nodes, std::map<std::string, std::string>());
+        if (minify_)
+        {
+            minify_html(nodes);
+            for (size_t i = 0; i < localized.size(); ++i)
+                minify_html(localized[i]);
+        }
+        escape_contexts(nodes);
+        for (size_t i = 0; i < localized.size(); ++i)
+            escape_contexts(localized[i]);
+        //variants start from the parse tree, bytecode has none
+        std::vector<nodes_t> variants;
+        const std::vector<variant_t> &bound = variants_[file_path];
+        for (size_t i = 0; backend_ == e_cpp && i < bound.size(); ++i)
+        {
+            variants.push_back(nodes);
+            bind_constants(variants.back(), bound[i]);
+        }
+
+        pass_manager passes;
+        std::string dump;
+        std::string *out = dump_ir_ ? &dump : NULL;
+        if (out)
+            dump = "; parse" + br + dump_ir(nodes);
+        passes.run(nodes, out);
+        for (size_t i = 0; i < variants.size(); ++i)
+        {
+            if (out)
+                dump += br + "; variant " + bound[i].name_ + br + dump_ir(variants[i]);
+            passes.run(variants[i], out);
+        }
+        for (size_t i = 0; i < localized.size(); ++i)
+        {
+            if (out)
+                dump += br + "; locale " + translated_[i] + br + dump_ir(localized[i]);
+            passes.run(localized[i], out);
+        }
+        use_profile(template_.interface_.name_, nodes);
+        for (size_t i = 0; i < variants.size(); ++i)
+            use_profile(template_.interface_.name_ + "_" + bound[i].name_, variants[i]);
+        for (size_t i = 0; i < localized.size(); ++i)
+            use_profile(template_.interface_.name_ + "_" + translated_[i], localized[i]);
+        if (out && !profiles_.empty())
+        {
+            dump += br + "; profile" + br + dump_ir(nodes);
+            for (size_t i = 0; i < variants.size(); ++i)
+                dump += br + "; profile " + bound[i].name_ + br + dump_ir(variants[i]);
+            for (size_t i = 0; i < localized.size(); ++i)
+                dump += br + "; profile " + translated_[i] + br + dump_ir(localized[i]);
+        }
+        if (out && !write_if_changed(file_path + ".ir", dump))
+            return false;
+        if (!charset_.empty())
+        {
+            if (backend_ == e_vm)
+                throw std::runtime_error("charset " + charset_ + " needs the C++ backend");
+            transcode(nodes, charset_);
+            for (size_t i = 0; i < variants.size(); ++i)
+                transcode(variants[i], charset_);
+            for (size_t i = 0; i < localized.size(); ++i)
+                transcode(localized[i], charset_);
+        }
+        if (backend_ == e_vm)
+            code = gen_program(nodes);
+        else
+            code = gen_template(nodes, variants, localized);
+    }
+    catch (const std::exception& e)
+    {
+        print_lexer_status(e.what());
+        return false;
+    }
+    return true;
+}
+struct compile_task: work_pool::task
+{
+    compile_task(const lemon &lm, const std::string &file_path)
+        :lemon_(lm),
+         file_path_(file_path),
+         ok_(false)
+    {
+
+    }
+    virtual void run()
+    {
+        ok_ = lemon_.parse_template(file_path_);
+    }
+    const lemon &lemon_;
+    std::string file_path_;
+    bool ok_;
+};
+bool lemon::parse_templates(const std::vector<std::string> &file_paths,
+                            int threads) const
+{
+    std::vector<compile_task*> tasks;
+    work_pool pool(threads);
+
+    for (size_t i = 0; i < file_paths.size(); ++i)
+    {
+        tasks.push_back(new compile_task(*this, file_paths[i]));
+        pool.push(tasks.back());
+    }
+    pool.run();
+    if (cache_)
+        cache_->trim();
+
+    bool ok = true;
+    for (size_t i = 0; i < tasks.size(); ++i)
+    {
+        ok = ok && tasks[i]->ok_;
+        delete tasks[i];
+    }
+    return ok;
+}
+// # comment
+// header   models/user.h
+// template views/user.lm
+// locale   fr po/fr.po
+bool lemon::parse_manifest(const std::string &file_path, int threads)
+{
+    std::vector<std::string> templates;
+    if (!load_manifest(file_path, templates))
+        return false;
+    return parse_templates(templates, threads);
+}
+//parse the headers of a manifest and collect its templates
+bool lemon::load_manifest(const std::string &file_path,
+                          std::vector<std::string> &templates)
+{
+    std::ifstream file(file_path.c_str());
+    if (!file.good())
+    {
+        std::cout << "open file error. " << file_path << std::endl;
+        return false;
+    }
+    std::string line;
+    int line_no = 0;
+
+    while (std::getline(file, line))
+    {
+        line_no++;
+        std::vector<std::string> tokens = split(line, " \r\t");
+        if (tokens.empty() || tokens[0][0] == '#')
+            continue;
+        if (tokens[0] == "variant" && tokens.size() >= 3)
+        {
+            //variant <template> <name> <param>=<value> ...
+            size_t pos = line.find(tokens[0]) + tokens[0].size();
+            pos = line.find(tokens[1], pos) + tokens[1].size();
+            pos = line.find(tokens[2], pos) + tokens[2].size();
+            if (!add_variant(tokens[1], tokens[2], line.substr(pos)))
+            {
+                std::cout << file_path << ":" << line_no << ": bad variant"
+                          << std::endl;
+                return false;
+            }
+            continue;
+        }
+        if (tokens[0] == "locale" && tokens.size() == 3)
+        {
+            //locale <name> <catalog.po>
+            if (!add_locale(tokens[1], tokens[2]))
+                return false;
+            continue;
+        }
+        if (tokens[0] == "charset" && tokens.size() == 3)
+        {
+            //charset <template> <name>
+            if (!set_charset(tokens[2], tokens[1]))
+                return false;
+            continue;
+        }
+        if (tokens.size() != 2)
+        {
+            std::cout << file_path << ":" << line_no
+                      << ": expect `header <path>`, `template <path>`, "
+                      << "`variant <path> <name> <param>=<value> ...`, "
+                      << "`locale <name> <catalog.po>` or "
+                      << "`charset <path> <name>`"
+                      << std::endl;
+            return false;
+        }
+        if (tokens[0] == "header")
+        {
+            if (!parse_cpp_header(tokens[1]))
+                return false;
+        }
+        else if (tokens[0] == "template")
+        {
+            templates.push_back(tokens[1]);
+        }
+        else
+        {
+            std::cout << file_path << ":" << line_no
+                      << ": unknown entry " << tokens[0] << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+void lemon::read_line()
+{
+    if (std::getline(*(lexer_->file_), lexer_->line_buffer_).good())
+    {
+        lexer_->line_buffer_ += "\r\n";
+        lexer_->current_line_ = lexer_->line_buffer_;
+        lexer_->line_++;
+        return;
+    }
+    lexer_->line_buffer_.clear();
+}
+void lemon::move_buffer(int offset)
+{
+    lexer_->line_buffer_ = lexer_->line_buffer_.substr(offset);
+}
+std::string lemon::get_string(const std::string &delimiters)
+{
+    std::string buffer;
+    if (delimiters.empty())
+        return lexer_->line_buffer_;
+
+    for (size_t i = 0; i < lexer_->line_buffer_.size(); i++)
+    {
+        char ch = lexer_->line_buffer_[i];
+        if (delimiters[0] != ch)
+        {
+            buffer.push_back(ch);
+        }
+        else 
+        {
+            int k = 0;
+            bool ok = true;
+            for (size_t j = i; j < lexer_->line_buffer_.size() &&
+                 k < delimiters.size(); j++,k++)
+            {
+                if (lexer_->line_buffer_[j] != delimiters[k])
+                {
+                    ok = false;
+                    break;
+                }
+            }
+            if (ok)
+                return buffer;
+        }
+    }
+    return buffer;
+}
+std::string lemon::get_string(size_t len)
+{
+    if (len > lexer_->line_buffer_.size())
+        len = lexer_->line_buffer_.size();
+
+    return std::string (lexer_->line_buffer_.c_str(),len);
+}
+std::string lemon::next_token(const std::string &delimiters, const std::string &skips)
+{
+    std::string buffer;
+
+    do
+    {
+        if (lexer_->line_buffer_.empty())
+            read_line();
+        if (lexer_->line_buffer_.empty())
+            return buffer;
+        if(skips.size())
+            skip(lexer_->line_buffer_,skips);
+        if (!lexer_->line_buffer_.empty())
+            break;
+    } while (true);
+    
+
+    for (size_t i = 0; i < lexer_->line_buffer_.size(); i++)
+    {
+        char ch = lexer_->line_buffer_[i];
+        if (delimiters.find(ch) == std::string::npos)
+        {
+            buffer.push_back(ch);
+        }
+        else
+        {
+            if(buffer.empty())
+                buffer.push_back(ch);
+            break;
+        }
+    }
+    lexer_->line_buffer_ = lexer_->line_buffer_.substr(buffer.size());
+    return buffer;
+}
+void lemon::push_back(const lemon::token_t &value)
+{
+    tokens_.push_back(value);
+}
+int lemon::line()
+{
+    return lexer_->line_;
+}
+void lemon::assert_not_eof(const token_t &t)
+{
+    if(t.type_ == token_t::e_eof)
+        throw syntax_error("end of file error");
+}
+#define eof_assert(T)  assert_not_eof(T)
+lemon::token_t lemon::curr_token()
+{
+    return lexer_->token_;
+}
+void lemon::clear_line_buffer()
+{
+    lexer_->line_buffer_.clear();
+}
+
+static const std::string g_delimiters = " <>{}()[]%&!?:;|,\\/.\r\t\n\"'`=-";
+
+lemon::token_t lemon::get_next_token(const std::string &skip_str)
+{
+    token_t t;
+    std::string str;
+    if (tokens_.size())
+    {
+        t = tokens_.front();
+        tokens_.pop_front();
+        return t;
+    }
+    else
+    {
+        if (skip_str.size())
+        {
+            skip(lexer_->line_buffer_, skip_str);
+        }
+        str = next_token(g_delimiters,skip_str);
+        t.str_ = str;
+    }
+
+    if (str == " ")
+    {
+        t.type_ = token_t::e_space;
+    }
+    else if (str == "\t")
+    {
+        t.type_ = token_t::e_$t;
+    }
+    else if (str == "\r")
+    {
+        t.type_ = token_t::e_$r;
+    }
+    else if (str == "\n")
+    {
+        t.type_ = token_t::e_$n;
+    }
+   
+    else if (str == "")
+    {
+        t.type_ = token_t::e_eof;
+    }
+    else if (str == "<")
+    {
+        t.type_ = token_t::e_less;
+        if (get_string(1) == "=")
+        {
+            move_buffer(1);
+            t.type_ = token_t::e_le;
+            t.str_ = "<=";
+        }
+        else if (get_string(3) == "!--")
+        {
+            move_buffer(3);
+            t.str_ = "<!--";
+            t.type_ = token_t::e_html_comment_begin;
+        }
+    }
+    else if (str == "-")
+    {
+        t.type_ = token_t::e_sub;
+        if (get_string(2) == "->")
+        {
+            move_buffer(2);
+            t.str_ = "-->";
+            t.type_ = token_t::e_html_comment_end;
+        }
+    }
+    else if (str == ">")
+    {
+        t.type_ = token_t::e_gt;
+        if (get_string(1) == "=")
+        {
+            move_buffer(1);
+            t.type_ = token_t::e_ge;
+            t.str_ = ">=";
+        }
+    }
+    else if (str == "{")
+    {
+        t.type_ = token_t::e_open_brace;
+        if (get_string(1) == "{")
+        {
+            t.type_ = token_t::e_open_variable;
+            t.str_ = "{{";
+            move_buffer(1);
+        }
+        else if (get_string(1) == "%")
+        {
+            t.type_ = token_t::e_open_block;
+            t.str_  = "{%";
+            move_buffer(1);
+        }
+    }
+    else if (str == "}")
     {
         t.type_ = token_t::e_close_brace;
         if (get_string(1) == "}")
@@ -388,11 +1400,13 @@ lemon::token_t lemon::get_next_token(const std::string &skip_str)
         if(get_string(1) == "/")
         {
             move_buffer(1);
+            t.str_ = "//";
             t.type_ = token_t::e_cpp_comment;
         }
         else if(get_string(1) == "*")
         {
             move_buffer(1);
+            t.str_ = "/*";
             t.type_ = token_t::e_cpp_comment_begin;
         }
     }
@@ -402,6 +1416,7 @@ lemon::token_t lemon::get_next_token(const std::string &skip_str)
         if (get_string(1) == "/")
         {
             move_buffer(1);
+            t.str_ = "*/";
             t.type_ = token_t::e_cpp_comment_end;
         }
     }
@@ -448,6 +1463,7 @@ lemon::token_t lemon::get_next_token(const std::string &skip_str)
         if (get_string(1) == "}")
         {
             move_buffer(1);
+            t.str_ = "%}";
             t.type_ = token_t::e_close_block;
         }
     }
@@ -548,6 +1564,50 @@ lemon::token_t lemon::get_next_token(const std::string &skip_str)
     {
         t.type_ = token_t::e_endautoescape;
     }
+    else if(str == "macro")
+    {
+        t.type_ = token_t::e_macro;
+    }
+    else if(str == "endmacro")
+    {
+        t.type_ = token_t::e_endmacro;
+    }
+    else if(str == "call")
+    {
+        t.type_ = token_t::e_call;
+    }
+    else if(str == "cold")
+    {
+        t.type_ = token_t::e_cold;
+    }
+    else if(str == "endcold")
+    {
+        t.type_ = token_t::e_endcold;
+    }
+    else if(str == "inline_file")
+    {
+        t.type_ = token_t::e_inline_file;
+    }
+    else if(str == "trans")
+    {
+        t.type_ = token_t::e_trans;
+    }
+    else if(str == "blocktrans")
+    {
+        t.type_ = token_t::e_blocktrans;
+    }
+    else if(str == "endblocktrans")
+    {
+        t.type_ = token_t::e_endblocktrans;
+    }
+    else if(str == "spaceless")
+    {
+        t.type_ = token_t::e_spaceless;
+    }
+    else if(str == "endspaceless")
+    {
+        t.type_ = token_t::e_endspaceless;
+    }
     //
     else if (str == ".")
     {
@@ -657,12 +1717,14 @@ lemon::token_t lemon::get_next_token(const std::string &skip_str)
             }
             else
             {
+                t.type_ = token_t::e_identifier;
                 tokens_.push_back(t2);
                 tokens_.push_back(t3);
             }
         }
         else
         {
+            t.type_ = token_t::e_identifier;
             tokens_.push_back(t2);
         }
     }
@@ -681,6 +1743,33 @@ lemon::token_t lemon::get_next_token(const std::string &skip_str)
             }
         }
     }
+    else if (str == "lm")
+    {
+        token_t t2 = get_next_token();
+        eof_assert(t2);
+        if (t2.type_ == token_t::e_double_colon)
+        {
+            token_t t3 = get_next_token();
+            eof_assert(t3);
+            if (t3.str_ == "safe_string")
+            {
+                t.type_ = token_t::e_safe_string;
+                t.str_ = "lm::safe_string";
+            }
+            else
+            {
+                //a variable or field named lm
+                t.type_ = token_t::e_identifier;
+                tokens_.push_back(t2);
+                tokens_.push_back(t3);
+            }
+        }
+        else
+        {
+            t.type_ = token_t::e_identifier;
+            tokens_.push_back(t2);
+        }
+    }
     else if (str == ",")
     {
         t.type_ = token_t::e_comma;
@@ -845,7 +1934,8 @@ lemon::field lemon::parse_param()
         t.type_ == token_t::e_long_long||
         t.type_ == token_t::e_unsigned_long_long||
         t.type_ == token_t::e_std_string||
-        t.type_ == token_t::e_acl_string)
+        t.type_ == token_t::e_acl_string||
+        t.type_ == token_t::e_safe_string)
     {
         f.type_ = get_field_type(t);
     }
@@ -1191,75 +2281,32 @@ static inline bool check_list(const std::string &str)
     }
     return skip_all(str," \r\t\n") == "std::list";
 }
-
-int g_tab;
-std::string tab()
-{
-    std::string tab (g_tab ,'\t');
-    return tab;
-}
-#define CODE_BEGIN  (tab() + "code += \"")
-#define CODE_END ("\";" + br)
-struct code_buffer
+static inline bool check_set(const std::string &str)
 {
-    code_buffer()
-    {
-    }
-    code_buffer &operator +=(const std::string &str)
-    {
-        if (str == "\t")
-            return *this;
-
-        if(str == CODE_BEGIN)
-        {
-            code_.append(line_);
-            line_= str;
-        }
-        else if(str == CODE_END)
-        {
-            if(line_ == CODE_BEGIN)
-            {
-                line_.clear();
-                return *this;
-            }
-            line_.append(str);
-            //std::cout << line_ << std::flush;
-            code_.append(line_);
-            line_.clear();
-        }
-        else if (str == " ")
-        {
-            if (line_ == CODE_BEGIN)
-            {
-                return *this;
-            }
-            line_.append(str);
-        }
-        else 
-        {
-            if (line_.empty())
-                code_.append(str);
-            else
-                line_.append(str);
-        }
+    std::string buffer;
 
-        return *this;
-        //std::cout << str << std::flush;
-    }
-    operator std::string ()
+    size_t pos = str.find_first_of('<');
+    if(pos != std::string::npos)
     {
-        return code_+line_;
+        buffer = str.substr(0,pos);
+        return skip_all(buffer," \r\t\n") == "std::set";
     }
-    std::string line_;
-    std::string code_;
-};
+    return skip_all(str," \r\t\n") == "std::set";
+}
 
+std::string lemon::tab()
+{
+    std::string tab (tab_ ,'\t');
+    return tab;
+}
 lemon::field::type lemon::get_field_type(const token_t& token)
 {
     switch (token.type_)
     {
         case token_t::e_void:
             return field::e_void;
+        case token_t::e_bool:
+            return field::e_bool;
         case token_t::e_char:
             return field::e_char;
         case token_t::e_unsigned_char:
@@ -1292,6 +2339,8 @@ lemon::field::type lemon::get_field_type(const token_t& token)
             return field::e_std_string;
         case token_t::e_acl_string:
             return field::e_acl_string;
+        case token_t::e_safe_string:
+            return field::e_safe_string;
         default:
             throw syntax_error("unknown type");
     }
@@ -1315,6 +2364,30 @@ lemon::field::type lemon::get_field_type(const std::string &type)
     {
         return field::e_std_list;
     }
+    else if (tokens[0] == "std::map")
+    {
+        return field::e_std_map;
+    }
+    else if (tokens[0] == "std::set")
+    {
+        return field::e_std_set;
+    }
+    else if (tokens[0] == "acl::string")
+    {
+        return field::e_acl_string;
+    }
+    else if (tokens[0] == "lm::safe_string")
+    {
+        return field::e_safe_string;
+    }
+    else if (tokens[0] == "bool")
+    {
+        return field::e_bool;
+    }
+    else if (tokens[0] == "char")
+    {
+        return field::e_char;
+    }
     else if (tokens[0] == "short")
     {
         return field::e_short;
@@ -1379,27 +2452,39 @@ lemon::field::type lemon::get_field_type(const std::string &type)
     throw syntax_error("not support type: "+tokens[0]);
     return field::e_void;
 }
-std::string lemon::get_code()
+expr_t lemon::gen_test(const expr_t &item)
 {
-    return "";
-}
-std::string lemon::gen_bool_code(const std::string &item)
-{
-    std::string item_type = get_type(item);
-    field::type type = get_field_type(item_type);
+    field::type type = get_field_type(item.type_str_);
+    expr_t test(expr_t::e_test, "empty");
+
     if (type == field::e_std_vector ||
         type == field::e_std_list ||
         type == field::e_std_map||
-        type == field::e_std_string)
-    {
-        return "!"+item + ".empty()";
+        type == field::e_std_set||
+        type == field::e_std_string||
+        type == field::e_acl_string||
+        type == field::e_safe_string)
+    {
+        test.str_ = "empty";
+    }
+    else if (type == field::e_bool ||
+             type == field::e_char ||
+             type == field::e_unsigned_char ||
+             type == field::e_short ||
+             type == field::e_unsigned_shot ||
+             type == field::e_int ||
+             type == field::e_unsigned_int ||
+             type == field::e_long ||
+             type == field::e_unsigned_long ||
+             type == field::e_long_long ||
+             type == field::e_unsigned_long_long)
+    {
+        test.str_ = "zero";
     }
-    else if (type == field::e_int)
-    {
-        return item +" != 0";
-    }
-    throw syntax_error("not support type: "+item_type);
-    return std::string();
+    else
+        throw syntax_error("not support type: "+item.type_str_);
+    test.args_.push_back(item);
+    return test;
 }
 
 bool lemon::check_filter(const std::string &name)
@@ -1407,92 +2492,163 @@ bool lemon::check_filter(const std::string &name)
     return filters_.find(name) != filters_.end();
 }
 
-std::string lemon::parse_if()
+static inline bool is_number(const std::string &str)
 {
-    code_buffer code;
-
-    std::string item;
-    bool flag = false;
-    bool pipeline = false;
-    bool op = false;
-
-    code += tab() + "if(";
+    return !str.empty() && ((str[0] >= '0' && str[0] <= '9') ||
+                            (str[0] == '-' && str.size() > 1));
+}
+//a.b.c|filter, "text" or 42
+expr_t lemon::parse_operand(bool &raw)
+{
+    expr_t item;
+    token_t t = get_next_token();
+    eof_assert(t);
 
-    do
+    raw = false;
+    if (t.type_ == token_t::e_double_quote)
     {
-        token_t t = get_next_token();
-        eof_assert(t);
-        if (t.type_ == token_t::e_close_block)
-        {
-            if (item.empty())
-                throw syntax_error("not find variable ");
-            if (!op && !pipeline)
-                code += gen_bool_code(item);
-            else
-                code += item;
-            if (flag)
-                code += ")";
-            break;
-        }
-        else if (t.type_ == token_t::e_and)
-        {
-            flag = true;
-            code += "(";
-            if (pipeline)
-                code += item;
-            else
-                code += gen_bool_code(item);
-            code += ")&&(";
-            item.clear();
-            pipeline = false;
-            op = false;
-        }
-        else if (t.type_ == token_t::e_or)
+        item.type_ = expr_t::e_string;
+        do
         {
-            flag = true;
-            code += "(";
-            if (pipeline)
-                code += item;
-            else
-                code += gen_bool_code(item);
-            code += ")||(";
-            item.clear();
-            pipeline = false;
-            op = false;
-        }
-        else if (t.type_ == token_t::e_pipeline)
+            t = get_next_token(std::string());
+            eof_assert(t);
+            if (t.type_ == token_t::e_double_quote)
+                break;
+            item.str_ += t.str_;
+        } while (true);
+        raw = true;
+        return item;
+    }
+    if (t.type_ == token_t::e_sub || is_number(t.str_))
+    {
+        item.type_ = expr_t::e_number;
+        item.str_ = t.str_;
+        do
         {
             t = get_next_token();
-            eof_assert(t);
-            if (!check_filter(t.str_))
-                throw syntax_error("unknown filter "+t.str_);
-            pipeline = true;
-            std::string filter = t.str_;
+            if (t.type_ == token_t::e_dot || is_number(t.str_))
+            {
+                item.str_ += t.str_;
+                continue;
+            }
+            push_back(t);
+            break;
+        } while (true);
+        raw = true;
+        return item;
+    }
+    push_back(t);
+    item = variable(get_variable());
 
-            item = "lm::$"+filter + "(" + item + ")";
-        }
-        else if (t.type_ == token_t::e_gt||
-                 t.type_ == token_t::e_ge||
-                 t.type_ == token_t::e_le||
-                 t.type_ == token_t::e_less||
-                 t.type_ == token_t::e_neq)
-        {
-            op = true;
-            item += t.str_;
-        }
-        else
+    do
+    {
+        t = get_next_token();
+        if (t.type_ != token_t::e_pipeline)
         {
-            item += t.str_;
+            push_back(t);
+            break;
         }
+        t = get_next_token();
+        eof_assert(t);
+        if (!check_filter(t.str_))
+            throw syntax_error("unknown filter "+t.str_);
+        expr_t call(expr_t::e_call, t.str_);
+        call.args_.push_back(item);
+        item = call;
+        raw = true;
+    } while (true);
+    return item;
+}
+// a.b > 0
+expr_t lemon::parse_compare()
+{
+    token_t t = get_next_token();
+    eof_assert(t);
+    if (t.type_ == token_t::e_not)
+    {
+        expr_t item(expr_t::e_not, "");
+        item.args_.push_back(parse_compare());
+        return item;
+    }
+    push_back(t);
+
+    bool raw = false;
+    expr_t item = parse_operand(raw);
+
+    t = get_next_token();
+    eof_assert(t);
+    if (t.type_ == token_t::e_gt||
+        t.type_ == token_t::e_ge||
+        t.type_ == token_t::e_le||
+        t.type_ == token_t::e_less||
+        t.type_ == token_t::e_eq||
+        t.type_ == token_t::e_neq)
+    {
+        expr_t cmp(expr_t::e_compare, t.str_);
+        cmp.args_.push_back(item);
+        cmp.args_.push_back(parse_operand(raw));
+        return cmp;
+    }
+    push_back(t);
+    if (raw)
+        return item;
+    return gen_test(item);
+}
+// a and b or not c %}
+expr_t lemon::parse_condition()
+{
+    expr_t any(expr_t::e_or, "||");
+    expr_t all(expr_t::e_and, "&&");
 
+    do
+    {
+        all.args_.push_back(parse_compare());
+
+        token_t t = get_next_token();
+        eof_assert(t);
+        if (t.type_ == token_t::e_and)
+            continue;
+        if (all.args_.size() == 1)
+            any.args_.push_back(all.args_[0]);
+        else
+            any.args_.push_back(all);
+        all.args_.clear();
+        if (t.type_ == token_t::e_or)
+            continue;
+        if (t.type_ != token_t::e_close_block)
+            throw syntax_error("not find %}");
+        break;
     } while (true);
 
-    code += ")" + br;
-    code += tab() + "{" + br;
-    g_tab++;
-    code += parse_html();
+    if (any.args_.size() == 1)
+        return any.args_[0];
+    return any;
+}
+void lemon::parse_if(nodes_t &nodes)
+{
+    nodes.push_back(node_t(node_t::e_if));
+    node_t &node = nodes.back();
+    node.line_ = line();
+    node.file_path_ = lexer_->file_path_;
 
-    return code;
+    push_status(token_t::e_if);
+    do
+    {
+        node.conds_.push_back(parse_condition());
+        node.bodies_.push_back(nodes_t());
+        token_t::type_t end = parse_html(node.bodies_.back());
+        if (end == token_t::e_elif)
+            continue;
+        if (end == token_t::e_else)
+        {
+            node.bodies_.push_back(nodes_t());
+            end = parse_html(node.bodies_.back());
+        }
+        if (end != token_t::e_endif)
+            throw syntax_error("status error "+ get_status_str());
+        break;
+    } while (true);
+    pop_status();
 }
 // {% for key, value in items%}
 // {% for key in items%}
@@ -1560,22 +2716,7 @@ void lemon::pop_stack()
         stack_.pop_back();
 }
 
-void lemon::pop_for_item()
-{
-    for_items_.pop_back();
-}
-
-void lemon::add_for_item(const std::string &item)
-{
-    for_items_.push_back(item);
-}
-std::string lemon::get_for_item()
-{
-    if (for_items_.empty())
-        throw syntax_error("for_items empty");
-    return for_items_.back();
-}
-std::string lemon::to_string(const namespaces_t &namespaces)
+std::string lemon::to_string(const namespaces_t &namespaces) const
 {
     std::string str;
     for (size_t i = 0; i < namespaces.size(); ++i)
@@ -1585,11 +2726,14 @@ std::string lemon::to_string(const namespaces_t &namespaces)
     }
     return str;
 }
-std::string lemon::parse_for()
+void lemon::parse_for(nodes_t &nodes)
 {
-    code_buffer code;
+    nodes.push_back(node_t(node_t::e_for));
+    node_t &node = nodes.back();
+    node.line_ = line();
+    node.file_path_ = lexer_->file_path_;
+    node.iterator_ = get_iterator();
 
-    std::string it = get_iterator();
     token_t t1 = get_next_token();
     token_t t2 = get_next_token();
     eof_assert(t1);
@@ -1606,29 +2750,19 @@ std::string lemon::parse_for()
 
         std::string items = get_for_items();
         std::string items_type = get_type(items);
-        add_for_item(items);
-
-        code += tab() + items_type + "::const_iterator " + it;
-        code += " = " + items + ".begin();" + br;
-        code += tab() + "for (; " + it + " != ";
-        code += items + ".end(); ++" + it + ")" + br;
-        code += tab() + "{" + br;
-        g_tab++;
-
-
-        std::string key = t1.str_;
-        std::string value = t3.str_;
-
-        std::string key_type = get_first_type(items_type);
-        std::string value_type = get_second_type(items_type);
-
-        code += tab() + "const " + key_type + " &" + key;
-        code += " = " + it + "->first;" + br;
-        code += tab() + "const " + value_type + " &" + value;
-        code += " = " + it + "->second;" + br;
-
-        push_stack(key, key_type);
-        push_stack(value, value_type);
+        if (!check_map(items_type))
+            throw syntax_error(items + " is not std::map");
+
+        node.loop_ = node_t::e_loop_map;
+        node.key_ = t1.str_;
+        node.value_ = t3.str_;
+        node.key_type_ = get_first_type(items_type);
+        node.value_type_ = get_second_type(items_type);
+        node.items_type_ = items_type;
+        node.expr_ = variable(items);
+
+        push_stack(node.key_, node.key_type_);
+        push_stack(node.value_, node.value_type_);
         push_stack_size(2);
     }
         //{% for v in items %}
@@ -1639,41 +2773,42 @@ std::string lemon::parse_for()
 
         std::string items = get_for_items();
         std::string items_type = get_type(items);
-        add_for_item(items);
 
-        code += tab() + items_type + "::const_iterator " + it;
-        code += " = " + items + ".begin();" + br;
-        code += tab() + "for (; " + it + " != ";
-        code += items + ".end(); ++" + it + ")" + br;
-        code += tab() + "{" + br;
-        g_tab++;
+        node.value_ = t1.str_;
+        node.items_type_ = items_type;
+        node.expr_ = variable(items);
 
-        if (check_list(items_type) || check_vector(items_type))
+        if (check_list(items_type) ||
+            check_vector(items_type) ||
+            check_set(items_type))
         {
-            std::string item = t1.str_;
-            std::string item_type = get_next_type(items_type);
-
-            code += tab() + "const " + item_type + " &" + item;
-            code += " = *" + it + ";" + br;
-
-            push_stack(item, item_type);
-            push_stack_size(1);
+            node.loop_ = node_t::e_loop_list;
+            node.value_type_ = get_next_type(items_type);
         }
         else if (check_map(items_type))
         {
-            std::string value = t1.str_;
-            std::string value_type = get_second_type(items_type);
-            code += tab() + "const " + value_type + " &" + value;
-            code +=" = " + it + "->second;" + br;
-
-            push_stack(value, value_type);
-            push_stack_size(1);
+            node.loop_ = node_t::e_loop_map_value;
+            node.value_type_ = get_second_type(items_type);
         }
-    }
+        else
+            throw syntax_error("can't iterate " + items_type);
 
-    code +=parse_html();
+        push_stack(node.value_, node.value_type_);
+        push_stack_size(1);
+    }
 
-    return code;
+    push_status(token_t::e_for);
+    node.bodies_.push_back(nodes_t());
+    token_t::type_t end = parse_html(node.bodies_.back());
+    if (end == token_t::e_empty)
+    {
+        node.bodies_.push_back(nodes_t());
+        end = parse_html(node.bodies_.back());
+    }
+    if (end != token_t::e_endfor)
+        throw syntax_error("status error "+ get_status_str());
+    pop_status();
+    pop_stack();
 }
 std::string lemon::get_default_string()
 {
@@ -1686,7 +2821,7 @@ std::string lemon::get_default_string()
         throw syntax_error("not find \" ");
     do
     {
-        t = get_next_token("");
+        t = get_next_token(std::string());
         if(t.type_ != token_t::e_double_quote)
             buffer.append(t.str_);
         else
@@ -1715,26 +2850,53 @@ std::string lemon::get_variable()
 
     return code;
 }
-std::string lemon::to_string(const std::string &name,const std::string &type)
+expr_t lemon::variable(const std::string &path)
+{
+    expr_t item(expr_t::e_variable, path);
+    std::vector<std::string> tokens = split(path, ".");
+    if (tokens.empty())
+        throw syntax_error("not find variable");
+    std::string prefix;
+    for (size_t i = 0; i < tokens.size(); ++i)
+    {
+        if (i)
+            prefix += ".";
+        prefix += tokens[i];
+        item.types_.push_back(get_type(prefix));
+    }
+    item.type_str_ = item.types_.back();
+    if (item.type_str_.empty())
+        throw syntax_error("unknown " + path);
+    return item;
+}
+static inline expr_t make_call(const std::string &name, const expr_t &arg)
 {
-    field::type_t t = get_field_type(type);
-    if (t == field::e_std_string||
-            t == field::e_acl_string)
-        return name;
-    return "$to_string("+name+")";
+    expr_t call(expr_t::e_call, name);
+    call.type_str_ = arg.type_str_;
+    call.args_.push_back(arg);
+    return call;
 }
-std::string lemon::parse_variable()
+static inline bool is_string(const expr_t &item)
 {
-    std::string code = tab() + "code += ";
-    bool safe = false;
-    std::string item = get_variable();
-    std::string type = get_type(item);
-    if (type.empty())
-        throw syntax_error("unknown " + item);
-    std::string to_str = to_string(item, type);
-    if(to_str != item)
-        safe = true;
-    item = to_str;
+    return item.type_str_ == "std::string" ||
+           item.type_str_ == "acl::string" ||
+           item.type_str_ == "lm::safe_string";
+}
+//numbers and containers are printed with lm::$to_string,
+//their text needs no escaping.
+static inline expr_t stringify(const expr_t &item)
+{
+    if (is_string(item))
+        return item;
+    expr_t call = make_call("to_string", item);
+    call.type_str_ = "std::string";
+    return call;
+}
+void lemon::parse_variable(nodes_t &nodes)
+{
+    expr_t item = variable(get_variable());
+    //escaped or html already, so is its default
+    bool safe = item.type_str_ == "lm::safe_string";
     token_t t = get_next_token();
     eof_assert(t);
     if (t.type_ == token_t::e_pipeline)
@@ -1745,10 +2907,15 @@ std::string lemon::parse_variable()
             //{{ data|default:"string" }}
             if(t.type_ == token_t::e_default)
             {
-                if(auto_escape())
-                    item = "lm::$escape("+item+")";
-                std::string str = get_default_string();
-                item = "lm::$"+t.str_ + "(" + item + ", \""+str+"\")";
+                if (!is_string(item))
+                    safe = true;
+                item = stringify(item);
+                if(auto_escape() && !safe)
+                    item = make_call("escape", item);
+                item = make_call(t.str_, item);
+                item.args_.push_back(expr_t(expr_t::e_string,
+                                            get_default_string()));
+                item.type_str_ = "std::string";
                 safe = true;
             }
             else if(t.type_ == token_t::e_safe)
@@ -1757,7 +2924,9 @@ std::string lemon::parse_variable()
             {
                 if(!check_filter(t.str_))
                     throw syntax_error("not found filter :" + t.str_);
-                item = "lm::$"+t.str_ + "(" + item + ")";
+                item = make_call(t.str_, item);
+                if (t.type_ == token_t::e_length)
+                    item.type_str_ = "size_t";
             }
             t = get_next_token();
             eof_assert(t);
@@ -1765,17 +2934,35 @@ std::string lemon::parse_variable()
                 continue;
             else if (t.type_ == token_t::e_close_variable)
                 break;
+            else
+                throw syntax_error("not find }}");
 
         } while (true);
     }
     else if (t.type_ != token_t::e_close_variable)
         throw syntax_error("unknown "+ t.str_);
+    if (!is_string(item))
+    {
+        if (item.type_ == expr_t::e_variable)
+        {
+            field::type type = get_field_type(item.type_str_);
+            if (type == field::e_class ||
+                type == field::e_std_vector ||
+                type == field::e_std_list ||
+                type == field::e_std_map ||
+                type == field::e_std_set)
+                throw syntax_error("can't print " + item.str_);
+        }
+        item = stringify(item);
+        safe = true;
+    }
     if(!safe && auto_escape())
-        item = "lm::$escape("+item+")";
-    code += item;
-    code += ";" + br;
+        item = make_call("escape", item);
 
-    return code;
+    nodes.push_back(node_t(node_t::e_emit));
+    nodes.back().expr_ = item;
+    nodes.back().line_ = line();
+    nodes.back().file_path_ = lexer_->file_path_;
 }
 //{% include "includes/nav.html" %}
 std::string lemon::get_include_filepath()
@@ -1804,12 +2991,177 @@ std::string lemon::get_include_filepath()
 
         }while (true);
     }
-    return file_path;
+    return file_path;
+}
+//strings as <size> <bytes>, the param strings may hold any byte
+static void write_string(std::string &out, const std::string &str)
+{
+    out += number(str.size()) + " " + str;
+}
+static std::string read_string(std::istream &in)
+{
+    size_t size = 0;
+    if (!(in >> size) || in.get() != ' ')
+        throw std::runtime_error("bad parse tree cache entry");
+    std::string str(size, '\0');
+    if (size)
+        in.read(&str[0], size);
+    return str;
+}
+void lemon::write_fields(std::string &out, const fields_t &fields)
+{
+    out += number(fields.size()) + " ";
+    for (size_t i = 0; i < fields.size(); ++i)
+    {
+        const field &f = fields[i];
+        out += number(f.type_) + " " + number(f.line_) + " ";
+        write_string(out, f.name_);
+        write_string(out, f.str_);
+        write_string(out, f.type_str_);
+        out += number(f.namespaces_.size()) + " ";
+        for (size_t j = 0; j < f.namespaces_.size(); ++j)
+            write_string(out, f.namespaces_[j]);
+    }
+}
+lemon::fields_t lemon::read_fields(std::istream &in)
+{
+    size_t size = 0;
+    in >> size;
+    fields_t fields(size);
+    for (size_t i = 0; i < size; ++i)
+    {
+        field &f = fields[i];
+        int type = 0;
+        size_t namespaces = 0;
+        in >> type >> f.line_;
+        f.type_ = (field::type_t)type;
+        f.name_ = read_string(in);
+        f.str_ = read_string(in);
+        f.type_str_ = read_string(in);
+        in >> namespaces;
+        for (size_t j = 0; j < namespaces; ++j)
+            f.namespaces_.push_back(read_string(in));
+    }
+    if (!in)
+        throw std::runtime_error("bad parse tree cache entry");
+    return fields;
+}
+//what the parse of an include depends on besides the files: variables,
+//macros, autoescape, the tags it is in and the blocks of a child
+std::string lemon::bindings() const
+{
+    std::string key;
+    write_fields(key, stack_);
+    std::map<std::string, fields_t>::const_iterator it;
+    for (it = macros_.begin(); it != macros_.end(); ++it)
+    {
+        write_string(key, it->first);
+        write_fields(key, it->second);
+    }
+    key += "\n";
+    for (size_t i = 0; i < auto_escape_.size(); ++i)
+        key += auto_escape_[i] ? '1' : '0';
+    key += is_base_ ? "\n1" : "\n0";
+    for (size_t i = 0; i < status_.size(); ++i)
+        key += " " + number(status_[i]);
+    key += "\n";
+    for (size_t i = 0; i < blocks_.size(); ++i)
+    {
+        write_string(key, blocks_[i].name_);
+        write_string(key, blocks_[i].file_path_);
+        key += number(blocks_[i].offset_) + " ";
+    }
+    return key;
+}
+//it<n> of the loops of a tree to it<n + offset>
+static void shift_iterators(nodes_t &nodes, int offset)
+{
+    for (size_t i = 0; i < nodes.size(); ++i)
+    {
+        if (nodes[i].type_ == node_t::e_for)
+        {
+            char buffer[32];
+            sprintf(buffer, "it%d", atoi(nodes[i].iterator_.c_str() + 2) + offset);
+            nodes[i].iterator_ = buffer;
+        }
+        for (size_t j = 0; j < nodes[i].bodies_.size(); ++j)
+            shift_iterators(nodes[i].bodies_[j], offset);
+    }
+}
+//nodes of a tree parsed before in the same bindings, with the inputs,
+//macros and iterators the parse would have added
+bool lemon::cached_tree(const std::string &key, nodes_t &nodes)
+{
+    source_cache::tree t;
+    if (!sources_->get_tree(key, t))
+        return false;
+    shift_iterators(t.nodes_, iterators_ - t.first_iterator_);
+    iterators_ += t.iterators_;
+    for (size_t i = 0; i < t.inputs_.size(); ++i)
+        add_input(t.inputs_[i]);
+    std::istringstream in(t.macros_);
+    while (in >> std::ws && !in.eof())
+    {
+        std::string name = read_string(in);
+        macros_[name] = read_fields(in);
+    }
+    nodes.insert(nodes.end(), t.nodes_.begin(), t.nodes_.end());
+    return true;
+}
+//the tree of a parse that started at reads_[reads], with macros_ and
+//iterators_ as they were then. inputs are files it depends on that it
+//did not read, the child of a base template.
+void lemon::cache_tree(const std::string &key, const nodes_t &nodes,
+                       std::vector<std::string> inputs, size_t reads,
+                       const std::map<std::string, fields_t> &macros,
+                       int iterators)
+{
+    source_cache::tree t;
+    t.nodes_ = nodes;
+    inputs.insert(inputs.end(), reads_.begin() + reads, reads_.end());
+    for (size_t i = 0; i < inputs.size(); ++i)
+    {
+        if (std::find(t.inputs_.begin(), t.inputs_.end(), inputs[i]) != t.inputs_.end())
+            continue;
+        std::string data;
+        if (!sources_->get(inputs[i], data))
+            return;
+        t.inputs_.push_back(inputs[i]);
+        t.hashes_.push_back(fnv1a(data));
+    }
+    std::map<std::string, fields_t>::const_iterator it;
+    for (it = macros_.begin(); it != macros_.end(); ++it)
+    {
+        std::map<std::string, fields_t>::const_iterator old = macros.find(it->first);
+        std::string now, before;
+        write_fields(now, it->second);
+        if (old != macros.end())
+            write_fields(before, old->second);
+        if (old == macros.end() || now != before)
+        {
+            write_string(t.macros_, it->first);
+            t.macros_ += now;
+        }
+    }
+    t.first_iterator_ = iterators;
+    t.iterators_ = iterators_ - iterators;
+    sources_->put_tree(key, t);
 }
-std::string lemon::parse_html_include()
+void lemon::parse_html_include(nodes_t &nodes)
 {
     std::string file_path = get_include_filepath();
 
+    nodes.push_back(node_t(node_t::e_include));
+    nodes.back().str_ = file_path;
+    nodes.back().bodies_.push_back(nodes_t());
+
+    std::string key = "include\n" + file_path + "\n" + bindings();
+    if (cached_tree(key, nodes.back().bodies_.back()))
+        return;
+    size_t reads = reads_.size();
+    std::map<std::string, fields_t> macros = macros_;
+    int iterators = iterators_;
+
     lexer_ = new_lexer(file_path);
     if(!lexer_)
         throw std::runtime_error("new lexer error");
@@ -1817,17 +3169,18 @@ std::string lemon::parse_html_include()
 
     push_status(token_t::e_include);
 
-    std::string code = parse_html();
+    if (parse_html(nodes.back().bodies_.back()) != token_t::e_eof)
+        throw syntax_error("status error "+ get_status_str());
 
     if(pop_status() != token_t::e_include)
         throw syntax_error("status error");
+    cache_tree(key, nodes.back().bodies_.back(), std::vector<std::string>(),
+               reads, macros, iterators);
 
-    lexer_->file_->close();
     delete lexer_->file_;
     delete  lexer_;
     lexers_.pop_back();
     lexer_ = lexers_.back();
-    return code;
 }
 void lemon::push_status(token_t::type_t type)
 {
@@ -1865,6 +3218,14 @@ std::string lemon::get_status_str()
             return "autoescape";
         case token_t::e_block:
             return "block";
+        case token_t::e_macro:
+            return "macro";
+        case token_t::e_cold:
+            return "cold";
+        case token_t::e_spaceless:
+            return "spaceless";
+        case token_t::e_blocktrans:
+            return "blocktrans";
         default:
             return "unknown status";
     }
@@ -1889,15 +3250,26 @@ bool lemon::block_exist(const std::string &name)
     }
     return false;
 }
-std::string lemon::parse_block()
+void lemon::parse_block(nodes_t &nodes)
 {
-    std::string code;
     std::string name = get_next_token().str_;
     if(get_next_token().type_ != token_t::e_close_block)
         throw syntax_error("not find %}");
+
+    nodes.push_back(node_t(node_t::e_block));
+    node_t &node = nodes.back();
+    node.str_ = name;
+    node.bodies_.push_back(nodes_t());
+
     push_status(token_t::e_block);
-    if(!block_exist(name))
-        return code;
+    if(!is_base_ || !block_exist(name))
+    {
+        //default content of the block
+        if (parse_html(node.bodies_.back()) != token_t::e_end_block)
+            throw syntax_error("status error "+ get_status_str());
+        pop_status();
+        return;
+    }
     block b = get_block(name);
     lexer *l = new lexer;
     l->file_ = b.file_;
@@ -1912,19 +3284,19 @@ std::string lemon::parse_block()
     lexer_ = l;
     lexers_.push_back(l);
     is_base_ = false;
-    code = parse_html();
+    if (parse_html(node.bodies_.back()) != token_t::e_end_block)
+        throw syntax_error("status error "+ get_status_str());
     is_base_ = true;
     delete l;
     lexers_.pop_back();
     lexer_ = lexers_.back();
+    pop_status();
     //skip parent block
     while(get_next_token().type_ != token_t::e_end_block);
     if(get_next_token().type_ != token_t::e_close_block)
         throw syntax_error("not find %}");
-
-    return code;
 }
-std::string lemon::parse_extends()
+void lemon::parse_extends(nodes_t &nodes)
 {
 
     std::string file_name;
@@ -1938,6 +3310,10 @@ std::string lemon::parse_extends()
             break;
     }while (true);
 
+    //the blocks come from the rest of the child
+    std::string child = lexer_->file_path_;
+    std::string key = "extends\n" + file_name + "\n" + child + "\n" + bindings();
+
     do
     {
         token_t t =get_next_token();
@@ -1961,85 +3337,397 @@ std::string lemon::parse_extends()
 
     }while(true);
 
-    lexer_ = new lexer;
-    lexer_->file_ = new std::ifstream;
-    lexer_->file_->clear();
+    //the base template replaces everything of the child
+    nodes.clear();
+    if (cached_tree(key, nodes))
+        return;
+    std::vector<std::string> inputs(1, child);
+    for (size_t i = 0; i < blocks_.size(); ++i)
+        inputs.push_back(blocks_[i].file_path_);
+    size_t reads = reads_.size();
+    std::map<std::string, fields_t> macros = macros_;
+    int iterators = iterators_;
 
-    lexer_ ->line_ = 0;
-    lexer_ ->file_->open(file_name.c_str());
-    if(!lexer_ ->file_->good())
+    lexer_ = new_lexer(file_name);
+    if(!lexer_)
         throw syntax_error("open file error "+ file_name);
     lexers_.push_back(lexer_ );
 
-    return parse_html();
+    if (parse_html(nodes) != token_t::e_eof)
+        throw syntax_error("status error "+ get_status_str());
+    cache_tree(key, nodes, inputs, reads, macros, iterators);
 }
-std::string lemon::parse_open_block()
+//parse a {% tag, returns the closing tag that ends
+//the current body, or e_void for any other tag
+//{% macro card(const shop::item &item, const std::string &label) %}
+//the body sees the parameters only
+void lemon::parse_macro(nodes_t &nodes)
 {
-    code_buffer code;
-    token_t t = get_next_token();
+    nodes.push_back(node_t(node_t::e_macro));
+    node_t &node = nodes.back();
+    node.line_ = line();
+    node.file_path_ = lexer_->file_path_;
+    node.str_ = get_next_token(true).str_;
+    if (get_next_token(true).type_ != token_t::e_open_paren)
+        throw syntax_error("not find (");
 
-    eof_assert(t);
-    if(t.type_ == token_t::e_include)
+    fields_t params;
+    std::string rest = lexer_->line_buffer_;
+    skip(rest, " \t");
+    if (!rest.empty() && rest[0] == ')')
+        get_next_token(true);
+    else
     {
-        code += parse_html_include();
+        do
+        {
+            params.push_back(parse_param());
+        } while (curr_token().type_ != token_t::e_close_paren);
     }
-    else if (t.type_ == token_t::e_for)
+    if (get_next_token(true).type_ != token_t::e_close_block)
+        throw syntax_error("not find %}");
+
+    for (size_t i = 0; i < params.size(); ++i)
+    {
+        expr_t param(expr_t::e_variable, params[i].name_);
+        param.type_str_ = to_string(params[i].namespaces_) + params[i].type_str_;
+        node.args_.push_back(param);
+    }
+
+    std::vector<field> stack;
+    stack.swap(stack_);
+    stack_ = params;
+    push_status(token_t::e_macro);
+    node.bodies_.push_back(nodes_t());
+    if (parse_html(node.bodies_.back()) != token_t::e_endmacro)
+        throw syntax_error("status error " + get_status_str());
+    pop_status();
+    stack_.swap(stack);
+    macros_[node.str_] = params;
+}
+static inline std::string strip_spaces(const std::string &str)
+{
+    std::string buffer;
+    for (size_t i = 0; i < str.size(); ++i)
     {
-        push_status(token_t::e_for);
-        code += parse_for();
+        if (str[i] != ' ')
+            buffer.push_back(str[i]);
     }
-    else if (t.type_ == token_t::e_empty)
+    return buffer;
+}
+bool lemon::is_numeric(field::type type)
+{
+    return type != field::e_std_string &&
+           type != field::e_acl_string &&
+           type != field::e_safe_string &&
+           type != field::e_std_list &&
+           type != field::e_std_vector &&
+           type != field::e_std_map &&
+           type != field::e_std_set &&
+           type != field::e_class;
+}
+//{% call card(item, "buy") %}, variables and literals
+void lemon::parse_call(nodes_t &nodes)
+{
+    std::string name = get_next_token(true).str_;
+    std::map<std::string, fields_t>::const_iterator it = macros_.find(name);
+    if (it == macros_.end())
+        throw syntax_error("not find macro " + name);
+    const fields_t &params = it->second;
+    if (get_next_token(true).type_ != token_t::e_open_paren)
+        throw syntax_error("not find (");
+
+    nodes.push_back(node_t(node_t::e_call));
+    node_t &node = nodes.back();
+    node.line_ = line();
+    node.file_path_ = lexer_->file_path_;
+    node.str_ = name;
+
+    token_t t = get_next_token(true);
+    eof_assert(t);
+    while (t.type_ != token_t::e_close_paren)
     {
-        if(get_status() != token_t::e_for)
-            throw syntax_error("status error " + get_status_str());
+        push_back(t);
+        bool raw;
+        expr_t arg = parse_operand(raw);
+        if (arg.type_ == expr_t::e_call)
+            throw syntax_error("filters are not allowed in call arguments");
+        node.args_.push_back(arg);
 
-        if (get_next_token().type_ != token_t::e_close_block)
-            throw syntax_error("not find %}");
+        t = get_next_token(true);
+        eof_assert(t);
+        if (t.type_ == token_t::e_comma)
+            t = get_next_token(true);
+        else if (t.type_ != token_t::e_close_paren)
+            throw syntax_error("not find `,` or `)` ");
+    }
+    if (get_next_token(true).type_ != token_t::e_close_block)
+        throw syntax_error("not find %}");
 
-        g_tab--;
-        code += tab() + "}" + br;
-        code += tab() + "if(" + get_for_item()+".empty())"+br;
-        code += tab() + "{"+br;
-        g_tab++;
-        code += tab() + "code += \"";
+    if (node.args_.size() != params.size())
+        throw syntax_error("macro " + name + " takes " +
+                           number(params.size()) + " arguments");
+    for (size_t i = 0; i < params.size(); ++i)
+    {
+        const field &f = params[i];
+        const expr_t &arg = node.args_[i];
+        std::string type = to_string(f.namespaces_) + f.type_str_;
+        bool ok;
+        if (arg.type_ == expr_t::e_string)
+            ok = f.type_ == field::e_std_string || f.type_ == field::e_acl_string ||
+                 f.type_ == field::e_safe_string;
+        else if (arg.type_ == expr_t::e_number)
+            ok = is_numeric(f.type_);
+        else
+            ok = strip_spaces(arg.type_str_) == strip_spaces(type) ||
+                 (is_numeric(f.type_) &&
+                  is_numeric(get_field_type(arg.type_str_)));
+        if (!ok)
+            throw syntax_error("argument " + f.name_ + " of macro " + name +
+                               " is " + type);
     }
-    else if (t.type_ == token_t::e_endfor)
+}
+//{% cold %}, a region that rarely renders, like an error banner
+void lemon::parse_cold(nodes_t &nodes)
+{
+    nodes.push_back(node_t(node_t::e_cold));
+    node_t &node = nodes.back();
+    node.line_ = line();
+    node.file_path_ = lexer_->file_path_;
+    if (get_next_token().type_ != token_t::e_close_block)
+        throw syntax_error("not find %}");
+
+    push_status(token_t::e_cold);
+    node.bodies_.push_back(nodes_t());
+    if (parse_html(node.bodies_.back()) != token_t::e_endcold)
+        throw syntax_error("status error " + get_status_str());
+    pop_status();
+}
+//minified on its own, whatever the global setting
+void lemon::parse_spaceless(nodes_t &nodes)
+{
+    if (get_next_token().type_ != token_t::e_close_block)
+        throw syntax_error("not find %}");
+
+    push_status(token_t::e_spaceless);
+    nodes_t body;
+    if (parse_html(body) != token_t::e_endspaceless)
+        throw syntax_error("status error " + get_status_str());
+    pop_status();
+    minify_html(body);
+    nodes.insert(nodes.end(), body.begin(), body.end());
+}
+//comments out, whitespace collapsed and dropped next to { } ; , > and
+//after :. strings are kept, so is the space of `a :hover` and `+` in calc().
+static std::string minify_css(const std::string &css)
+{
+    std::string out;
+    for (size_t i = 0; i < css.size(); ++i)
     {
-        if(pop_status() != token_t::e_for)
-            throw syntax_error("status error "+ get_status_str());
-        g_tab--;
-        code += tab() + "}"+br;
-        pop_stack();
-        pop_for_item();
-        if (get_next_token().type_ != token_t::e_close_block)
-            throw syntax_error("not find %}");
+        char ch = css[i];
+        if (ch == '"' || ch == '\'')
+        {
+            size_t end = i + 1;
+            while (end < css.size() && css[end] != ch)
+                end += css[end] == '\\' ? 2 : 1;
+            out.append(css, i, end + 1 - i);
+            i = end;
+        }
+        else if (ch == '/' && i + 1 < css.size() && css[i + 1] == '*')
+        {
+            size_t end = css.find("*/", i + 2);
+            if (end == std::string::npos)
+                break;
+            i = end + 1;
+        }
+        else if (isspace((unsigned char)ch))
+        {
+            while (i + 1 < css.size() && isspace((unsigned char)css[i + 1]))
+                ++i;
+            if (out.empty() || i + 1 == css.size())
+                continue;
+            if (strchr("{};,>:", out[out.size() - 1]) ||
+                strchr("{};,>", css[i + 1]))
+                continue;
+            out += ' ';
+        }
+        else
+        {
+            out += ch;
+        }
     }
-    else if (t.type_ == token_t::e_if)
+    return out;
+}
+//{% inline_file "critical.css" minify %}, the bytes of the file as
+//static text of the template. minify takes the whitespace out of css,
+//svg and html files.
+void lemon::parse_inline_file(nodes_t &nodes)
+{
+    token_t t = get_next_token();
+    if (t.type_ != token_t::e_double_quote && t.type_ != token_t::e_quote)
+        throw syntax_error("not find \" ");
+    std::string file_path;
+    do
     {
-        push_status(token_t::e_if);
-        code += parse_if();
+        token_t t1 = get_next_token(std::string());
+        eof_assert(t1);
+        if (t1.type_ == t.type_)
+            break;
+        file_path.append(t1.str_);
+    } while (true);
+
+    bool minify = false;
+    t = get_next_token();
+    if (t.str_ == "minify")
+    {
+        minify = true;
+        t = get_next_token();
     }
-    else if (t.type_ == token_t::e_elif)
+    if (t.type_ != token_t::e_close_block)
+        throw syntax_error("not find %}");
+
+    std::string data;
+    if (!sources_->get(file_path, data))
+        throw syntax_error("open file error. " + file_path);
+    add_input(file_path);
+
+    std::string ext = file_path.substr(file_path.find_last_of('.') + 1);
+    for (size_t i = 0; i < ext.size(); ++i)
+        ext[i] = (char)tolower((unsigned char)ext[i]);
+    nodes_t text(1, node_t(node_t::e_literal));
+    text[0].str_ = data;
+    if (minify && ext == "css")
+        text[0].str_ = minify_css(data);
+    else if (minify && (ext == "svg" || ext == "html" || ext == "htm"))
+        minify_html(text);
+    nodes.insert(nodes.end(), text.begin(), text.end());
+}
+//{% trans "text" %}, text the locales translate
+void lemon::parse_trans(nodes_t &nodes)
+{
+    token_t t = get_next_token();
+    if (t.type_ != token_t::e_double_quote && t.type_ != token_t::e_quote)
+        throw syntax_error("not find \" ");
+    node_t node(node_t::e_trans);
+    do
     {
-        if(get_status() != token_t::e_if)
-            throw syntax_error("status error "+ get_status_str());
-        code += tab() + "}" + br;
-        code += tab() + "else ";
-        code += parse_if();
+        token_t t1 = get_next_token(std::string());
+        eof_assert(t1);
+        if (t1.type_ == t.type_)
+            break;
+        node.str_.append(t1.str_);
+    } while (true);
+    if (get_next_token().type_ != token_t::e_close_block)
+        throw syntax_error("not find %}");
+
+    node.bodies_.push_back(nodes_t(1, node_t(node_t::e_literal)));
+    node.bodies_[0][0].str_ = node.str_;
+    nodes.push_back(node);
+}
+//{% blocktrans [trimmed] %}text and {{ a.b }}{% endblocktrans %}, the
+//message is `text and %(a.b)s`. trimmed collapses its whitespace.
+void lemon::parse_blocktrans(nodes_t &nodes)
+{
+    token_t t = get_next_token();
+    bool trimmed = t.str_ == "trimmed";
+    if (trimmed)
+        t = get_next_token();
+    if (t.type_ != token_t::e_close_block)
+        throw syntax_error("not find %}");
+
+    push_status(token_t::e_blocktrans);
+    node_t node(node_t::e_trans);
+    node.bodies_.push_back(nodes_t());
+    nodes_t &body = node.bodies_[0];
+    if (parse_html(body) != token_t::e_endblocktrans)
+        throw syntax_error("status error " + get_status_str());
+    pop_status();
+
+    //a literal per line from the parser
+    nodes_t merged;
+    for (size_t i = 0; i < body.size(); ++i)
+    {
+        if (body[i].type_ == node_t::e_literal && !merged.empty() &&
+            merged.back().type_ == node_t::e_literal)
+            merged.back().str_ += body[i].str_;
+        else
+            merged.push_back(body[i]);
     }
-    else if (t.type_ == token_t::e_endif)
+    body.swap(merged);
+    for (size_t i = 0; trimmed && i < body.size(); ++i)
     {
-        if(pop_status() != token_t::e_if)
-            throw syntax_error("status error "+ get_status_str());
+        if (body[i].type_ != node_t::e_literal)
+            continue;
+        std::string text;
+        const std::string &str = body[i].str_;
+        for (size_t j = 0; j < str.size(); ++j)
+        {
+            if (!isspace((unsigned char)str[j]))
+                text += str[j];
+            else if (j + 1 == str.size() || !isspace((unsigned char)str[j + 1]))
+                text += ' ';
+        }
+        if (i == 0 && !text.empty() && text[0] == ' ')
+            text.erase(0, 1);
+        if (i + 1 == body.size() && !text.empty() && text[text.size() - 1] == ' ')
+            text.erase(text.size() - 1);
+        body[i].str_ = text;
+    }
+    node.str_ = trans_message(body);
+    nodes.push_back(node);
+}
+lemon::token_t::type_t lemon::parse_open_block(nodes_t &nodes)
+{
+    token_t t = get_next_token();
 
-        g_tab--;
-        code += tab() + "}" + br;
-        if(get_next_token().type_ != token_t::e_close_block)
-            throw syntax_error("not find %}");
+    eof_assert(t);
+    if(t.type_ == token_t::e_include)
+    {
+        parse_html_include(nodes);
+    }
+    else if (t.type_ == token_t::e_for)
+    {
+        parse_for(nodes);
+    }
+    else if (t.type_ == token_t::e_if)
+    {
+        parse_if(nodes);
     }
     else if(t.type_ == token_t::e_block)
     {
-        code += parse_block();
+        parse_block(nodes);
+    }
+    else if(t.type_ == token_t::e_extends)
+    {
+        parse_extends(nodes);
+        return token_t::e_eof;
+    }
+    else if (t.type_ == token_t::e_macro)
+    {
+        parse_macro(nodes);
+    }
+    else if (t.type_ == token_t::e_call)
+    {
+        parse_call(nodes);
+    }
+    else if (t.type_ == token_t::e_cold)
+    {
+        parse_cold(nodes);
+    }
+    else if (t.type_ == token_t::e_spaceless)
+    {
+        parse_spaceless(nodes);
+    }
+    else if (t.type_ == token_t::e_inline_file)
+    {
+        parse_inline_file(nodes);
+    }
+    else if (t.type_ == token_t::e_trans)
+    {
+        parse_trans(nodes);
+    }
+    else if (t.type_ == token_t::e_blocktrans)
+    {
+        parse_blocktrans(nodes);
     }
     else if(t.type_ == token_t::e_autoescape)
     {
@@ -2053,130 +3741,678 @@ std::string lemon::parse_open_block()
         if(get_next_token().type_ != token_t::e_close_block)
             throw syntax_error("not find %}");
         push_status(token_t::e_autoescape);
+        if (parse_html(nodes) != token_t::e_endautoescape)
+            throw syntax_error("status error. "+get_status_str());
+        pop_status();
+        pop_auto_escape();
+    }
+    else if (t.type_ == token_t::e_elif)
+    {
+        //the condition is parsed by parse_if()
+        if(get_status() != token_t::e_if)
+            throw syntax_error("status error "+ get_status_str());
+        return t.type_;
+    }
+    else if (t.type_ == token_t::e_else||
+             t.type_ == token_t::e_endif||
+             t.type_ == token_t::e_empty||
+             t.type_ == token_t::e_endfor||
+             t.type_ == token_t::e_end_block||
+             t.type_ == token_t::e_endautoescape||
+             t.type_ == token_t::e_endmacro||
+             t.type_ == token_t::e_endcold||
+             t.type_ == token_t::e_endspaceless||
+             t.type_ == token_t::e_endblocktrans)
+    {
+        if(get_next_token().type_ != token_t::e_close_block)
+            throw syntax_error("not find %}");
+        return t.type_;
+    }
+    else
+    {
+        throw syntax_error("unknown tag "+t.str_);
+    }
+    return token_t::e_void;
+}
+
+static inline void add_literal(nodes_t &nodes, std::string &text)
+{
+    if (text.empty())
+        return;
+    nodes.push_back(node_t(node_t::e_literal));
+    nodes.back().str_ = text;
+    text.clear();
+}
+//parse static text and tags into nodes, until the end of
+//the file or a closing tag, which is returned. the text is kept as
+//written, minify_html() takes its whitespace out.
+lemon::token_t::type_t lemon::parse_html(nodes_t &nodes)
+{
+    std::string text;
+
+    do
+    {
+        //a std::string, "" would be the bool overload skipping spaces
+        token_t t = get_next_token(std::string());
+        if (t.type_ == token_t::e_eof)
+        {
+            add_literal(nodes, text);
+            return t.type_;
+        }
+        else if (t.type_ == token_t::e_open_variable)
+        {
+            add_literal(nodes, text);
+            parse_variable(nodes);
+        }
+        else if (t.type_ == token_t::e_open_block)
+        {
+            add_literal(nodes, text);
+            token_t::type_t end = parse_open_block(nodes);
+            if (end != token_t::e_void)
+                return end;
+        }
+        else if (t.type_ == token_t::e_$r)
+        {
+            //read_line() ends lines with \r\n, the text gets \n
+            continue;
+        }
+        else if (t.type_ == token_t::e_$n)
+        {
+            //one literal per line of the template
+            text += t.str_;
+            add_literal(nodes, text);
+        }
+        else
+        {
+            text += t.str_;
+        }
+    } while (true);
+}
+void lemon::push_auto_escape(bool escape)
+{
+    auto_escape_.push_back(escape);
+}
+void lemon::pop_auto_escape()
+{
+    auto_escape_.pop_back();
+}
+bool lemon::auto_escape()
+{
+    if(auto_escape_.empty())
+        throw syntax_error("auto_escape syntax error");
+    return auto_escape_.back();
+}
+//text of a C++ string literal. text converted from utf-8 is all ascii,
+//the compiler would read its other bytes in the charset of the source
+static inline std::string escape_cpp(const std::string &str, bool ascii = false)
+{
+    std::string buffer;
+    for (size_t i = 0; i < str.size(); ++i)
+    {
+        char ch = str[i];
+        if (ch == '\n')
+            buffer += "\\n";
+        else if (ch == '\t')
+            buffer += "\\t";
+        else if ((unsigned char)ch < 0x20 || ch == 0x7f ||
+                 (ascii && (unsigned char)ch >= 0x80))
+        {
+            //three digits, the next char can't continue the number
+            char octal[8];
+            sprintf(octal, "\\%03o", (unsigned char)ch);
+            buffer += octal;
+        }
+        else
+        {
+            if (ch == '"' || ch == '\\')
+                buffer.push_back('\\');
+            buffer.push_back(ch);
+        }
+    }
+    return buffer;
+}
+std::string lemon::gen_expr(const expr_t &expr)
+{
+    std::string code;
+    switch (expr.type_)
+    {
+        case expr_t::e_variable:
+        case expr_t::e_number:
+            return expr.str_;
+        case expr_t::e_string:
+            return "\"" + escape_cpp(expr.str_) + "\"";
+        case expr_t::e_call:
+            code = "lm::$" + expr.str_ + "(";
+            for (size_t i = 0; i < expr.args_.size(); ++i)
+            {
+                if (i)
+                    code += ", ";
+                code += gen_expr(expr.args_[i]);
+            }
+            return code + ")";
+        case expr_t::e_test:
+            if (expr.str_ == "zero")
+                return gen_expr(expr.args_[0]) + " != 0";
+            return "!" + gen_expr(expr.args_[0]) + ".empty()";
+        case expr_t::e_compare:
+            return gen_expr(expr.args_[0]) + expr.str_ + gen_expr(expr.args_[1]);
+        case expr_t::e_and:
+        case expr_t::e_or:
+            for (size_t i = 0; i < expr.args_.size(); ++i)
+            {
+                if (i)
+                    code += expr.str_;
+                code += "(" + gen_expr(expr.args_[i]) + ")";
+            }
+            return code;
+        case expr_t::e_not:
+            return "!(" + gen_expr(expr.args_[0]) + ")";
+    }
+    return code;
+}
+static size_t count_nodes(const nodes_t &nodes)
+{
+    size_t count = nodes.size();
+    for (size_t i = 0; i < nodes.size(); ++i)
+    {
+        for (size_t j = 0; j < nodes[i].bodies_.size(); ++j)
+            count += count_nodes(nodes[i].bodies_[j]);
+    }
+    return count;
+}
+//nodes that compile into the body itself, not into functions of their own
+static size_t body_size(const nodes_t &nodes)
+{
+    size_t count = nodes.size();
+    for (size_t i = 0; i < nodes.size(); ++i)
+    {
+        if (nodes[i].type_ == node_t::e_cold || nodes[i].type_ == node_t::e_macro)
+            continue;
+        for (size_t j = 0; j < nodes[i].bodies_.size(); ++j)
+            count += body_size(nodes[i].bodies_[j]);
+    }
+    return count;
+}
+//names and types of the variables an include reads from its caller
+static void free_variables(const expr_t &expr,
+                           const std::vector<std::string> &bound,
+                           std::vector<std::pair<std::string, std::string> > &vars)
+{
+    if (expr.type_ == expr_t::e_variable)
+    {
+        std::string name = expr.str_.substr(0, expr.str_.find('.'));
+        if (std::find(bound.begin(), bound.end(), name) != bound.end())
+            return;
+        for (size_t i = 0; i < vars.size(); ++i)
+        {
+            if (vars[i].first == name)
+                return;
+        }
+        vars.push_back(std::make_pair(name, expr.types_[0]));
+        return;
+    }
+    for (size_t i = 0; i < expr.args_.size(); ++i)
+        free_variables(expr.args_[i], bound, vars);
+}
+static void free_variables(const nodes_t &nodes,
+                           std::vector<std::string> &bound,
+                           std::vector<std::pair<std::string, std::string> > &vars)
+{
+    for (size_t i = 0; i < nodes.size(); ++i)
+    {
+        const node_t &node = nodes[i];
+        //macros see their parameters only
+        if (node.type_ == node_t::e_macro)
+            continue;
+        if (node.type_ == node_t::e_emit || node.type_ == node_t::e_for ||
+            node.type_ == node_t::e_let || node.type_ == node_t::e_switch)
+            free_variables(node.expr_, bound, vars);
+        //bound to the end of the body
+        if (node.type_ == node_t::e_let)
+            bound.push_back(node.value_);
+        for (size_t j = 0; j < node.args_.size(); ++j)
+            free_variables(node.args_[j], bound, vars);
+        for (size_t j = 0; j < node.conds_.size(); ++j)
+            free_variables(node.conds_[j], bound, vars);
+        for (size_t j = 0; j < node.bodies_.size(); ++j)
+        {
+            size_t size = bound.size();
+            if (node.type_ == node_t::e_for && j == 0)
+            {
+                bound.push_back(node.value_);
+                if (node.loop_ == node_t::e_loop_map)
+                    bound.push_back(node.key_);
+            }
+            free_variables(node.bodies_[j], bound, vars);
+            bound.resize(size);
+        }
     }
-    else if(t.type_ == token_t::e_endautoescape)
+}
+static bool has_lets(const nodes_t &nodes)
+{
+    for (size_t i = 0; i < nodes.size(); ++i)
     {
-        if(pop_status() != token_t::e_autoescape)
-            throw syntax_error("status error. "+get_status_str());
-        if(get_next_token().type_ != token_t::e_close_block)
-            throw syntax_error("not find %}");
-        pop_auto_escape();
+        if (nodes[i].type_ == node_t::e_let)
+            return true;
     }
-    return code;
+    return false;
 }
-
-
-std::string lemon::parse_html()
+//iterators numbered from the start of the include, so the same
+//include generates the same function in every template
+static void renumber_iterators(nodes_t &nodes, int &iterators)
 {
-    code_buffer code;
-
-    code += tab() + "code += \"";
+    for (size_t i = 0; i < nodes.size(); ++i)
+    {
+        if (nodes[i].type_ == node_t::e_for)
+        {
+            char buffer[32];
+            sprintf(buffer, "it%d", ++iterators);
+            nodes[i].iterator_ = buffer;
+        }
+        for (size_t j = 0; j < nodes[i].bodies_.size(); ++j)
+            renumber_iterators(nodes[i].bodies_[j], iterators);
+    }
+}
+//shorter literals stay in the code, they cost less than loading a slice
+static const size_t pool_min_size = 16;
+//LM_LIKELY or LM_UNLIKELY when the profile says a condition is nearly
+//always, or nearly never, true
+static std::string expect(const std::string &cond, unsigned long long tested,
+                          unsigned long long taken)
+{
+    if (!tested)
+        return cond;
+    if (taken * 10 >= tested * 9)
+        return "LM_LIKELY(" + cond + ")";
+    if (taken * 10 <= tested)
+        return "LM_UNLIKELY(" + cond + ")";
+    return cond;
+}
+std::string lemon::gen_cpp(const nodes_t &nodes)
+{
+    std::string code;
 
-    do
+    for (size_t i = 0; i < nodes.size(); ++i)
     {
-        token_t t = get_next_token("");
-        if (t.type_ == token_t::e_eof)
+        const node_t &node = nodes[i];
+        if (node.type_ == node_t::e_literal && literal_pool_ &&
+            node.str_.size() >= pool_min_size)
         {
-            code +="\";"+br;
-            break;
+            code += tab() + "lm::append_literal(code, " + gen_literal(node.str_) + ");" + br;
         }
-        else if (t.type_ == token_t::e_open_variable)
+        else if (node.type_ == node_t::e_literal)
         {
-            code += CODE_END;
-            code += parse_variable();
-            code += CODE_BEGIN;
+            code += tab() + "code += \"" + escape_cpp(node.str_, !charset_.empty()) + "\";" + br;
         }
-        else if (t.type_ == token_t::e_open_block)
+        else if (node.type_ == node_t::e_emit)
         {
-            code += CODE_END;
-            t = get_next_token();
-            if(t.type_ == token_t::e_end_block)
+            lm::escape_t kind;
+            const expr_t &expr = node.expr_;
+            if (charset_.empty())
+                code += tab() + "code += " + gen_expr(expr) + ";" + br;
+            else if (expr.type_ == expr_t::e_call && lm::find_escape(expr.str_, kind))
             {
-                if(pop_status() != token_t::e_block)
-                    throw syntax_error("status error."+ get_status_str());
-                if(get_next_token().type_ != token_t::e_close_block)
-                    throw syntax_error("not find %}");
-                if(!is_base_)
-                    return code;
+                //escaped into code, without a temporary
+                code += tab() + "lm_out.escape(code, lm::e_" + lm::escape_name(kind) + ", " +
+                        gen_expr(expr.args_[0]) + ");" + br;
+            }
+            else
+                code += tab() + "lm_out.append(code, " + gen_expr(expr) + ");" + br;
+        }
+        else if (node.type_ == node_t::e_let)
+        {
+            code += tab() + "const " + node.value_type_ + " &" + node.value_;
+            code += " = " + gen_expr(node.expr_) + ";" + br;
+        }
+        else if (node.type_ == node_t::e_if)
+        {
+            code += gen_count(node.site_, 0);
+            //the times each condition is tested
+            unsigned long long tested = node.counts_.empty() ? 0 : node.counts_[0];
+            for (size_t j = 0; j < node.bodies_.size(); ++j)
+            {
+                std::string cond;
+                if (j < node.conds_.size())
+                {
+                    unsigned long long taken = tested ? node.counts_[j + 1] : 0;
+                    cond = expect(gen_expr(node.conds_[j]), tested, taken);
+                    tested = tested > taken ? tested - taken : 0;
+                }
+                if (j == 0)
+                    code += tab() + "if(" + cond + ")" + br;
+                else if (j < node.conds_.size())
+                    code += tab() + "else if(" + cond + ")" + br;
+                else
+                    code += tab() + "else" + br;
+                code += tab() + "{" + br;
+                tab_++;
+                code += gen_count(node.site_, j + 1);
+                code += gen_body(node.bodies_[j]);
+                tab_--;
+                code += tab() + "}" + br;
+            }
+        }
+        else if (node.type_ == node_t::e_switch)
+        {
+            code += gen_switch(node);
+        }
+        else if (node.type_ == node_t::e_for)
+        {
+            std::string items = gen_expr(node.expr_);
+            std::string it = node.iterator_;
+
+            code += gen_count(node.site_, 0);
+            code += tab() + node.items_type_ + "::const_iterator " + it;
+            code += " = " + items + ".begin();" + br;
+            code += tab() + "for (; " + it + " != ";
+            code += items + ".end(); ++" + it + ")" + br;
+            code += tab() + "{" + br;
+            tab_++;
+            if (node.loop_ == node_t::e_loop_map)
+            {
+                code += tab() + "const " + node.key_type_ + " &" + node.key_;
+                code += " = " + it + "->first;" + br;
+                code += tab() + "const " + node.value_type_ + " &" + node.value_;
+                code += " = " + it + "->second;" + br;
             }
-            else if(t.type_ == token_t::e_extends)
+            else if (node.loop_ == node_t::e_loop_map_value)
             {
-                return parse_extends();
+                code += tab() + "const " + node.value_type_ + " &" + node.value_;
+                code +=" = " + it + "->second;" + br;
+            }
+            else
+            {
+                code += tab() + "const " + node.value_type_ + " &" + node.value_;
+                code += " = *" + it + ";" + br;
+            }
+            code += gen_count(node.site_, 1);
+            code += gen_body(node.bodies_[0]);
+            tab_--;
+            code += tab() + "}" + br;
+            if (node.bodies_.size() > 1)
+            {
+                std::string empty = items + ".empty()";
+                if (!node.counts_.empty())
+                    empty = expect(empty, node.counts_[0], node.counts_[2]);
+                code += tab() + "if(" + empty + ")" + br;
+                code += tab() + "{" + br;
+                tab_++;
+                code += gen_count(node.site_, 2);
+                code += gen_body(node.bodies_[1]);
+                tab_--;
+                code += tab() + "}" + br;
             }
-            push_back(t);
-            code += parse_open_block();
-            code += CODE_BEGIN;
         }
-        else if (t.type_ == token_t::e_$r)
+        else if (node.type_ == node_t::e_include &&
+                 count_nodes(node.bodies_[0]) > inline_threshold_)
         {
-            t = get_next_token("");
-            eof_assert(t);
-            code += CODE_END;
-            code += CODE_BEGIN;
-            if (t.type_ == token_t::e_$n)
-                continue;
-            code += t.str_;
+            code += gen_outline(node.bodies_[0], "lm_include_", "", node.str_);
         }
-        else if(t.type_ == token_t::e_$n)
+        else if (node.type_ == node_t::e_cold)
         {
-            code += CODE_END;
-            code += CODE_BEGIN;
+            std::string where = node.file_path_ + ":" + number(node.line_);
+            code += gen_outline(node.bodies_[0], "lm_cold_", "LM_COLD ", where);
         }
-        else if (t.type_ == token_t::e_$t)
+        else if (node.type_ == node_t::e_macro)
         {
-            code += "\t";
+            macro_functions_[node.str_] = gen_macro(node);
         }
-        else if(t.type_ == token_t::e_double_quote)
+        else if (node.type_ == node_t::e_call)
         {
-            code += "\\\"";
+            code += tab() + macro_functions_[node.str_] + "(code";
+            for (size_t j = 0; j < node.args_.size(); ++j)
+                code += ", " + gen_expr(node.args_[j]);
+            code += ");" + br;
         }
-        else
+        else if (node.type_ == node_t::e_include && has_lets(node.bodies_[0]))
         {
-            code += t.str_;
+            //the same include pasted twice declares its values twice
+            code += tab() + "{" + br;
+            tab_++;
+            code += gen_cpp(node.bodies_[0]);
+            tab_--;
+            code += tab() + "}" + br;
         }
-        
-    } while (true);
-
+        else if (node.type_ == node_t::e_block ||
+                 node.type_ == node_t::e_include)
+        {
+            code += gen_cpp(node.bodies_[0]);
+        }
+    }
     return code;
 }
-#if 0
-static inline std::string skip_multi_space(const std::string &str)
+//integers switch on the value, strings pick the case by length and
+//then by the character that tells most of them apart, and switch on it
+std::string lemon::gen_switch(const node_t &node)
 {
-    std::string buffer;
-    for (size_t i = 0; i < str.size(); ++i)
+    std::string code = gen_count(node.site_, 0);
+    bool strings = node.conds_[0].args_[0].type_ == expr_t::e_string;
+    std::string subject = gen_expr(node.expr_);
+    if (strings)
     {
-        char ch = str[i];
-        if (ch == ' ')
+        code += tab() + "{" + br;
+        tab_++;
+        code += tab() + "const std::string &lm_key = " + subject + ";" + br;
+        code += tab() + "int lm_case = -1;" + br;
+
+        std::map<size_t, std::vector<std::pair<std::string, size_t> > > lengths;
+        for (size_t i = 0; i < node.conds_.size(); ++i)
+        {
+            const std::vector<expr_t> &labels = node.conds_[i].args_;
+            for (size_t j = 0; j < labels.size(); ++j)
+                lengths[labels[j].str_.size()].push_back(std::make_pair(labels[j].str_, i));
+        }
+        code += tab() + "switch(lm_key.size())" + br;
+        code += tab() + "{" + br;
+        std::map<size_t, std::vector<std::pair<std::string, size_t> > >::iterator it;
+        for (it = lengths.begin(); it != lengths.end(); ++it)
         {
-            buffer.push_back(' ');
-            for (; i < str.size(); ++i)
+            const std::vector<std::pair<std::string, size_t> > &bucket = it->second;
+            code += tab() + "case " + number(it->first) + ":" + br;
+            tab_++;
+            //the position with the most different characters
+            size_t pos = 0;
+            size_t best = 0;
+            for (size_t i = 0; i < it->first; ++i)
             {
-                ch = str[i];
-                if (ch != ' ')
-                    break;
+                std::set<char> chars;
+                for (size_t j = 0; j < bucket.size(); ++j)
+                    chars.insert(bucket[j].first[i]);
+                if (chars.size() > best)
+                {
+                    best = chars.size();
+                    pos = i;
+                }
+            }
+            std::map<unsigned char, std::vector<size_t> > chars;
+            for (size_t j = 0; j < bucket.size(); ++j)
+                chars[it->first ? (unsigned char)bucket[j].first[pos] : 0].push_back(j);
+            bool by_char = chars.size() > 1;
+            if (by_char)
+            {
+                code += tab() + "switch((unsigned char)lm_key[" + number(pos) + "])" + br;
+                code += tab() + "{" + br;
+            }
+            std::map<unsigned char, std::vector<size_t> >::iterator c;
+            for (c = chars.begin(); c != chars.end(); ++c)
+            {
+                if (by_char)
+                {
+                    std::string label = number(c->first);
+                    if (isalnum(c->first))
+                        label = std::string("'") + (char)c->first + "'";
+                    code += tab() + "case " + label + ":" + br;
+                    tab_++;
+                }
+                for (size_t j = 0; j < c->second.size(); ++j)
+                {
+                    const std::pair<std::string, size_t> &label = bucket[c->second[j]];
+                    code += tab() + (j ? "else if" : "if");
+                    code += "(lm_key == \"" + escape_cpp(label.first) + "\")" + br;
+                    tab_++;
+                    code += tab() + "lm_case = " + number(label.second) + ";" + br;
+                    tab_--;
+                }
+                if (by_char)
+                {
+                    code += tab() + "break;" + br;
+                    tab_--;
+                }
             }
+            if (by_char)
+                code += tab() + "}" + br;
+            code += tab() + "break;" + br;
+            tab_--;
         }
+        code += tab() + "}" + br;
+        subject = "lm_case";
+    }
 
-        buffer.push_back(ch);
+    code += tab() + "switch(" + subject + ")" + br;
+    code += tab() + "{" + br;
+    for (size_t i = 0; i < node.bodies_.size(); ++i)
+    {
+        if (i < node.conds_.size() && strings)
+            code += tab() + "case " + number(i) + ":" + br;
+        else if (i < node.conds_.size())
+        {
+            const std::vector<expr_t> &labels = node.conds_[i].args_;
+            for (size_t j = 0; j < labels.size(); ++j)
+                code += tab() + "case " + labels[j].str_ + ":" + br;
+        }
+        else
+            code += tab() + "default:" + br;
+        //the cases' declarations stay in their own scope
+        tab_++;
+        code += tab() + "{" + br;
+        tab_++;
+        code += gen_count(node.site_, i + 1);
+        code += gen_body(node.bodies_[i]);
+        tab_--;
+        code += tab() + "}" + br;
+        code += tab() + "break;" + br;
+        tab_--;
     }
-    return buffer;
+    code += tab() + "}" + br;
+    if (strings)
+    {
+        tab_--;
+        code += tab() + "}" + br;
+    }
+    return code;
 }
-#endif
-void lemon::push_auto_escape(bool escape)
+//lm_literal_<hash>, the slices of the literal pool holding str
+std::string lemon::gen_literal(const std::string &str)
 {
-    auto_escape_.push_back(escape);
+    std::string name = "lm_literal_" + to_hex(fnv1a(str));
+    if (literals_.insert(str).second)
+        literal_decls_ += "extern const lm::slice_t " + name + "[];" + br;
+    return name;
 }
-void lemon::pop_auto_escape()
+//the converter of the values a function body writes, if it writes any
+std::string lemon::gen_transcoder(const std::string &text)
 {
-    auto_escape_.pop_back();
+    if (text.find("lm_out.") == std::string::npos)
+        return "";
+    return "\tlm::transcoder &lm_out = lm::thread_transcoder(\"" + charset_ + "\");" + br;
 }
-bool lemon::auto_escape()
+//++ the counter of the node reached, index 0, or of body index - 1,
+//in an instrumented build
+std::string lemon::gen_count(int site, size_t index)
 {
-    if(auto_escape_.empty())
-        throw syntax_error("auto_escape syntax error");
-    return auto_escape_.back();
+    if (counter_array_.empty() || site < 0)
+        return std::string();
+    return tab() + "++" + counter_array_ + "[" + number(site + index) + "];" + br;
+}
+//a branch or loop body, out of line when it is big
+std::string lemon::gen_body(const nodes_t &nodes)
+{
+    if (!outline_threshold_ || body_size(nodes) <= outline_threshold_)
+        return gen_cpp(nodes);
+    return gen_outline(nodes, "lm_part_", "LM_NOINLINE ", template_.name_);
+}
+// an include, a cold region or a big body becomes an inline function
+// named by the hash of its code, taking the variables it reads. the
+// uses with the same variables and escaping share one, within a
+// template and, through the linker, across templates.
+std::string lemon::gen_outline(const nodes_t &nodes, const std::string &prefix,
+                               const std::string &attributes,
+                               const std::string &comment)
+{
+    std::vector<std::string> bound;
+    std::vector<std::pair<std::string, std::string> > vars;
+    free_variables(nodes, bound, vars);
+
+    nodes_t body = nodes;
+    int iterators = 0;
+    renumber_iterators(body, iterators);
+
+    int depth = tab_;
+    tab_ = 1;
+    std::string params = "std::string &code";
+    std::string args = "code";
+    for (size_t i = 0; i < vars.size(); ++i)
+    {
+        params += ", const " + vars[i].second + " &" + vars[i].first;
+        args += ", " + vars[i].first;
+    }
+    std::string text = gen_cpp(body);
+    tab_ = depth;
+    //a file of macros only
+    if (text.empty())
+        return text;
+
+    std::string code = "(" + params + ")" + br;
+    code += "{" + br;
+    code += gen_transcoder(text);
+    code += text;
+    code += "}" + br;
+    std::string name = add_function(prefix, comment, code, attributes);
+    return tab() + name + "(" + args + ");" + br;
+}
+//{% macro %} writes into the caller's buffer, one function for all calls
+std::string lemon::gen_macro(const node_t &node)
+{
+    nodes_t body = node.bodies_[0];
+    int iterators = 0;
+    renumber_iterators(body, iterators);
+
+    int depth = tab_;
+    tab_ = 1;
+    std::string code = "(std::string &code";
+    for (size_t i = 0; i < node.args_.size(); ++i)
+        code += ", const " + node.args_[i].type_str_ + " &" + node.args_[i].str_;
+    code += ")" + br;
+    code += "{" + br;
+    std::string text = gen_cpp(body);
+    code += gen_transcoder(text);
+    code += text;
+    code += "}" + br;
+    tab_ = depth;
+
+    return add_function("lm_macro_" + node.str_ + "_", node.str_, code);
+}
+//the function named by the hash of its code, guarded for unity builds
+std::string lemon::add_function(const std::string &prefix,
+                                const std::string &comment,
+                                const std::string &code,
+                                const std::string &attributes)
+{
+    std::string name = prefix + to_hex(fnv1a(code));
+    if (function_names_.insert(name).second)
+    {
+        std::string guard = name;
+        for (size_t i = 0; i < guard.size(); ++i)
+            guard[i] = (char)toupper(guard[i]);
+        functions_ += "//" + comment + br;
+        functions_ += "#ifndef " + guard + br;
+        functions_ += "#define " + guard + br;
+        functions_ += attributes + "inline void " + name + code;
+        functions_ += "#endif" + br + br;
+    }
+    return name;
 }
-void lemon::parse_template()
+void lemon::parse_template(nodes_t &nodes)
 {
 
     token_t t = get_next_token();
@@ -2187,27 +4423,805 @@ void lemon::parse_template()
     skip(template_.interface_.str_," ");
     template_.name_ = lexer_->file_path_;
     parse_interface();
+    //the rest of the interface line isn't text
+    if (get_string("") == "\r\n")
+        clear_line_buffer();
 
     stack_ = template_.interface_.params_;
     push_auto_escape(true);
     is_base_ = true;
 
-    g_tab = 1;
+    if (parse_html(nodes) != token_t::e_eof)
+        throw syntax_error("status error "+ get_status_str());
+}
+//<name>_locale(), the interface with the locale first
+std::string lemon::locale_interface(const interface_t &interface)
+{
+    size_t paren = interface.str_.find('(');
+    size_t name = interface.str_.rfind(interface.name_, paren);
+    std::string params = interface.str_.substr(paren + 1);
+    params = params.substr(0, params.rfind(')'));
+    std::string str = interface.str_.substr(0, name) + interface.name_ +
+                      "_locale(const std::string &lm_locale";
+    if (params.find_first_not_of(" \t") != std::string::npos)
+        str += ", " + params;
+    return str + ")";
+}
+std::string lemon::gen_template(const nodes_t &nodes,
+                                const std::vector<nodes_t> &variants,
+                                const std::vector<nodes_t> &localized)
+{
+    std::string code;
+    std::string header = header_path(template_.name_);
+    code += "#include \"lemon.hpp\"" + br;
+    if (!counters_.empty())
+        code += "#include \"lemon_profile.hpp\"" + br;
+    if (!charset_.empty())
+        code += "#include \"lemon_charset.hpp\"" + br;
+    code += "#include \"" + header.substr(header.find_last_of("/\\") + 1) + "\"" + br + br;
+    code += counters_;
+
+    std::string body = gen_function(template_.interface_, nodes);
+    const std::vector<variant_t> &bound = variants_[template_.name_];
+    for (size_t i = 0; i < variants.size(); ++i)
+    {
+        interface_t interface = variant_interface(template_.interface_, bound[i]);
+        body += br + gen_function(interface, variants[i]);
+    }
+    for (size_t i = 0; i < localized.size(); ++i)
+    {
+        variant_t locale;
+        locale.name_ = translated_[i];
+        interface_t interface = variant_interface(template_.interface_, locale);
+        body += br + gen_function(interface, localized[i]);
+    }
+    if (!locales_.empty())
+    {
+        //locales without a translation render the source text
+        const interface_t &interface = template_.interface_;
+        std::string args;
+        for (size_t i = 0; i < interface.params_.size(); ++i)
+            args += (i ? ", " : "") + interface.params_[i].name_;
+        body += br + locale_interface(interface) + br + "{" + br;
+        for (size_t i = 0; i < translated_.size(); ++i)
+        {
+            body += "\tif (lm_locale == \"" + translated_[i] + "\")" + br;
+            body += "\t\treturn " + interface.name_ + "_" + translated_[i] +
+                    "(" + args + ");" + br;
+        }
+        body += "\treturn " + interface.name_ + "(" + args + ");" + br;
+        body += "}" + br;
+    }
+    code += literal_decls_;
+    if (!literal_decls_.empty())
+        code += br;
+    code += functions_;
+    code += body;
+    return code;
+}
+//the render function, and the record lemon_reload.hpp finds it by
+//the counters of a function are numbered on its optimized tree. an
+//instrumented build declares them, else the profile read for the
+//function applies if it was taken from the same tree.
+void lemon::use_profile(const std::string &name, nodes_t &nodes)
+{
+    size_t sites = number_sites(nodes);
+    std::string hash = to_hex(fnv1a(dump_ir(nodes)));
+    if (instrument_ && backend_ == e_cpp)
+    {
+        std::string counts = "lm_counts_" + name;
+        std::string profile = "lm_profile_" + name;
+        //never empty
+        counters_ += "static unsigned long long " + counts;
+        counters_ += "[" + number(sites + 1) + "];" + br;
+        counters_ += "static lm::profile_t " + profile + " =" + br;
+        counters_ += "{" + br;
+        counters_ += "\t\"" + name + "\", \"" + hash + "\", 0, 0, ";
+        counters_ += counts + ", " + number(sites) + ", NULL" + br;
+        counters_ += "};" + br;
+        counters_ += "static lm::profile_link " + profile + "_link(" + profile + ");" + br + br;
+        profiles_.erase(name);
+        return;
+    }
+    std::map<std::string, profile_t>::iterator it = profiles_.find(name);
+    if (it == profiles_.end())
+        return;
+    if (it->second.hash_ != hash || it->second.counts_.size() != sites)
+    {
+        std::cout << template_.name_ << ": the profile of " << name
+                  << " is from another version, not used" << std::endl;
+        profiles_.erase(it);
+        return;
+    }
+    apply_profile(nodes, it->second.counts_, inline_threshold_);
+}
+std::string lemon::gen_function(const interface_t &interface, const nodes_t &nodes)
+{
+    tab_ = 1;
+    counter_array_.clear();
+    if (instrument_)
+        counter_array_ = "lm_counts_" + interface.name_;
+    std::string code;
+    code += interface.str_ + br;
+    code += "{" + br;
+    if (nodes.empty() || (nodes.size() == 1 && nodes[0].type_ == node_t::e_literal))
+    {
+        //fully static, rendered at compile time
+        std::string text = nodes.empty() ? "" : nodes[0].str_;
+        if (literal_pool_ && text.size() >= pool_min_size)
+        {
+            code += tab() + "std::string code;" + br;
+            code += tab() + "lm::append_literal(code, " + gen_literal(text) + ");" + br;
+            code += tab() + "return code;" + br;
+        }
+        else
+            code += tab() + "return \"" + escape_cpp(text, !charset_.empty()) + "\";" + br;
+    }
+    else
+    {
+        code += tab() + "std::string code;" + br;
+        //the average size the profile saw
+        std::map<std::string, profile_t>::const_iterator it;
+        it = profiles_.find(interface.name_);
+        if (it != profiles_.end() && it->second.renders_)
+        {
+            code += tab() + "code.reserve(";
+            code += number(it->second.bytes_ / it->second.renders_) + ");" + br;
+        }
+        std::string text = gen_cpp(nodes);
+        code += gen_transcoder(text);
+        code += text;
+        if (!counter_array_.empty())
+        {
+            code += tab() + "lm_profile_" + interface.name_ + ".bytes_ += code.size();" + br;
+            code += tab() + "++lm_profile_" + interface.name_ + ".renders_;" + br;
+        }
+        code += tab() + "return code;" + br;
+    }
+    code += "}" + br;
+
+    const std::string &name = interface.name_;
+    code += br;
+    code += "extern \"C\" LM_EXPORT const lm::export_t lm_template_" + name + " =" + br;
+    code += "{" + br;
+    code += tab() + "\"" + name + "\"," + br;
+    code += tab() + "\"" + escape_cpp(interface.str_) + "\"," + br;
+    code += tab() + "(lm::function_t)&" + name + br;
+    code += "};" + br;
+    return code;
+}
+//<name>_<variant>(), the interface without the bound parameters
+lemon::interface_t lemon::variant_interface(const interface_t &interface,
+                                            const variant_t &variant)
+{
+    interface_t result = interface;
+    result.name_ = interface.name_ + "_" + variant.name_;
+    result.params_.clear();
+    std::string params;
+    for (size_t i = 0; i < interface.params_.size(); ++i)
+    {
+        const field &f = interface.params_[i];
+        bool bound = false;
+        for (size_t j = 0; j < variant.constants_.size() && !bound; ++j)
+            bound = variant.constants_[j].first == f.name_;
+        if (bound)
+            continue;
+        result.params_.push_back(f);
+        size_t begin = f.str_.find_first_not_of(" \t");
+        size_t end = f.str_.find_last_not_of(" \t");
+        if (!params.empty())
+            params += ", ";
+        if (begin != std::string::npos)
+            params += f.str_.substr(begin, end - begin + 1);
+    }
+    size_t paren = interface.str_.find('(');
+    size_t name = interface.str_.rfind(interface.name_, paren);
+    result.str_ = interface.str_.substr(0, name) + result.name_ + "(" + params + ")";
+    return result;
+}
+void lemon::bind_constants(nodes_t &nodes, const variant_t &variant)
+{
+    const std::vector<field> &params = template_.interface_.params_;
+    for (size_t i = 0; i < variant.constants_.size(); ++i)
+    {
+        const std::string &name = variant.constants_[i].first;
+        const std::string &value = variant.constants_[i].second;
+        std::string error = "variant " + variant.name_ + ": " + name;
+        const field *param = NULL;
+        for (size_t j = 0; j < params.size() && !param; ++j)
+        {
+            if (params[j].name_ == name)
+                param = &params[j];
+        }
+        if (!param)
+            throw syntax_error(error + " is not a parameter");
+
+        bool quoted = value.size() >= 2 && value[0] == '"' &&
+                      value[value.size() - 1] == '"';
+        //no leading 0, C++ would read it as octal
+        size_t sign = !value.empty() && value[0] == '-' ? 1 : 0;
+        bool digits = value.size() > sign &&
+                      (value[sign] != '0' || value.size() == sign + 1);
+        for (size_t j = sign; digits && j < value.size(); ++j)
+            digits = value[j] >= '0' && value[j] <= '9';
+        switch (param->type_)
+        {
+            case field::e_bool:
+                if (value != "true" && value != "false")
+                    throw syntax_error(error + " takes true or false");
+                bind_constant(nodes, name, expr_t(expr_t::e_number,
+                                                  value == "true" ? "1" : "0"));
+                break;
+            //chars print as characters, they aren't bound
+            case field::e_short:
+            case field::e_unsigned_shot:
+            case field::e_int:
+            case field::e_unsigned_int:
+            case field::e_long:
+            case field::e_unsigned_long:
+            case field::e_long_long:
+            case field::e_unsigned_long_long:
+                if (!digits)
+                    throw syntax_error(error + " takes an integer");
+                bind_constant(nodes, name, expr_t(expr_t::e_number, value));
+                break;
+            case field::e_std_string:
+            case field::e_acl_string:
+            case field::e_safe_string:
+                if (!quoted)
+                    throw syntax_error(error + " takes \"text\"");
+                bind_constant(nodes, name, expr_t(expr_t::e_string,
+                                                  value.substr(1, value.size() - 2)));
+                break;
+            case field::e_std_vector:
+            case field::e_std_list:
+            {
+                std::string type = param->type_str_;
+                type.erase(std::remove(type.begin(), type.end(), ' '), type.end());
+                if (value.empty() || value[0] != '[' ||
+                    type.find("<std::string>") == std::string::npos)
+                    throw syntax_error(error + " takes [\"text\", ...] "
+                                       "for a list of std::string");
+                std::vector<std::string> items;
+                size_t at = 1;
+                while ((at = value.find('"', at)) != std::string::npos)
+                {
+                    size_t close = value.find('"', at + 1);
+                    if (close == std::string::npos)
+                        throw syntax_error(error + " has an open string");
+                    items.push_back(value.substr(at + 1, close - at - 1));
+                    at = close + 1;
+                }
+                bind_constant(nodes, name, items);
+                break;
+            }
+            default:
+                throw syntax_error(error + " can't be bound to a constant");
+        }
+    }
+    //unrolled loops repeat the iterator names
+    int iterators = 0;
+    renumber_iterators(nodes, iterators);
+}
+//standard headers for the parameter types, the model headers
+//only when a parameter is a class or holds one
+std::string lemon::gen_header(const interface_t &interface,
+                              const std::vector<variant_t> &variants,
+                              const std::vector<std::string> &translated) const
+{
+    std::string types;
+    for (size_t i = 0; i < interface.params_.size(); ++i)
+    {
+        const field &f = interface.params_[i];
+        types += to_string(f.namespaces_) + f.type_str_ + br;
+    }
+    bool models = false;
+    for (size_t i = 0; i < classes_.size() && !models; ++i)
+        models = types.find(classes_[i].name_) != std::string::npos;
+
+    std::string code;
+    code += "#pragma once" + br;
+    code += "#include <string>" + br;
+    const char *std_headers[] = {"list", "map", "set", "vector"};
+    for (size_t i = 0; i < sizeof(std_headers) / sizeof(std_headers[0]); ++i)
+    {
+        if (types.find(std::string("std::") + std_headers[i] + "<") != std::string::npos)
+            code += std::string("#include <") + std_headers[i] + ">" + br;
+    }
+    if (types.find("acl::string") != std::string::npos)
+        code += "#include \"acl_cpp/lib_acl.hpp\"" + br;
+    if (types.find("lm::safe_string") != std::string::npos)
+        code += "#include \"lemon.hpp\"" + br;
+    for (size_t i = 0; models && i < headers_.size(); ++i)
+        code += "#include \"" + headers_[i] + "\"" + br;
+    code += br;
+    code += interface.str_ + ";" + br;
+    for (size_t i = 0; i < variants.size(); ++i)
+        code += variant_interface(interface, variants[i]).str_ + ";" + br;
+    for (size_t i = 0; i < translated.size(); ++i)
+    {
+        variant_t locale;
+        locale.name_ = translated[i];
+        code += variant_interface(interface, locale).str_ + ";" + br;
+    }
+    if (!locales_.empty())
+        code += locale_interface(interface) + ";" + br;
+    return code;
+}
+//the interface line of a template, nothing else is parsed
+bool lemon::load_interface(const std::string &file_path)
+{
+    lexer_ = new_lexer(file_path);
+    if (!lexer_)
+        return false;
+    try
+    {
+        lexers_.push_back(lexer_);
+        token_t t = get_next_token();
+        eof_assert(t);
+        if (t.type_ != token_t::e_html_comment_begin)
+            throw syntax_error("error not find template interface.");
+        template_.interface_.str_ = get_string("-->");
+        skip(template_.interface_.str_, " ");
+        parse_interface();
+    }
+    catch (const std::exception& e)
+    {
+        print_lexer_status(e.what());
+        return false;
+    }
+    return true;
+}
+//hash and displace: buckets of names share a displacement, the
+//biggest buckets pick one first, while most slots are free.
+static bool perfect_hash(const std::vector<std::string> &names,
+                         unsigned int seed,
+                         std::vector<unsigned int> &displace,
+                         std::vector<size_t> &slots)
+{
+    size_t size = names.size();
+    std::vector<unsigned long long> hashes;
+    std::vector<std::vector<size_t> > buckets(size);
+    for (size_t i = 0; i < size; ++i)
+    {
+        hashes.push_back(lm::name_hash(names[i].c_str(),
+                                       names[i].size(), seed));
+        buckets[hashes[i] % size].push_back(i);
+    }
+    std::vector<std::pair<size_t, size_t> > order;
+    for (size_t i = 0; i < size; ++i)
+        order.push_back(std::make_pair(buckets[i].size(), i));
+    std::sort(order.rbegin(), order.rend());
+
+    std::vector<bool> used(size, false);
+    displace.assign(size, 0);
+    slots.assign(size, 0);
+    for (size_t i = 0; i < order.size() && order[i].first; ++i)
+    {
+        const std::vector<size_t> &bucket = buckets[order[i].second];
+        unsigned int d = 0;
+        for (; d < 1000000; ++d)
+        {
+            std::vector<size_t> taken;
+            for (size_t j = 0; j < bucket.size(); ++j)
+            {
+                size_t slot = lm::name_slot(hashes[bucket[j]], d, size);
+                if (used[slot] ||
+                    std::find(taken.begin(), taken.end(), slot) != taken.end())
+                    break;
+                taken.push_back(slot);
+            }
+            if (taken.size() != bucket.size())
+                continue;
+            for (size_t j = 0; j < bucket.size(); ++j)
+            {
+                used[taken[j]] = true;
+                slots[bucket[j]] = taken[j];
+            }
+            displace[order[i].second] = d;
+            break;
+        }
+        if (d == 1000000)
+            return false;
+    }
+    return true;
+}
+bool lemon::gen_registry(const std::vector<std::string> &templates,
+                         const std::string &file_path) const
+{
+    std::vector<interface_t> interfaces;
+    std::vector<std::string> names;
+    for (size_t i = 0; i < templates.size(); ++i)
+    {
+        lemon ctx(classes_, sources_, backend_);
+        if (!ctx.load_interface(templates[i]))
+            return false;
+        std::vector<interface_t> found(1, ctx.template_.interface_);
+        std::map<std::string, std::vector<variant_t> >::const_iterator it;
+        it = variants_.find(templates[i]);
+        for (size_t j = 0; it != variants_.end() && j < it->second.size(); ++j)
+            found.push_back(variant_interface(found[0], it->second[j]));
+        for (size_t j = 0; j < found.size(); ++j)
+        {
+            const interface_t &interface = found[j];
+            if (std::find(names.begin(), names.end(), interface.name_) != names.end())
+            {
+                std::cout << templates[i] << ": template " << interface.name_
+                          << " defined twice" << std::endl;
+                return false;
+            }
+            interfaces.push_back(interface);
+            names.push_back(interface.name_);
+        }
+    }
+
+    unsigned int seed = 0;
+    std::vector<unsigned int> displace;
+    std::vector<size_t> slots;
+    while (!names.empty() && !perfect_hash(names, seed, displace, slots))
+        seed++;
+
+    std::string code;
+    code += "#include \"lemon.hpp\"" + br;
+    code += "#include \"lemon_registry.hpp\"" + br;
+    for (size_t i = 0; i < headers_.size(); ++i)
+        code += "#include \"" + headers_[i] + "\"" + br;
+    code += br;
+    //undefined references for templates that aren't linked in
+    for (size_t i = 0; i < interfaces.size(); ++i)
+        code += interfaces[i].str_ + ";" + br;
+    code += br;
+
+    code += "namespace" + br + "{" + br;
+    for (size_t i = 0; i < interfaces.size(); ++i)
+    {
+        const interface_t &interface = interfaces[i];
+        const std::string &name = interface.name_;
+        code += "    void lm_render_" + name;
+        code += "(const void *const *args, std::string &out)" + br;
+        code += "    {" + br;
+        code += "        out = " + name + "(";
+        for (size_t j = 0; j < interface.params_.size(); ++j)
+        {
+            const field &f = interface.params_[j];
+            if (j)
+                code += "," + br + std::string(15 + name.size(), ' ');
+            code += "*(const " + to_string(f.namespaces_) + f.type_str_;
+            code += " *)args[" + number(j) + "]";
+        }
+        code += ");" + br;
+        code += "    }" + br;
+        code += "    const lm::param_t lm_params_" + name + "[] =" + br;
+        code += "    {" + br;
+        for (size_t j = 0; j < interface.params_.size(); ++j)
+        {
+            const field &f = interface.params_[j];
+            code += "        {\"" + f.name_ + "\", \"";
+            code += escape_cpp(to_string(f.namespaces_) + f.type_str_) + "\"}";
+            code += (j + 1 < interface.params_.size() ? "," : "") + br;
+        }
+        code += "    };" + br;
+    }
+
+    //entries in slot order
+    std::vector<size_t> entries(names.size());
+    for (size_t i = 0; i < names.size(); ++i)
+        entries[slots[i]] = i;
+    code += "    const lm::entry_t lm_entries[] =" + br;
+    code += "    {" + br;
+    for (size_t i = 0; i < entries.size(); ++i)
+    {
+        const interface_t &interface = interfaces[entries[i]];
+        const std::string &name = interface.name_;
+        code += "        {\"" + name + "\", \"" + escape_cpp(interface.str_);
+        code += "\", lm_render_" + name + ", lm_params_" + name + ", ";
+        code += number(interface.params_.size());
+        code += "}" + std::string(i + 1 < entries.size() ? "," : "") + br;
+    }
+    if (entries.empty())
+        code += "        {\"\", \"\", 0, 0, 0}" + br;
+    code += "    };" + br;
+    code += "    const unsigned int lm_displace[] =" + br;
+    code += "    {" + br;
+    for (size_t i = 0; i < displace.size(); i += 8)
+    {
+        code += "       ";
+        for (size_t j = i; j < i + 8 && j < displace.size(); ++j)
+        {
+            code += " " + number(displace[j]);
+            if (j + 1 < displace.size())
+                code += ",";
+        }
+        code += br;
+    }
+    if (displace.empty())
+        code += "        0" + br;
+    code += "    };" + br;
+    code += "}" + br + br;
+
+    code += "namespace lm" + br + "{" + br;
+    code += "    const entry_t *find_template(const char *name, size_t len)" + br;
+    code += "    {" + br;
+    code += "        const size_t size = " + number(names.size()) + ";" + br;
+    code += "        if (!size)" + br;
+    code += "            return NULL;" + br;
+    code += "        unsigned long long hash = name_hash(name, len, " +
+            number(seed) + "u);" + br;
+    code += "        const entry_t *e = &lm_entries[name_slot(hash, "
+            "lm_displace[hash % size], size)];" + br;
+    code += "        if (strncmp(e->name_, name, len) != 0 || e->name_[len])" + br;
+    code += "            return NULL;" + br;
+    code += "        return e;" + br;
+    code += "    }" + br;
+    code += "    const entry_t *templates(size_t &size)" + br;
+    code += "    {" + br;
+    code += "        size = " + number(names.size()) + ";" + br;
+    code += "        return lm_entries;" + br;
+    code += "    }" + br;
+    code += "}" + br;
+    return write_if_changed(file_path, code);
+}
+//random values of the bytes for the gear hash, splitmix64 outputs
+static const unsigned long long gear[256] =
+{
+    0xe220a8397b1dcdafULL, 0x6e789e6aa1b965f4ULL, 0x06c45d188009454fULL,
+    0xf88bb8a8724c81ecULL, 0x1b39896a51a8749bULL, 0x53cb9f0c747ea2eaULL,
+    0x2c829abe1f4532e1ULL, 0xc584133ac916ab3cULL, 0x3ee5789041c98ac3ULL,
+    0xf3b8488c368cb0a6ULL, 0x657eecdd3cb13d09ULL, 0xc2d326e0055bdef6ULL,
+    0x8621a03fe0bbdb7bULL, 0x8e1f7555983aa92fULL, 0xb54e0f1600cc4d19ULL,
+    0x84bb3f97971d80abULL, 0x7d29825c75521255ULL, 0xc3cf17102b7f7f86ULL,
+    0x3466e9a083914f64ULL, 0xd81a8d2b5a4485acULL, 0xdb01602b100b9ed7ULL,
+    0xa9038a921825f10dULL, 0xedf5f1d90dca2f6aULL, 0x54496ad67bd2634cULL,
+    0xdd7c01d4f5407269ULL, 0x935e82f1db4c4f7bULL, 0x69b82ebc92233300ULL,
+    0x40d29eb57de1d510ULL, 0xa2f09dabb45c6316ULL, 0xee521d7a0f4d3872ULL,
+    0xf16952ee72f3454fULL, 0x377d35dea8e40225ULL, 0x0c7de8064963bab0ULL,
+    0x05582d37111ac529ULL, 0xd254741f599dc6f7ULL, 0x69630f7593d108c3ULL,
+    0x417ef96181daa383ULL, 0x3c3c41a3b43343a1ULL, 0x6e19905dcbe531dfULL,
+    0x4fa9fa7324851729ULL, 0x84eb4454a792922aULL, 0x134f7096918175ceULL,
+    0x07dc930b302278a8ULL, 0x12c015a97019e937ULL, 0xcc06c31652ebf438ULL,
+    0xecee65630a691e37ULL, 0x3e84ecb1763e79adULL, 0x690ed476743aae49ULL,
+    0x774615d7b1a1f2e1ULL, 0x22b353f04f4f52daULL, 0xe3ddd86ba71a5eb1ULL,
+    0xdf268adeb6513356ULL, 0x2098eb73d4367d77ULL, 0x03d6845323ce3c71ULL,
+    0xc952c5620043c714ULL, 0x9b196bca844f1705ULL, 0x30260345dd9e0ec1ULL,
+    0xcf448a5882bb9698ULL, 0xf4a578dccbc87656ULL, 0xbfdeaed9a17b3c8fULL,
+    0xed79402d1d5c5d7bULL, 0x55f070ab1cbbf170ULL, 0x3e00a34929a88f1dULL,
+    0xe255b237b8bb18fbULL, 0x2a7b67af6c6ad50eULL, 0x466d5e7f3e46f143ULL,
+    0x42375cb399a4fc72ULL, 0x8c8a1f148a8bb259ULL, 0x32fcab5daed5bdfcULL,
+    0x9e60398c8d8553c0ULL, 0xee89cceb8c4064c0ULL, 0xdb0215941d86a66fULL,
+    0x5ccde78203c367a8ULL, 0xf1bcbc6a1ec11786ULL, 0xef054fceee954551ULL,
+    0xdf82012d0555c6dfULL, 0x292566ff72403c08ULL, 0xc4dd302a1bfa1137ULL,
+    0xd85f219db5c554e1ULL, 0x6a27ff807441bcd2ULL, 0x96a573e9b48216e8ULL,
+    0x46a9fdac40bf0048ULL, 0x3dd12464a0ee15b4ULL, 0x451e521296a7eea1ULL,
+    0x56e4398a98f8a0fdULL, 0x7b7dc2160e3335a7ULL, 0xc679ee0bebcb1ccaULL,
+    0x928d6f2d7453424eULL, 0x1b38994205234c6dULL, 0x8086d193a6f2b568ULL,
+    0x21c6e26639ac2c65ULL, 0xd9dccac414d23c6fULL, 0x91cd642057e00235ULL,
+    0x77fc607dc6589373ULL, 0x05b8abe26dd3aee7ULL, 0x12f6436ac376cc66ULL,
+    0x64952424897b2307ULL, 0xee8c2baf6343e5c3ULL, 0xdc4c613d9eba2304ULL,
+    0x3505b7796bd1a506ULL, 0x8176daf800a05f50ULL, 0x8bd8ff7a0385cdbcULL,
+    0x1a764a3cd78101daULL, 0xbe4d15bf6ca266acULL, 0xa85e1f38bb2dc749ULL,
+    0x56759a968493cd8cULL, 0xf3a9bce7336bd182ULL, 0x365b15013741519bULL,
+    0x1f7a44a6b109ac94ULL, 0x3521d628813cb177ULL, 0x6a77afab0f7c9370ULL,
+    0x179642d8cde95015ULL, 0x5ef102a8fb354461ULL, 0xf51c504764ed82f2ULL,
+    0xc58427f041ce6808ULL, 0xfad8fc45c9643c37ULL, 0xcf8682f9a70fa9c0ULL,
+    0x7e1b3b75a4005729ULL, 0x992dd867927b52d8ULL, 0x7fbd5db142f6791fULL,
+    0x370595aacab4adaeULL, 0xb1392dbdc5ab61d6ULL, 0x9fea7dfc79d452d9ULL,
+    0x40b12b120085641cULL, 0xa192afe3157c85d0ULL, 0xc847729f4e08f3a3ULL,
+    0x6f1384a306c41fc2ULL, 0x12d05c4045a39c19ULL, 0x9899202fd20f0841ULL,
+    0xe9c7191857e774b8ULL, 0x4eead809af5b0cc3ULL, 0xe809acafa23864a4ULL,
+    0x4da1edaba1d0f7bdULL, 0x846eb9673349f8e4ULL, 0x87bae55b86039fe8ULL,
+    0x7f367b8bd953eff2ULL, 0x3884700f650d04e1ULL, 0xbfe4b2ab46980cadULL,
+    0xc5fc89075299106cULL, 0x37b2fa361adea7cdULL, 0x7d75d813f04895b4ULL,
+    0x702f5b393f62c0e0ULL, 0x0a3fc775f4ecf37fULL, 0xe4b23787a352437fULL,
+    0xf83fa245c34d6363ULL, 0xb99bcf040786cf50ULL, 0x38b6ea0a0e6c9d8aULL,
+    0x093fdc76776e37e1ULL, 0x1a75e6f76ba7eee8ULL, 0x442cdcfee9660c62ULL,
+    0x22d58d35116b5e0bULL, 0x87d4a5180f6a3645ULL, 0x589fb216bd82131bULL,
+    0x91d031cad319aec0ULL, 0xabecf76a553d320bULL, 0xb8686cb347612dcfULL,
+    0xfcab66337c0a77f5ULL, 0xac318214381ec437ULL, 0x6eb7f0fca24494aeULL,
+    0xcf42861dcdc895a9ULL, 0x4abad7a1586d7a91ULL, 0xc21b318dc2f49745ULL,
+    0xd49474dc2acbd1f0ULL, 0xb1d4873747c1c8e1ULL, 0x5434dc8c7d015bf6ULL,
+    0xe1c486287511b6a9ULL, 0xa8616df62e89a193ULL, 0x31ce6319498d8347ULL,
+    0xafd0b486123d6faaULL, 0xe6495f5d102301ebULL, 0x0dc51ced17a43c52ULL,
+    0x8bcbcde81355ef2dULL, 0x2412af73fdee7cfcULL, 0xc8d589e486e29eedULL,
+    0x23390e8664517f89ULL, 0x251ade58e8a6849dULL, 0xf8555dbd2e8f9cb0ULL,
+    0xcb417c3eef54f7c3ULL, 0x8028f8e1aac3a919ULL, 0x10e31052acf748a0ULL,
+    0x2d886c073b1e1b78ULL, 0x972974d90df9faeeULL, 0xbc1b7b38796893baULL,
+    0x1958ed432070e652ULL, 0xca5f297197a12dccULL, 0xe025a27375704f28ULL,
+    0x418010a570a924fbULL, 0x9828e2941bfc419cULL, 0x4fbacd2f52b85c1fULL,
+    0x33dd5b756211cc67ULL, 0x23c8dfdd1db57ff0ULL, 0x32f81801a1a8e901ULL,
+    0x26884eac5ada36daULL, 0xcaa82f9bb42e37d4ULL, 0x19fb1a7491d6a7d1ULL,
+    0x5aa0243aa357f38eULL, 0xb31d917809e447f0ULL, 0x3f9c197225215be0ULL,
+    0xdc3c315a1e33c095ULL, 0x3dd399ad533e80acULL, 0x566f32cce8301d95ULL,
+    0xc880188083d9ba21ULL, 0xb9cc357f3b0e7d2eULL, 0x0237d2123a8a8d6cULL,
+    0xbf636e9aa7cbf6bdULL, 0xd7bd4284c4e2a6a7ULL, 0xda2ebb47d50577a9ULL,
+    0x90ba1c11b539087dULL, 0x44993d31552b4f57ULL, 0x32c2d6f80a8a8898ULL,
+    0x450583ed7fb54b19ULL, 0xec2b0b09e50ef3efULL, 0xd918a0b6e2efd65cULL,
+    0xe37a868d9785f572ULL, 0x7d1a6118f2b0f37aULL, 0x9e2e3cc13b343439ULL,
+    0xefd82c11212e37e8ULL, 0xaf89c05cd4fc75edULL, 0x55bc16bb9697108eULL,
+    0x6c4701fa5db69beeULL, 0x9237338441daf445ULL, 0x248cf0831e81a5fcULL,
+    0xacc13557e77de273ULL, 0x520970c25e06513aULL, 0x657329cb02987cabULL,
+    0xa9b0b3366a4e55a8ULL, 0xc4d06ca2f39acdd4ULL, 0x5dce37d68170cde1ULL,
+    0x5f1e44e77e1854c9ULL, 0x6883d452d55df899ULL, 0x05c5bd62f1067032ULL,
+    0xe680b683ce60fab0ULL, 0x5dc9da3f286d18b1ULL, 0x94b4bf3ab85ed6d8ULL,
+    0xce65f449e3acc5a3ULL, 0x34b0209642cea639ULL, 0xc14c3c771d904827ULL,
+    0x6addcee2bd9cdee5ULL, 0xe24eed137ffbb613ULL, 0x75dd58ef79963d1bULL,
+    0xfdb83ecf6cc24920ULL, 0x7a1d0057c57169fbULL, 0x339200f4feb62d07ULL,
+    0xd33f4d4ac88469f4ULL, 0x8226f234e68dfee4ULL, 0x320def4f2a105536ULL,
+    0x7786f3b13aefc159ULL, 0xb28225ac9df63ee2ULL, 0x781b9d0376cc6044ULL,
+    0x05bd0115226c6ab6ULL, 0xd302230207bdfdabULL, 0xdb898abd8e0d2933ULL,
+    0x9e79a397ba00b9ccULL, 0x89df84a5f0003ee8ULL, 0x011f04f2a75fb9beULL,
+    0x5a5832bb47bcf19eULL
+};
+//pieces of str cut where the bytes before say so, not at offsets, so
+//the same text in two literals gives the same pieces wherever it is
+static void chunk(const std::string &str, std::vector<std::string> &pieces)
+{
+    const size_t min_size = 64;
+    const size_t max_size = 4096;
+    size_t begin = 0;
+    unsigned long long hash = 0;
+    for (size_t i = 0; i < str.size(); ++i)
+    {
+        //the top bits of the gear hash depend on the last 64 bytes
+        hash = (hash << 1) + gear[(unsigned char)str[i]];
+        size_t size = i + 1 - begin;
+        if ((size >= min_size && (hash >> 58) == 0) || size >= max_size)
+        {
+            pieces.push_back(str.substr(begin, size));
+            begin = i + 1;
+        }
+    }
+    if (begin < str.size())
+        pieces.push_back(str.substr(begin));
+}
+static bool longer(const std::string &a, const std::string &b)
+{
+    return a.size() != b.size() ? a.size() > b.size() : a < b;
+}
+// the literals of each template are read from the .literals file its
+// compilation left, a template without one is compiled again. they are
+// cut into pieces and a piece is in the blob once. longest first, a literal lays
+// its new pieces at the end of the blob, and pieces next to each other
+// in the blob are one slice. a head shared by the pages is a slice then,
+// the text of each page another.
+bool lemon::gen_literal_pool(const std::vector<std::string> &templates,
+                             const std::string &file_path) const
+{
+    if (backend_ != e_cpp)
+    {
+        std::cout << "a literal pool needs the C++ backend" << std::endl;
+        return false;
+    }
+    std::set<std::string> all;
+    for (size_t i = 0; i < templates.size(); ++i)
+    {
+        std::string data;
+        if (literal_pool_ && up_to_date(templates[i]) &&
+            read_file(output_path(templates[i]) + ".literals", data) &&
+            unpack_literals(data, all))
+            continue;
+        lemon ctx(classes_, sources_, backend_);
+        copy_options(ctx, templates[i]);
+        ctx.literal_pool_ = true;
+        std::string code;
+        if (!ctx.compile(templates[i], code))
+            return false;
+        all.insert(ctx.literals_.begin(), ctx.literals_.end());
+    }
+    std::vector<std::string> literals(all.begin(), all.end());
+    std::sort(literals.begin(), literals.end(), longer);
+
+    std::string blob;
+    std::map<std::string, size_t> placed;
+    //offset and size of the slices of each literal
+    std::vector<std::vector<std::pair<size_t, size_t> > > slices(literals.size());
+    for (size_t i = 0; i < literals.size(); ++i)
+    {
+        std::vector<std::string> pieces;
+        chunk(literals[i], pieces);
+        for (size_t j = 0; j < pieces.size(); ++j)
+        {
+            std::map<std::string, size_t>::iterator it = placed.find(pieces[j]);
+            if (it == placed.end())
+            {
+                it = placed.insert(std::make_pair(pieces[j], blob.size())).first;
+                blob += pieces[j];
+            }
+            std::vector<std::pair<size_t, size_t> > &runs = slices[i];
+            if (!runs.empty() && runs.back().first + runs.back().second == it->second)
+                runs.back().second += pieces[j].size();
+            else
+                runs.push_back(std::make_pair(it->second, pieces[j].size()));
+        }
+    }
+
     std::string code;
-    code += "#include \"lemon.hpp\"" + br+br;
-    code += template_.interface_.str_+br;
-    code += "{"+br;
-    code += tab() + "std::string code;" +br;
-    code += parse_html();
-    code += tab()+"return code;"+br;
-    code +="}"+br;
-    std::cout << code;
+    code += "#include \"lemon.hpp\"" + br + br;
+    code += "//literals of the templates, lm_literal_<hash> are their slices" + br;
+    code += "namespace" + br + "{" + br;
+    //numbers, compilers limit the size of string literals
+    code += "    const unsigned char lm_literals[] =" + br;
+    code += "    {" + br;
+    for (size_t i = 0; i < blob.size(); i += 16)
+    {
+        code += "       ";
+        for (size_t j = i; j < i + 16 && j < blob.size(); ++j)
+            code += " " + number((unsigned char)blob[j]) + ",";
+        code += br;
+    }
+    code += "        0" + br;
+    code += "    };" + br;
+    code += "}" + br + br;
+    for (size_t i = 0; i < literals.size(); ++i)
+    {
+        code += "extern const lm::slice_t lm_literal_" + to_hex(fnv1a(literals[i])) +
+                "[] =" + br;
+        code += "{" + br;
+        for (size_t j = 0; j < slices[i].size(); ++j)
+        {
+            code += "    {(const char *)lm_literals + " + number(slices[i][j].first) +
+                    ", " + number(slices[i][j].second) + "}," + br;
+        }
+        code += "    {NULL, 0}" + br;
+        code += "};" + br;
+    }
+    return write_if_changed(file_path, code);
+}
+// <prefix>.h, lemon.hpp and the model headers, to precompile.
+// <prefix>_<n>.cpp, the prelude and a run of generated templates,
+// split by generated size so the parts build in about the same time.
+bool lemon::gen_unity(const std::vector<std::string> &templates,
+                      const std::string &prefix, int parts) const
+{
+    if (backend_ != e_cpp)
+    {
+        std::cout << "unity builds need the C++ backend" << std::endl;
+        return false;
+    }
+    std::string prelude;
+    prelude += "#pragma once" + br;
+    prelude += "#include \"lemon.hpp\"" + br;
+    for (size_t i = 0; i < headers_.size(); ++i)
+        prelude += "#include \"" + headers_[i] + "\"" + br;
+    if (!write_if_changed(prefix + ".h", prelude))
+        return false;
 
-    std::fstream file;
-    std::string file_path = template_.name_;
-    file_path += ".cpp";
-    file.open(file_path.c_str(), std::ios::out);
-    file.write(code.c_str(), code.size());
+    std::vector<size_t> sizes;
+    size_t total = 0;
+    for (size_t i = 0; i < templates.size(); ++i)
+    {
+        std::string code;
+        if (!read_file(output_path(templates[i]), code))
+        {
+            std::cout << "open file error. " << output_path(templates[i])
+                      << std::endl;
+            return false;
+        }
+        sizes.push_back(code.size());
+        total += code.size();
+    }
+    if (parts < 1)
+        parts = 1;
+
+    std::string name = prefix.substr(prefix.find_last_of("/\\") + 1);
+    size_t next = 0;
+    size_t done = 0;
+    for (int part = 0; part < parts; ++part)
+    {
+        std::string code;
+        code += "#include \"" + name + ".h\"" + br;
+        //the rest goes to the last part
+        size_t limit = total / parts * (part + 1);
+        while (next < templates.size() &&
+               (part + 1 == parts || done + sizes[next] / 2 <= limit))
+        {
+            code += "#include \"" + output_path(templates[next]) + "\"" + br;
+            done += sizes[next];
+            next++;
+        }
+        if (!write_if_changed(prefix + "_" + number(part + 1) + ".cpp", code))
+            return false;
+    }
+    return true;
 }
 /////////////////////////////////////////////////////////////////////////////
 bool lemon::check_file_done(const std::string &file_name)
@@ -2228,8 +5242,10 @@ void lemon::parse_cpp_include()
         throw std::runtime_error("new lexer error");
     lexers_.push_back(lexer_);
     parse_cpp_header();
+    analyzed_files_.push_back(file_path);
     delete lexer_->file_;
     delete lexer_;
+    lexers_.pop_back();
     lexer_ = lexers_.back();
 }
 void lemon::parse_cpp_header()
@@ -2253,7 +5269,7 @@ void lemon::parse_cpp_header()
             }
             t = get_next_token();
             if(t.type_ == token_t::e_include)
-                return parse_cpp_include();
+                parse_cpp_include();
         }
         else if(t.type_ == token_t::e_cpp_comment_begin)
         {
@@ -2536,7 +5552,8 @@ lemon::field lemon::parse_field_type()
             t.type_ == token_t::e_long_long||
             t.type_ == token_t::e_unsigned_long_long||
             t.type_ == token_t::e_std_string||
-            t.type_ == token_t::e_acl_string)
+            t.type_ == token_t::e_acl_string||
+            t.type_ == token_t::e_safe_string)
     {
         f.type_ = get_field_type(t);
         f.type_str_.append(t.str_);
@@ -2,14 +2,197 @@
 #include "acl_cpp/lib_acl.hpp"
 #include "lemon.h"
 
+static void usage(const char *procname)
+{
+    printf("usage: %s [-j threads] [-m manifest] [--watch] [--vm] "
+           "[--reflect out.hpp] [--registry out.cpp] "
+           "[--unity prefix [--unity-parts n]] [--inline-includes nodes] "
+           "[--outline nodes] [--instrument] [--profile file] "
+           "[--literal-pool out.cpp] [--no-minify] [--locale name file.po] "
+           "[--charset name] "
+           "[--dump-ir] [header.h ...] "
+           "[template.lm ...]\r\n"
+           " -j threads  compile templates on `threads` threads\r\n"
+           " -m manifest batch manifest, lines of `header <path>`, "
+           "`template <path>`, `variant <path> <name> <param>=<value> ...`, "
+           "<name>_<variant>() rendering with those parameters "
+           "bound, `locale <name> <file.po>`, or `charset <path> <name>`\r\n"
+           " --watch     keep running, rebuild templates when they, "
+           "their includes, base templates or headers change\r\n"
+           " --vm        write <template>.lmc bytecode instead of C++\r\n"
+           " --reflect   write the lm::vm::reflect<> tables of the headers' "
+           "classes, for rendering .lmc programs\r\n"
+           " --registry  write lm::find_template(), the templates "
+           "by name\r\n"
+           " --unity     write the generated templates as unity builds, "
+           "prefix_1.cpp ... including the prelude prefix.h\r\n"
+           " --unity-parts  number of unity builds, 1 by default\r\n"
+           " --inline-includes  paste includes of up to `nodes` nodes in "
+           "place, bigger ones are shared functions, 4 by default\r\n"
+           " --outline   compile branch and loop bodies of more than `nodes` "
+           "nodes as functions of their own, {%% cold %%} regions always "
+           "are\r\n"
+           " --instrument  count branches and loop trips at run time, "
+           "lm::write_profile() writes the counts\r\n"
+           " --profile   compile with the counts of an instrumented build: "
+           "hints, cold branches, switch order and buffer sizes, may be "
+           "repeated\r\n"
+           " --literal-pool  write the literals of the templates, "
+           "deduplicated into one blob, the templates use slices of it\r\n"
+           " --no-minify  keep the whitespace of the text as written. by "
+           "default it is collapsed, and dropped between tags, except in "
+           "pre, textarea, script and style; {%% spaceless %%} blocks "
+           "always are\r\n"
+           " --locale    translate {%% trans %%} and {%% blocktrans %%} text with "
+           "a gettext catalog into <name>_<locale>(), <name>_locale(locale, "
+           "...) picks one, may be repeated\r\n"
+           " --charset   render gbk, gb18030 or another superset of ascii "
+           "instead of utf-8, the text converted at compile time, the "
+           "values as they are written, with lemon_charset.hpp and acl\r\n"
+           " --dump-ir   write <template>.ir, the tree after the parser "
+           "and each optimization pass\r\n",
+           procname);
+}
 
-int main()
+static bool is_header(const std::string &file_path)
 {
-    lemon lm;
+    size_t pos = file_path.find_last_of('.');
+    if (pos == std::string::npos)
+        return false;
+    std::string ext = file_path.substr(pos);
+    return ext == ".h" || ext == ".hpp" || ext == ".hh";
+}
 
-    if(lm.parse_cpp_header("hello.h"))
-        lm.parse_template("hello.lm");
+int main(int argc, char *argv[])
+{
+    lemon lm;
+    int threads = 1;
+    bool watch = false;
+    std::string reflect;
+    std::string registry;
+    std::string literal_pool;
+    std::string unity;
+    int unity_parts = 1;
+    std::vector<std::string> manifests;
+    std::vector<std::string> templates;
 
-    getchar();
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "-j" && i + 1 < argc)
+        {
+            threads = atoi(argv[++i]);
+        }
+        else if (arg == "-m" && i + 1 < argc)
+        {
+            manifests.push_back(argv[++i]);
+        }
+        else if (arg == "--watch")
+        {
+            watch = true;
+        }
+        else if (arg == "--vm")
+        {
+            lm.set_backend(lemon::e_vm);
+        }
+        else if (arg == "--reflect" && i + 1 < argc)
+        {
+            reflect = argv[++i];
+        }
+        else if (arg == "--registry" && i + 1 < argc)
+        {
+            registry = argv[++i];
+        }
+        else if (arg == "--unity" && i + 1 < argc)
+        {
+            unity = argv[++i];
+        }
+        else if (arg == "--unity-parts" && i + 1 < argc)
+        {
+            unity_parts = atoi(argv[++i]);
+        }
+        else if (arg == "--inline-includes" && i + 1 < argc)
+        {
+            lm.set_inline_threshold(atoi(argv[++i]));
+        }
+        else if (arg == "--outline" && i + 1 < argc)
+        {
+            lm.set_outline_threshold(atoi(argv[++i]));
+        }
+        else if (arg == "--instrument")
+        {
+            lm.set_instrument(true);
+        }
+        else if (arg == "--profile" && i + 1 < argc)
+        {
+            if (!lm.load_profile(argv[++i]))
+                return 1;
+        }
+        else if (arg == "--literal-pool" && i + 1 < argc)
+        {
+            literal_pool = argv[++i];
+            lm.set_literal_pool(true);
+        }
+        else if (arg == "--no-minify")
+        {
+            lm.set_minify(false);
+        }
+        else if (arg == "--locale" && i + 2 < argc)
+        {
+            if (!lm.add_locale(argv[i + 1], argv[i + 2]))
+                return 1;
+            i += 2;
+        }
+        else if (arg == "--charset" && i + 1 < argc)
+        {
+            if (!lm.set_charset(argv[++i]))
+                return 1;
+        }
+        else if (arg == "--dump-ir")
+        {
+            lm.set_dump_ir(true);
+        }
+        else if (arg == "-h" || arg[0] == '-')
+        {
+            usage(argv[0]);
+            return arg == "-h" ? 0 : 1;
+        }
+        else if (is_header(arg))
+        {
+            if (!lm.parse_cpp_header(arg))
+                return 1;
+        }
+        else
+        {
+            templates.push_back(arg);
+        }
+    }
+    if (manifests.empty() && templates.empty() && reflect.empty())
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    for (size_t i = 0; i < manifests.size(); ++i)
+    {
+        if (!lm.load_manifest(manifests[i], templates))
+            return 1;
+    }
+    if (!reflect.empty() && !lm.gen_reflect(reflect))
+        return 1;
+    if (!registry.empty() && !lm.gen_registry(templates, registry))
+        return 1;
+    if (watch && !literal_pool.empty())
+    {
+        printf("--watch doesn't rebuild the literal pool\r\n");
+        return 1;
+    }
+    if (watch)
+        return lm.watch(templates, threads) ? 0 : 1;
+    if (!lm.parse_templates(templates, threads))
+        return 1;
+    if (!literal_pool.empty() && !lm.gen_literal_pool(templates, literal_pool))
+        return 1;
+    if (!unity.empty() && !lm.gen_unity(templates, unity, unity_parts))
+        return 1;
     return 0;
-}
\ No newline at end of file
+}
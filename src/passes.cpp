@@ -0,0 +1,2029 @@
+#include <map>
+#include <set>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cctype>
+#include <stdexcept>
+#include "lemon.hpp"
+#include "passes.h"
+
+#define br std::string("\n")
+
+static std::string dump_expr(const expr_t &expr);
+static std::string quote(const std::string &str);
+
+//blocks are resolved by the parser, their bodies belong to the parent
+static void flatten_blocks(nodes_t &nodes)
+{
+    nodes_t result;
+    for (size_t i = 0; i < nodes.size(); ++i)
+    {
+        node_t &node = nodes[i];
+        for (size_t j = 0; j < node.bodies_.size(); ++j)
+            flatten_blocks(node.bodies_[j]);
+        if (node.type_ != node_t::e_block)
+        {
+            result.push_back(node);
+            continue;
+        }
+        nodes_t &body = node.bodies_[0];
+        result.insert(result.end(), body.begin(), body.end());
+    }
+    nodes.swap(result);
+}
+//conditions, filters and tests of literals and bound constants are
+//computed here, the same way lemon.hpp does at run time.
+static bool is_integer(const std::string &str)
+{
+    size_t i = !str.empty() && str[0] == '-' ? 1 : 0;
+    //a leading 0 is octal in C++
+    if (i == str.size() || (str[i] == '0' && i + 1 < str.size()))
+        return false;
+    for (; i < str.size(); ++i)
+    {
+        if (!isdigit((unsigned char)str[i]))
+            return false;
+    }
+    return true;
+}
+static expr_t boolean(bool value)
+{
+    return expr_t(expr_t::e_number, value ? "1" : "0");
+}
+static bool truth(const expr_t &expr)
+{
+    return strtod(expr.str_.c_str(), NULL) != 0;
+}
+template<class T>
+static bool compare(const std::string &op, const T &a, const T &b, bool &result)
+{
+    if (op == "==")
+        result = a == b;
+    else if (op == "!=")
+        result = a != b;
+    else if (op == "<")
+        result = a < b;
+    else if (op == "<=")
+        result = a <= b;
+    else if (op == ">")
+        result = a > b;
+    else if (op == ">=")
+        result = a >= b;
+    else
+        return false;
+    return true;
+}
+static void fold_expr(expr_t &expr)
+{
+    for (size_t i = 0; i < expr.args_.size(); ++i)
+        fold_expr(expr.args_[i]);
+
+    bool result = false;
+    lm::escape_t kind;
+    switch (expr.type_)
+    {
+        case expr_t::e_call:
+        {
+            expr_t arg = expr.args_[0];
+            if (expr.str_ == "length" && arg.type_ == expr_t::e_string)
+                expr = expr_t(expr_t::e_number, lm::$to_string(arg.str_.size()));
+            else if (lm::find_escape(expr.str_, kind) && arg.type_ == expr_t::e_string)
+                expr = expr_t(expr_t::e_string, lm::escape(kind, arg.str_));
+            else if (expr.str_ == "default" && arg.type_ == expr_t::e_string &&
+                     expr.args_[1].type_ == expr_t::e_string)
+                expr = arg.str_.empty() ? expr_t(expr.args_[1]) : arg;
+            else if (expr.str_ == "to_string" && arg.type_ == expr_t::e_number &&
+                     is_integer(arg.str_))
+                expr = expr_t(expr_t::e_string,
+                              lm::$to_string(strtoll(arg.str_.c_str(), NULL, 10)));
+            break;
+        }
+        case expr_t::e_test:
+        {
+            const expr_t &arg = expr.args_[0];
+            if (expr.str_ == "empty" && arg.type_ == expr_t::e_string)
+                expr = boolean(!arg.str_.empty());
+            else if (expr.str_ == "zero" && arg.type_ == expr_t::e_number)
+                expr = boolean(truth(arg));
+            break;
+        }
+        case expr_t::e_compare:
+        {
+            const expr_t &a = expr.args_[0];
+            const expr_t &b = expr.args_[1];
+            bool folded = false;
+            if (a.type_ == expr_t::e_string && b.type_ == expr_t::e_string)
+                folded = compare(expr.str_, a.str_, b.str_, result);
+            else if (a.type_ == expr_t::e_number && b.type_ == expr_t::e_number)
+            {
+                if (is_integer(a.str_) && is_integer(b.str_))
+                    folded = compare(expr.str_, strtoll(a.str_.c_str(), NULL, 10),
+                                     strtoll(b.str_.c_str(), NULL, 10), result);
+                else
+                    folded = compare(expr.str_, strtod(a.str_.c_str(), NULL),
+                                     strtod(b.str_.c_str(), NULL), result);
+            }
+            if (folded)
+                expr = boolean(result);
+            break;
+        }
+        case expr_t::e_and:
+        case expr_t::e_or:
+        {
+            //true is neutral in `and`, false in `or`
+            bool is_and = expr.type_ == expr_t::e_and;
+            std::vector<expr_t> args;
+            for (size_t i = 0; i < expr.args_.size(); ++i)
+            {
+                const expr_t &arg = expr.args_[i];
+                if (arg.type_ != expr_t::e_number)
+                    args.push_back(arg);
+                else if (truth(arg) != is_and)
+                {
+                    expr = boolean(!is_and);
+                    return;
+                }
+            }
+            if (args.empty())
+                expr = boolean(is_and);
+            else if (args.size() == 1)
+                expr = expr_t(args[0]);
+            else
+                expr.args_.swap(args);
+            break;
+        }
+        case expr_t::e_not:
+            if (expr.args_[0].type_ == expr_t::e_number)
+                expr = boolean(!truth(expr.args_[0]));
+            break;
+        default:
+            break;
+    }
+}
+//dead branches go, a branch that is always taken replaces the if
+static void fold_constants(nodes_t &nodes)
+{
+    nodes_t result;
+    for (size_t i = 0; i < nodes.size(); ++i)
+    {
+        node_t &node = nodes[i];
+        if (node.type_ == node_t::e_emit || node.type_ == node_t::e_for)
+            fold_expr(node.expr_);
+        for (size_t j = 0; j < node.conds_.size(); ++j)
+            fold_expr(node.conds_[j]);
+        for (size_t j = 0; j < node.args_.size(); ++j)
+            fold_expr(node.args_[j]);
+
+        if (node.type_ == node_t::e_emit && node.expr_.type_ == expr_t::e_string)
+        {
+            node_t text(node_t::e_literal);
+            text.str_ = node.expr_.str_;
+            text.line_ = node.line_;
+            text.file_path_ = node.file_path_;
+            result.push_back(text);
+            continue;
+        }
+        if (node.type_ == node_t::e_if)
+        {
+            std::vector<expr_t> conds;
+            std::vector<nodes_t> bodies;
+            for (size_t j = 0; j < node.bodies_.size(); ++j)
+            {
+                bool taken = j >= node.conds_.size();
+                if (!taken && node.conds_[j].type_ == expr_t::e_number)
+                {
+                    if (!truth(node.conds_[j]))
+                        continue;
+                    taken = true;
+                }
+                else if (!taken)
+                    conds.push_back(node.conds_[j]);
+                bodies.push_back(node.bodies_[j]);
+                if (taken)
+                    break;
+            }
+            if (bodies.empty())
+                continue;
+            if (conds.empty())
+            {
+                fold_constants(bodies[0]);
+                result.insert(result.end(), bodies[0].begin(), bodies[0].end());
+                continue;
+            }
+            node.conds_.swap(conds);
+            node.bodies_.swap(bodies);
+        }
+        for (size_t j = 0; j < node.bodies_.size(); ++j)
+            fold_constants(node.bodies_[j]);
+        result.push_back(node);
+    }
+    nodes.swap(result);
+}
+//if/elif chains comparing one subject to constants, a switch in C++
+static bool is_integer_type(const expr_t &expr)
+{
+    if (expr.type_ == expr_t::e_call)
+        return expr.str_ == "length";
+    const char *types[] = {"short", "int", "long", "long long", "unsigned short",
+                           "unsigned int", "unsigned long", "unsigned long long",
+                           "size_t"};
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); ++i)
+    {
+        if (expr.type_str_ == types[i])
+            return true;
+    }
+    return false;
+}
+static bool is_unsigned_type(const expr_t &expr)
+{
+    return expr.type_ == expr_t::e_call ||
+           expr.type_str_.find("unsigned") == 0 || expr.type_str_ == "size_t";
+}
+static bool is_string_type(const expr_t &expr)
+{
+    if (expr.type_ == expr_t::e_call)
+        return expr.str_ != "length";
+    return expr.type_ == expr_t::e_variable && expr.type_str_ == "std::string";
+}
+//`a == 1` or `a == 1 or a == 2 ...`
+static bool case_labels(const expr_t &cond, std::string &key, expr_t &subject,
+                        std::vector<expr_t> &labels)
+{
+    if (cond.type_ == expr_t::e_or)
+    {
+        for (size_t i = 0; i < cond.args_.size(); ++i)
+        {
+            if (!case_labels(cond.args_[i], key, subject, labels))
+                return false;
+        }
+        return true;
+    }
+    if (cond.type_ != expr_t::e_compare || cond.str_ != "==")
+        return false;
+    const expr_t *a = &cond.args_[0];
+    const expr_t *b = &cond.args_[1];
+    if (a->type_ == expr_t::e_string || a->type_ == expr_t::e_number)
+        std::swap(a, b);
+    if (b->type_ != expr_t::e_string && b->type_ != expr_t::e_number)
+        return false;
+    if (a->type_ != expr_t::e_variable && a->type_ != expr_t::e_call)
+        return false;
+    std::string dump = dump_expr(*a);
+    if (key.empty())
+    {
+        key = dump;
+        subject = *a;
+    }
+    else if (key != dump)
+        return false;
+
+    if (b->type_ == expr_t::e_number)
+    {
+        if (!is_integer_type(*a) || !is_integer(b->str_) ||
+            (b->str_[0] == '-' && is_unsigned_type(*a)))
+            return false;
+    }
+    else if (!is_string_type(*a))
+        return false;
+    labels.push_back(*b);
+    return true;
+}
+static void switch_dispatch(nodes_t &nodes)
+{
+    for (size_t i = 0; i < nodes.size(); ++i)
+    {
+        node_t &node = nodes[i];
+        for (size_t j = 0; j < node.bodies_.size(); ++j)
+            switch_dispatch(node.bodies_[j]);
+        //two compares are as cheap as a switch
+        if (node.type_ != node_t::e_if || node.conds_.size() < 3)
+            continue;
+
+        std::string key;
+        expr_t subject;
+        std::vector<expr_t> conds;
+        std::vector<nodes_t> bodies;
+        std::set<std::string> seen;
+        bool ok = true;
+        for (size_t j = 0; j < node.conds_.size() && ok; ++j)
+        {
+            std::vector<expr_t> labels;
+            ok = case_labels(node.conds_[j], key, subject, labels);
+            //a constant seen before never matches here
+            expr_t group(expr_t::e_or, "||");
+            for (size_t k = 0; ok && k < labels.size(); ++k)
+            {
+                if (seen.insert(dump_expr(labels[k])).second)
+                    group.args_.push_back(labels[k]);
+            }
+            if (!group.args_.empty())
+            {
+                conds.push_back(group);
+                bodies.push_back(node.bodies_[j]);
+            }
+        }
+        //strings and numbers don't mix
+        for (size_t j = 1; ok && j < conds.size(); ++j)
+            ok = conds[j].args_[0].type_ == conds[0].args_[0].type_;
+        if (!ok || conds.empty())
+            continue;
+        if (node.bodies_.size() > node.conds_.size())
+            bodies.push_back(node.bodies_.back());
+
+        node.type_ = node_t::e_switch;
+        node.expr_ = subject;
+        node.conds_.swap(conds);
+        node.bodies_.swap(bodies);
+    }
+}
+//one append for a run of static text
+static void merge_literals(nodes_t &nodes)
+{
+    nodes_t result;
+    for (size_t i = 0; i < nodes.size(); ++i)
+    {
+        node_t &node = nodes[i];
+        for (size_t j = 0; j < node.bodies_.size(); ++j)
+            merge_literals(node.bodies_[j]);
+        if (node.type_ == node_t::e_literal)
+        {
+            if (node.str_.empty())
+                continue;
+            if (!result.empty() && result.back().type_ == node_t::e_literal)
+            {
+                result.back().str_ += node.str_;
+                continue;
+            }
+        }
+        result.push_back(node);
+    }
+    nodes.swap(result);
+}
+
+// filters and a.b.c paths computed more than once, or in a loop that
+// doesn't bind their variables, are bound once with an e_let: before the
+// outermost such loop, else in the innermost body holding every use.
+// macro, include and cold bodies stay self contained, they become
+// functions.
+struct value_t
+{
+    value_t()
+        :weight_(0),
+         first_(0)
+    {
+
+    }
+    expr_t expr_;
+    std::vector<int> loops_;
+    int weight_;
+    size_t first_;
+    std::vector<expr_t *> uses_;
+};
+typedef std::map<std::string, value_t> values_t;
+
+struct let_t
+{
+    nodes_t *nodes_;
+    size_t at_;
+    node_t node_;
+};
+
+struct hoist_t
+{
+    hoist_t()
+        :loops_count_(0),
+         lets_(0)
+    {
+
+    }
+    //loop variables and the loop binding them, innermost last
+    std::vector<std::pair<std::string, int> > scope_;
+    std::vector<int> loops_;
+    int loops_count_;
+    int lets_;
+    //inner bodies first, inserting moves the nodes of the outer ones
+    std::vector<let_t> inserts_;
+};
+
+static bool is_value(const expr_t &expr)
+{
+    return expr.type_ == expr_t::e_call ||
+           (expr.type_ == expr_t::e_variable &&
+            expr.str_.find('.') != std::string::npos);
+}
+static void bound_by(const hoist_t &h, const expr_t &expr, std::vector<int> &loops)
+{
+    if (expr.type_ == expr_t::e_variable)
+    {
+        std::string name = expr.str_.substr(0, expr.str_.find('.'));
+        for (size_t i = h.scope_.size(); i > 0; --i)
+        {
+            if (h.scope_[i - 1].first == name)
+            {
+                loops.push_back(h.scope_[i - 1].second);
+                break;
+            }
+        }
+        return;
+    }
+    for (size_t i = 0; i < expr.args_.size(); ++i)
+        bound_by(h, expr.args_[i], loops);
+}
+static bool depends(const value_t &value, int loop)
+{
+    for (size_t i = 0; i < value.loops_.size(); ++i)
+    {
+        if (value.loops_[i] == loop)
+            return true;
+    }
+    return false;
+}
+static void find_values(hoist_t &h, expr_t &expr, size_t at, values_t &values)
+{
+    if (!is_value(expr))
+    {
+        for (size_t i = 0; i < expr.args_.size(); ++i)
+            find_values(h, expr.args_[i], at, values);
+        return;
+    }
+    std::vector<int> loops;
+    bound_by(h, expr, loops);
+    std::string key = dump_expr(expr);
+    for (size_t i = 0; i < loops.size(); ++i)
+    {
+        char buffer[32];
+        sprintf(buffer, "@%d", loops[i]);
+        key += buffer;
+    }
+    value_t &value = values[key];
+    if (value.uses_.empty())
+    {
+        value.expr_ = expr;
+        value.loops_ = loops;
+        value.first_ = at;
+    }
+    value.weight_ += 1;
+    value.uses_.push_back(&expr);
+}
+static std::string value_type(const expr_t &expr)
+{
+    if (expr.type_ == expr_t::e_variable)
+        return expr.type_str_;
+    return expr.str_ == "length" ? "size_t" : "std::string";
+}
+static values_t hoist(hoist_t &h, nodes_t &nodes);
+static void hoist_root(hoist_t &h, nodes_t &nodes)
+{
+    std::vector<std::pair<std::string, int> > scope;
+    std::vector<int> loops;
+    int lets = h.lets_;
+    scope.swap(h.scope_);
+    loops.swap(h.loops_);
+    h.lets_ = 0;
+    hoist(h, nodes);
+    h.scope_.swap(scope);
+    h.loops_.swap(loops);
+    h.lets_ = lets;
+}
+static values_t hoist(hoist_t &h, nodes_t &nodes)
+{
+    values_t values;
+    for (size_t i = 0; i < nodes.size(); ++i)
+    {
+        node_t &node = nodes[i];
+        if (node.type_ == node_t::e_macro || node.type_ == node_t::e_include ||
+            node.type_ == node_t::e_cold)
+        {
+            hoist_root(h, node.bodies_[0]);
+            continue;
+        }
+        if (node.type_ == node_t::e_emit || node.type_ == node_t::e_for ||
+            node.type_ == node_t::e_switch)
+            find_values(h, node.expr_, i, values);
+        for (size_t j = 0; j < node.conds_.size() && node.type_ == node_t::e_if; ++j)
+            find_values(h, node.conds_[j], i, values);
+        for (size_t j = 0; j < node.args_.size(); ++j)
+            find_values(h, node.args_[j], i, values);
+
+        for (size_t j = 0; j < node.bodies_.size(); ++j)
+        {
+            bool loop = node.type_ == node_t::e_for && j == 0;
+            int id = 0;
+            if (loop)
+            {
+                id = ++h.loops_count_;
+                h.scope_.push_back(std::make_pair(node.value_, id));
+                if (node.loop_ == node_t::e_loop_map)
+                    h.scope_.push_back(std::make_pair(node.key_, id));
+                h.loops_.push_back(id);
+            }
+            values_t inner = hoist(h, node.bodies_[j]);
+            if (loop)
+            {
+                h.scope_.resize(h.scope_.size() -
+                                (node.loop_ == node_t::e_loop_map ? 2 : 1));
+                h.loops_.pop_back();
+            }
+            for (values_t::iterator it = inner.begin(); it != inner.end(); ++it)
+            {
+                //out of scope here
+                if (loop && depends(it->second, id))
+                    continue;
+                value_t &value = values[it->first];
+                if (value.uses_.empty())
+                {
+                    value.expr_ = it->second.expr_;
+                    value.loops_ = it->second.loops_;
+                    value.first_ = i;
+                }
+                //a loop body runs many times
+                value.weight_ += loop ? 2 : it->second.weight_;
+                value.uses_.insert(value.uses_.end(), it->second.uses_.begin(),
+                                   it->second.uses_.end());
+            }
+        }
+    }
+
+    int loop = h.loops_.empty() ? 0 : h.loops_.back();
+    std::vector<let_t> lets;
+    values_t::iterator it = values.begin();
+    while (it != values.end())
+    {
+        value_t &value = it->second;
+        //invariant in the enclosing loop, bind it outside
+        if ((loop && !depends(value, loop)) || value.weight_ < 2)
+        {
+            ++it;
+            continue;
+        }
+        char buffer[32];
+        sprintf(buffer, "lm_v%d", ++h.lets_);
+        let_t let;
+        let.nodes_ = &nodes;
+        let.at_ = value.first_;
+        let.node_ = node_t(node_t::e_let);
+        let.node_.value_ = buffer;
+        let.node_.value_type_ = value_type(value.expr_);
+        let.node_.expr_ = value.expr_;
+
+        expr_t ref(expr_t::e_variable, buffer);
+        ref.type_str_ = let.node_.value_type_;
+        ref.types_.push_back(ref.type_str_);
+        for (size_t i = 0; i < value.uses_.size(); ++i)
+            *value.uses_[i] = ref;
+
+        //later positions first, so the earlier ones stay valid
+        size_t k = lets.size();
+        while (k > 0 && lets[k - 1].at_ <= let.at_)
+            --k;
+        lets.insert(lets.begin() + k, let);
+        values.erase(it++);
+    }
+    h.inserts_.insert(h.inserts_.end(), lets.begin(), lets.end());
+    return values;
+}
+static void hoist_expressions(nodes_t &nodes)
+{
+    hoist_t h;
+    hoist_root(h, nodes);
+    for (size_t i = 0; i < h.inserts_.size(); ++i)
+    {
+        let_t &let = h.inserts_[i];
+        let.nodes_->insert(let.nodes_->begin() + let.at_, let.node_);
+    }
+}
+
+pass_manager::pass_manager()
+{
+    add("flatten-blocks", flatten_blocks);
+    add("fold-constants", fold_constants);
+    add("switch-dispatch", switch_dispatch);
+    add("merge-literals", merge_literals);
+    add("hoist-expressions", hoist_expressions);
+}
+void pass_manager::add(const char *name, void (*run)(nodes_t &nodes))
+{
+    pass_t pass;
+    pass.name_ = name;
+    pass.run_ = run;
+    passes_.push_back(pass);
+}
+void pass_manager::run(nodes_t &nodes, std::string *dump) const
+{
+    for (size_t i = 0; i < passes_.size(); ++i)
+    {
+        passes_[i].run_(nodes);
+        if (dump)
+            *dump += br + "; " + passes_[i].name_ + br + dump_ir(nodes);
+    }
+}
+
+static void number_sites(nodes_t &nodes, size_t &count)
+{
+    for (size_t i = 0; i < nodes.size(); ++i)
+    {
+        node_t &node = nodes[i];
+        if (node.type_ == node_t::e_if || node.type_ == node_t::e_switch ||
+            node.type_ == node_t::e_for)
+        {
+            node.site_ = (int)count;
+            count += 1 + node.bodies_.size();
+        }
+        for (size_t j = 0; j < node.bodies_.size(); ++j)
+            number_sites(node.bodies_[j], count);
+    }
+}
+size_t number_sites(nodes_t &nodes)
+{
+    size_t count = 0;
+    number_sites(nodes, count);
+    return count;
+}
+static size_t count_nodes(const nodes_t &nodes)
+{
+    size_t count = nodes.size();
+    for (size_t i = 0; i < nodes.size(); ++i)
+    {
+        for (size_t j = 0; j < nodes[i].bodies_.size(); ++j)
+            count += count_nodes(nodes[i].bodies_[j]);
+    }
+    return count;
+}
+struct more_taken
+{
+    more_taken(const std::vector<unsigned long long> &counts)
+        :counts_(counts)
+    {
+
+    }
+    bool operator()(size_t a, size_t b) const
+    {
+        return counts_[a + 1] > counts_[b + 1];
+    }
+    const std::vector<unsigned long long> &counts_;
+};
+void apply_profile(nodes_t &nodes, const std::vector<unsigned long long> &counts,
+                   size_t min_nodes)
+{
+    for (size_t i = 0; i < nodes.size(); ++i)
+    {
+        node_t &node = nodes[i];
+        for (size_t j = 0; j < node.bodies_.size(); ++j)
+            apply_profile(node.bodies_[j], counts, min_nodes);
+        size_t size = 1 + node.bodies_.size();
+        if (node.site_ < 0 || node.site_ + size > counts.size())
+            continue;
+        std::vector<unsigned long long>::const_iterator first;
+        first = counts.begin() + node.site_;
+        node.counts_.assign(first, first + size);
+
+        //the cases match one constant each, their order is free
+        if (node.type_ == node_t::e_switch)
+        {
+            std::vector<size_t> order;
+            for (size_t j = 0; j < node.conds_.size(); ++j)
+                order.push_back(j);
+            std::stable_sort(order.begin(), order.end(), more_taken(node.counts_));
+            std::vector<expr_t> conds;
+            std::vector<nodes_t> bodies;
+            std::vector<unsigned long long> taken(1, node.counts_[0]);
+            for (size_t j = 0; j < order.size(); ++j)
+            {
+                conds.push_back(node.conds_[order[j]]);
+                bodies.push_back(node.bodies_[order[j]]);
+                taken.push_back(node.counts_[order[j] + 1]);
+            }
+            for (size_t j = order.size(); j < node.bodies_.size(); ++j)
+            {
+                bodies.push_back(node.bodies_[j]);
+                taken.push_back(node.counts_[j + 1]);
+            }
+            node.conds_.swap(conds);
+            node.bodies_.swap(bodies);
+            node.counts_.swap(taken);
+        }
+
+        unsigned long long reached = node.counts_[0];
+        for (size_t j = 0; j < node.bodies_.size(); ++j)
+        {
+            nodes_t &body = node.bodies_[j];
+            if (!reached || node.counts_[j + 1] * 100 >= reached ||
+                count_nodes(body) <= min_nodes ||
+                (body.size() == 1 && body[0].type_ == node_t::e_cold))
+                continue;
+            node_t cold(node_t::e_cold);
+            cold.line_ = node.line_;
+            cold.file_path_ = node.file_path_;
+            cold.bodies_.push_back(nodes_t());
+            cold.bodies_[0].swap(body);
+            body.push_back(cold);
+        }
+    }
+}
+
+static bool binds(const node_t &node, size_t body, const std::string &name)
+{
+    return node.type_ == node_t::e_for && body == 0 &&
+           (node.value_ == name ||
+            (node.loop_ == node_t::e_loop_map && node.key_ == name));
+}
+static void replace(expr_t &expr, const std::string &name, const expr_t &value)
+{
+    if (expr.type_ == expr_t::e_variable && expr.str_ == name)
+    {
+        expr = value;
+        return;
+    }
+    for (size_t i = 0; i < expr.args_.size(); ++i)
+        replace(expr.args_[i], name, value);
+}
+void bind_constant(nodes_t &nodes, const std::string &name, const expr_t &value)
+{
+    for (size_t i = 0; i < nodes.size(); ++i)
+    {
+        node_t &node = nodes[i];
+        //macros see their parameters only
+        if (node.type_ == node_t::e_macro)
+            continue;
+        replace(node.expr_, name, value);
+        for (size_t j = 0; j < node.conds_.size(); ++j)
+            replace(node.conds_[j], name, value);
+        for (size_t j = 0; j < node.args_.size(); ++j)
+            replace(node.args_[j], name, value);
+        for (size_t j = 0; j < node.bodies_.size(); ++j)
+        {
+            if (!binds(node, j, name))
+                bind_constant(node.bodies_[j], name, value);
+        }
+    }
+}
+static void replace(expr_t &expr, const std::string &name,
+                    const std::vector<std::string> &items)
+{
+    bool list = !expr.args_.empty() &&
+                expr.args_[0].type_ == expr_t::e_variable &&
+                expr.args_[0].str_ == name;
+    if (list && expr.type_ == expr_t::e_call && expr.str_ == "length")
+    {
+        expr = expr_t(expr_t::e_number, lm::$to_string(items.size()));
+        return;
+    }
+    if (list && expr.type_ == expr_t::e_test)
+    {
+        expr = boolean(!items.empty());
+        return;
+    }
+    if (expr.type_ == expr_t::e_variable && expr.str_ == name)
+        throw std::runtime_error(name + " is a constant list, only loops, "
+                                 "length and tests may use it");
+    for (size_t i = 0; i < expr.args_.size(); ++i)
+        replace(expr.args_[i], name, items);
+}
+void bind_constant(nodes_t &nodes, const std::string &name,
+                   const std::vector<std::string> &items)
+{
+    nodes_t result;
+    for (size_t i = 0; i < nodes.size(); ++i)
+    {
+        node_t &node = nodes[i];
+        if (node.type_ == node_t::e_macro)
+        {
+            result.push_back(node);
+            continue;
+        }
+        //unrolled, a copy of the body per item
+        if (node.type_ == node_t::e_for &&
+            node.expr_.type_ == expr_t::e_variable && node.expr_.str_ == name)
+        {
+            for (size_t k = 0; k < items.size(); ++k)
+            {
+                nodes_t body = node.bodies_[0];
+                bind_constant(body, node.value_, expr_t(expr_t::e_string, items[k]));
+                if (node.value_ != name)
+                    bind_constant(body, name, items);
+                result.insert(result.end(), body.begin(), body.end());
+            }
+            if (items.empty() && node.bodies_.size() > 1)
+            {
+                nodes_t body = node.bodies_[1];
+                bind_constant(body, name, items);
+                result.insert(result.end(), body.begin(), body.end());
+            }
+            continue;
+        }
+        replace(node.expr_, name, items);
+        for (size_t j = 0; j < node.conds_.size(); ++j)
+            replace(node.conds_[j], name, items);
+        for (size_t j = 0; j < node.args_.size(); ++j)
+            replace(node.args_[j], name, items);
+        for (size_t j = 0; j < node.bodies_.size(); ++j)
+        {
+            if (!binds(node, j, name))
+                bind_constant(node.bodies_[j], name, items);
+        }
+        result.push_back(node);
+    }
+    nodes.swap(result);
+}
+
+// a run of whitespace becomes a space, or nothing between two tags and
+// at the ends of the output. next to {% if %} or {% for %} a run is
+// decided by every text that can come before and after it, {{ }} can be
+// anything. pre, textarea, script and style keep their text, in template
+// order.
+typedef std::set<char> chars_t;
+//what is next to a text: '\0' for the end of the output, '?' a value
+struct edge_t
+{
+    //the nearest char that is not whitespace
+    chars_t solid_;
+    //the char right there, whitespace as ' '
+    chars_t raw_;
+
+    bool operator!=(const edge_t &other) const
+    {
+        return solid_ != other.solid_ || raw_ != other.raw_;
+    }
+    void merge(const edge_t &other)
+    {
+        solid_.insert(other.solid_.begin(), other.solid_.end());
+        raw_.insert(other.raw_.begin(), other.raw_.end());
+    }
+};
+typedef std::map<const node_t *, std::pair<edge_t, edge_t> > edges_t;
+
+static edge_t edge(char ch)
+{
+    edge_t e;
+    e.solid_.insert(ch);
+    e.raw_.insert(ch);
+    return e;
+}
+static bool is_space(char ch)
+{
+    return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r' || ch == '\f';
+}
+//the edge past str, coming from in. backward for the start of str.
+static edge_t pass_text(const std::string &str, const edge_t &in, bool backward)
+{
+    size_t size = str.size();
+    size_t i = 0;
+    while (i < size && is_space(str[backward ? i : size - 1 - i]))
+        ++i;
+    edge_t out = in;
+    out.raw_.clear();
+    out.raw_.insert(' ');
+    if (i == size)
+        return out;
+    char solid = str[backward ? i : size - 1 - i];
+    out = edge(solid);
+    if (i)
+        out.raw_ = edge(' ').raw_;
+    return out;
+}
+//the edges before each text, or after them when backward
+static edge_t find_edges(const nodes_t &nodes, edge_t in, edges_t &edges, bool backward)
+{
+    for (size_t n = 0; n < nodes.size(); ++n)
+    {
+        const node_t &node = nodes[backward ? nodes.size() - 1 - n : n];
+        if (node.type_ == node_t::e_literal)
+        {
+            (backward ? edges[&node].second : edges[&node].first) = in;
+            in = pass_text(node.str_, in, backward);
+        }
+        else if (node.type_ == node_t::e_emit || node.type_ == node_t::e_call)
+        {
+            in = edge('?');
+        }
+        else if (node.type_ == node_t::e_if || node.type_ == node_t::e_switch)
+        {
+            edge_t out;
+            for (size_t i = 0; i < node.bodies_.size(); ++i)
+                out.merge(find_edges(node.bodies_[i], in, edges, backward));
+            //no else, no default
+            if (node.bodies_.size() == node.conds_.size())
+                out.merge(in);
+            in = out;
+        }
+        else if (node.type_ == node_t::e_for)
+        {
+            //a round starts where the loop or the last round left
+            edge_t round = in;
+            edge_t out;
+            do
+            {
+                out = find_edges(node.bodies_[0], round, edges, backward);
+                edge_t next = in;
+                next.merge(out);
+                if (!(next != round))
+                    break;
+                round = next;
+            } while (true);
+            if (node.bodies_.size() > 1)
+                out.merge(find_edges(node.bodies_[1], in, edges, backward));
+            else
+                out.merge(in);
+            in = out;
+        }
+        else if (node.type_ == node_t::e_macro)
+        {
+            //a function of its own
+            find_edges(node.bodies_[0], edge('\0'), edges, backward);
+        }
+        else
+        {
+            for (size_t i = 0; i < node.bodies_.size(); ++i)
+                in = find_edges(node.bodies_[i], in, edges, backward);
+        }
+    }
+    return in;
+}
+static bool only(const chars_t &chars, char a, char b)
+{
+    for (chars_t::const_iterator it = chars.begin(); it != chars.end(); ++it)
+    {
+        if (*it != a && *it != b)
+            return false;
+    }
+    return true;
+}
+//the element at str[i], "<pre ..." and the like, kept as written
+static std::string raw_element(const std::string &str, size_t i)
+{
+    static const char *names[] = {"pre", "textarea", "script", "style"};
+    for (size_t k = 0; k < sizeof(names) / sizeof(names[0]); ++k)
+    {
+        std::string name = names[k];
+        size_t j = 0;
+        while (j < name.size() && i + j < str.size() &&
+               tolower((unsigned char)str[i + j]) == name[j])
+            ++j;
+        if (j < name.size())
+            continue;
+        if (i + j == str.size() || is_space(str[i + j]) ||
+            str[i + j] == '>' || str[i + j] == '/')
+            return name;
+    }
+    return std::string();
+}
+static size_t find_close(const std::string &str, size_t from, const std::string &name)
+{
+    for (size_t i = from; i + 1 < str.size(); ++i)
+    {
+        if (str[i] == '<' && str[i + 1] == '/' && raw_element(str, i + 2) == name)
+            return i;
+    }
+    return std::string::npos;
+}
+static void minify_text(std::string &str, const edge_t &prev, const edge_t &next,
+                        std::string &raw)
+{
+    std::string out;
+    size_t i = 0;
+    while (i < str.size())
+    {
+        if (!raw.empty())
+        {
+            size_t end = find_close(str, i, raw);
+            if (end == std::string::npos)
+                end = str.size();
+            else
+                raw.clear();
+            out.append(str, i, end - i);
+            i = end;
+            continue;
+        }
+        if (!is_space(str[i]))
+        {
+            if (str[i] == '<')
+                raw = raw_element(str, i + 1);
+            out += str[i++];
+            continue;
+        }
+        size_t j = i;
+        while (j < str.size() && is_space(str[j]))
+            ++j;
+        chars_t before = i ? edge(str[i - 1]).solid_ : prev.solid_;
+        chars_t after = j < str.size() ? edge(str[j]).solid_ : next.solid_;
+        bool end = only(before, '\0', '\0') || only(after, '\0', '\0');
+        bool tags = only(before, '>', '\0') && only(after, '<', '\0');
+        //the text before ends with a space already
+        bool spaced = !i && only(prev.raw_, ' ', ' ');
+        if (!end && !tags && !spaced)
+            out += ' ';
+        i = j;
+    }
+    str.swap(out);
+}
+static void minify_nodes(nodes_t &nodes, const edges_t &edges, std::string &raw)
+{
+    for (size_t i = 0; i < nodes.size(); ++i)
+    {
+        node_t &node = nodes[i];
+        if (node.type_ == node_t::e_literal)
+        {
+            edges_t::const_iterator it = edges.find(&node);
+            minify_text(node.str_, it->second.first, it->second.second, raw);
+        }
+        else if (node.type_ == node_t::e_macro)
+        {
+            std::string own;
+            minify_nodes(node.bodies_[0], edges, own);
+        }
+        else
+        {
+            for (size_t j = 0; j < node.bodies_.size(); ++j)
+                minify_nodes(node.bodies_[j], edges, raw);
+        }
+    }
+}
+void minify_html(nodes_t &nodes)
+{
+    //a run of whitespace in one literal
+    merge_literals(nodes);
+    edges_t edges;
+    find_edges(nodes, edge('\0'), edges, false);
+    find_edges(nodes, edge('\0'), edges, true);
+    std::string raw;
+    minify_nodes(nodes, edges, raw);
+    merge_literals(nodes);
+}
+
+// {% trans %} and {% blocktrans %}. a message is the text of the tag,
+// a {{ }} in it is %(a.b)s, the path of its variable, like gettext's
+// python-format. translations are text and the same placeholders in any
+// order. their text is escaped like a {{ }} where it lands.
+static const expr_t *placeholder_variable(const expr_t &expr)
+{
+    if (expr.type_ == expr_t::e_variable)
+        return &expr;
+    for (size_t i = 0; i < expr.args_.size(); ++i)
+    {
+        const expr_t *var = placeholder_variable(expr.args_[i]);
+        if (var)
+            return var;
+    }
+    return NULL;
+}
+static std::string placeholder(const node_t &node)
+{
+    const expr_t *var = placeholder_variable(node.expr_);
+    if (!var)
+        throw std::runtime_error("a {{ }} in blocktrans needs a variable");
+    return "%(" + var->str_ + ")s";
+}
+std::string trans_message(const nodes_t &body)
+{
+    std::string message;
+    for (size_t i = 0; i < body.size(); ++i)
+    {
+        if (body[i].type_ == node_t::e_literal)
+            message += body[i].str_;
+        else if (body[i].type_ == node_t::e_emit)
+            message += placeholder(body[i]);
+        else
+            throw std::runtime_error("only text and {{ }} in blocktrans");
+    }
+    return message;
+}
+//{{ "text" }}, escape_contexts picks the escaper
+static void push_text(const node_t &node, const std::string &text, nodes_t &result)
+{
+    result.push_back(node_t(node_t::e_emit));
+    node_t &emit = result.back();
+    emit.expr_ = expr_t(expr_t::e_call, "escape");
+    emit.expr_.args_.push_back(expr_t(expr_t::e_string, text));
+    emit.file_path_ = node.file_path_;
+    emit.line_ = node.line_;
+}
+//the translation as text and the {{ }} of the source
+static bool translate(const node_t &node, const std::string &str, nodes_t &result)
+{
+    const nodes_t &body = node.bodies_[0];
+    std::string text;
+    size_t pos = 0;
+    while (pos < str.size())
+    {
+        size_t begin = str.find("%(", pos);
+        size_t end = begin == std::string::npos ? begin : str.find(")s", begin);
+        if (end == std::string::npos)
+        {
+            text += str.substr(pos);
+            break;
+        }
+        text += str.substr(pos, begin - pos);
+        std::string name = str.substr(begin, end + 2 - begin);
+        const node_t *value = NULL;
+        for (size_t i = 0; i < body.size() && !value; ++i)
+        {
+            if (body[i].type_ == node_t::e_emit && placeholder(body[i]) == name)
+                value = &body[i];
+        }
+        if (!value)
+            return false;
+        if (!text.empty())
+            push_text(node, text, result);
+        text.clear();
+        result.push_back(*value);
+        pos = end + 2;
+    }
+    if (!text.empty())
+        push_text(node, text, result);
+    return true;
+}
+size_t translate(nodes_t &nodes, const std::map<std::string, std::string> &messages)
+{
+    size_t count = 0;
+    nodes_t result;
+    for (size_t i = 0; i < nodes.size(); ++i)
+    {
+        node_t &node = nodes[i];
+        for (size_t j = 0; j < node.bodies_.size(); ++j)
+            count += translate(node.bodies_[j], messages);
+        if (node.type_ != node_t::e_trans)
+        {
+            result.push_back(node);
+            continue;
+        }
+        std::map<std::string, std::string>::const_iterator it;
+        it = messages.find(node.str_);
+        if (it != messages.end() && translate(node, it->second, result))
+        {
+            count++;
+            continue;
+        }
+        if (it != messages.end())
+            throw std::runtime_error("the translation of " + quote(node.str_) +
+                                     " has a placeholder the message doesn't");
+        result.insert(result.end(), node.bodies_[0].begin(), node.bodies_[0].end());
+    }
+    nodes.swap(result);
+    return count;
+}
+
+// the html context of each {{ }} decides its escaper, see
+// lemon_escape.hpp. the text before a value is read like a browser
+// would: tags, attributes and their quotes, comments, and in <script>,
+// <style> and event handler and style attributes the strings and
+// comments of the code. where branches or loop rounds end in different
+// contexts, the context is unknown from there on and values get the
+// $escape of before.
+struct context_t
+{
+    typedef enum state_t
+    {
+        c_text,
+        c_lt,              // after <
+        c_markup,          // <! or <?, dashes_ of <!--
+        c_comment,         // dashes_ of -->
+        c_tag_name,
+        c_tag,
+        c_attr_name,
+        c_after_name,
+        c_before_value,    // after =
+        c_value,           // quote_, 0 for an unquoted one
+        c_raw,             // tag_ is script or style, match_ chars of its </tag
+        c_unknown
+    } state_t;
+    //code_ of script, style and the values of on* and style attributes
+    typedef enum code_t
+    {
+        k_code,
+        k_line_comment,
+        k_block_comment,
+        k_string           // quote_ is the quote of the string
+    } code_t;
+
+    context_t()
+        :state_(c_text),
+         closing_(false),
+         quote_(0),
+         query_(false),
+         scheme_(false),
+         dashes_(0),
+         match_(0),
+         code_(k_code),
+         string_quote_(0),
+         after_(0)
+    {
+    }
+    bool operator!=(const context_t &other) const
+    {
+        return state_ != other.state_ || tag_ != other.tag_ ||
+               closing_ != other.closing_ || attr_ != other.attr_ ||
+               quote_ != other.quote_ || query_ != other.query_ ||
+               scheme_ != other.scheme_ ||
+               dashes_ != other.dashes_ || match_ != other.match_ ||
+               code_ != other.code_ || string_quote_ != other.string_quote_ ||
+               after_ != other.after_;
+    }
+
+    state_t state_;
+    std::string tag_;
+    bool closing_;
+    std::string attr_;
+    char quote_;
+    //a url value past its ? or #, and one before a : / ? or #, where
+    //a value could start a javascript: url
+    bool query_;
+    bool scheme_;
+    int dashes_;
+    size_t match_;
+    code_t code_;
+    char string_quote_;
+    //a / or * starting or ending a comment, a \ in a string
+    char after_;
+};
+//where a value goes: its escaper, and the quotes it is put in
+struct escaping_t
+{
+    lm::escape_t kind_;
+    std::string quote_;
+};
+typedef std::map<const node_t *, escaping_t> escapings_t;
+
+static bool is_tag_space(char ch)
+{
+    return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r' || ch == '\f';
+}
+static bool is_url_attr(const std::string &name)
+{
+    static const char *names[] =
+    {
+        "href", "src", "action", "formaction", "cite", "poster", "background",
+        "longdesc", "usemap", "codebase", "data", "manifest", "icon", "srcset",
+        "xlink:href"
+    };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i)
+    {
+        if (name == names[i])
+            return true;
+    }
+    return false;
+}
+static bool is_js_attr(const std::string &name)
+{
+    return name.size() > 2 && name[0] == 'o' && name[1] == 'n';
+}
+//a char of javascript, or of css
+static void scan_code(context_t &c, char ch, bool js)
+{
+    char after = c.after_;
+    c.after_ = 0;
+    switch (c.code_)
+    {
+        case context_t::k_code:
+            if (after == '/' && (ch == '*' || (ch == '/' && js)))
+                c.code_ = ch == '*' ? context_t::k_block_comment : context_t::k_line_comment;
+            else if (ch == '"' || ch == '\'' || (ch == '`' && js))
+            {
+                c.code_ = context_t::k_string;
+                c.string_quote_ = ch;
+            }
+            else if (ch == '/')
+                c.after_ = ch;
+            break;
+        case context_t::k_line_comment:
+            if (ch == '\n')
+                c.code_ = context_t::k_code;
+            break;
+        case context_t::k_block_comment:
+            if (after == '*' && ch == '/')
+                c.code_ = context_t::k_code;
+            else if (ch == '*')
+                c.after_ = ch;
+            break;
+        case context_t::k_string:
+            if (after == '\\')
+                break;
+            if (ch == '\\')
+                c.after_ = ch;
+            else if (ch == c.string_quote_ || (ch == '\n' && c.string_quote_ != '`'))
+            {
+                c.code_ = context_t::k_code;
+                c.string_quote_ = 0;
+            }
+            break;
+    }
+}
+static void start_code(context_t &c)
+{
+    c.code_ = context_t::k_code;
+    c.string_quote_ = 0;
+    c.after_ = 0;
+}
+static void end_tag(context_t &c)
+{
+    if (!c.closing_ && (c.tag_ == "script" || c.tag_ == "style"))
+    {
+        c.state_ = context_t::c_raw;
+        c.match_ = 0;
+        start_code(c);
+        return;
+    }
+    c.state_ = context_t::c_text;
+    c.tag_.clear();
+    c.closing_ = false;
+}
+static void start_value(context_t &c, char quote)
+{
+    c.state_ = context_t::c_value;
+    c.quote_ = quote;
+    c.query_ = false;
+    c.scheme_ = true;
+    start_code(c);
+}
+static void end_value(context_t &c)
+{
+    c.state_ = context_t::c_tag;
+    c.attr_.clear();
+    c.quote_ = 0;
+    c.query_ = false;
+    c.scheme_ = false;
+    start_code(c);
+}
+static void value_char(context_t &c, char ch)
+{
+    if (is_url_attr(c.attr_))
+    {
+        c.query_ = c.query_ || ch == '?' || ch == '#';
+        c.scheme_ = c.scheme_ && ch != ':' && ch != '/' && !c.query_;
+    }
+    else if (is_js_attr(c.attr_) || c.attr_ == "style")
+        scan_code(c, ch, c.attr_ != "style");
+}
+static void scan_char(context_t &c, char ch)
+{
+    char lower = (char)tolower((unsigned char)ch);
+    switch (c.state_)
+    {
+        case context_t::c_text:
+            if (ch == '<')
+                c.state_ = context_t::c_lt;
+            break;
+        case context_t::c_lt:
+            c.dashes_ = 0;
+            if (ch == '/' || isalpha((unsigned char)ch))
+            {
+                c.state_ = context_t::c_tag_name;
+                c.closing_ = ch == '/';
+                c.tag_ = ch == '/' ? "" : std::string(1, lower);
+            }
+            else if (ch == '!' || ch == '?')
+            {
+                c.state_ = context_t::c_markup;
+                c.dashes_ = ch == '!' ? 0 : 3;
+            }
+            else
+            {
+                c.state_ = context_t::c_text;
+                scan_char(c, ch);
+            }
+            break;
+        case context_t::c_markup:
+            if (ch == '-' && ++c.dashes_ == 2)
+            {
+                c.state_ = context_t::c_comment;
+                c.dashes_ = 0;
+            }
+            else if (ch == '>')
+            {
+                c.state_ = context_t::c_text;
+                c.dashes_ = 0;
+            }
+            else if (ch != '-')
+                c.dashes_ = 3;
+            break;
+        case context_t::c_comment:
+            if (ch == '>' && c.dashes_ >= 2)
+                c.state_ = context_t::c_text;
+            c.dashes_ = ch == '-' ? c.dashes_ + 1 : 0;
+            break;
+        case context_t::c_tag_name:
+            if (is_tag_space(ch) || ch == '/')
+                c.state_ = context_t::c_tag;
+            else if (ch == '>')
+                end_tag(c);
+            else
+                c.tag_ += lower;
+            break;
+        case context_t::c_tag:
+            if (ch == '>')
+                end_tag(c);
+            else if (!is_tag_space(ch) && ch != '/')
+            {
+                c.state_ = context_t::c_attr_name;
+                c.attr_ = lower;
+            }
+            break;
+        case context_t::c_attr_name:
+        case context_t::c_after_name:
+            if (ch == '=')
+                c.state_ = context_t::c_before_value;
+            else if (ch == '>')
+                end_tag(c);
+            else if (ch == '/')
+            {
+                c.state_ = context_t::c_tag;
+                c.attr_.clear();
+            }
+            else if (is_tag_space(ch))
+                c.state_ = context_t::c_after_name;
+            else if (c.state_ == context_t::c_after_name)
+            {
+                c.state_ = context_t::c_attr_name;
+                c.attr_ = lower;
+            }
+            else
+                c.attr_ += lower;
+            break;
+        case context_t::c_before_value:
+            if (ch == '"' || ch == '\'')
+                start_value(c, ch);
+            else if (ch == '>')
+            {
+                c.attr_.clear();
+                end_tag(c);
+            }
+            else if (!is_tag_space(ch))
+            {
+                start_value(c, 0);
+                value_char(c, ch);
+            }
+            break;
+        case context_t::c_value:
+            if (c.quote_ ? ch == c.quote_ : is_tag_space(ch))
+                end_value(c);
+            else if (!c.quote_ && ch == '>')
+            {
+                end_value(c);
+                end_tag(c);
+            }
+            else
+                value_char(c, ch);
+            break;
+        case context_t::c_raw:
+        {
+            //the raw text ends at </script or </style
+            std::string close = "</" + c.tag_;
+            if (lower == close[c.match_])
+                c.match_++;
+            else
+                c.match_ = ch == '<' ? 1 : 0;
+            if (c.match_ == close.size())
+            {
+                c.state_ = context_t::c_tag_name;
+                c.closing_ = true;
+                c.match_ = 0;
+                start_code(c);
+            }
+            else
+                scan_code(c, ch, c.tag_ == "script");
+            break;
+        }
+        case context_t::c_unknown:
+            break;
+    }
+}
+static escaping_t escaping(lm::escape_t kind, const std::string &quote = "")
+{
+    escaping_t e;
+    e.kind_ = kind;
+    e.quote_ = quote;
+    return e;
+}
+//the escaping of a value there, and the context after it
+static escaping_t scan_value(context_t &c)
+{
+    switch (c.state_)
+    {
+        case context_t::c_text:
+        case context_t::c_markup:
+        case context_t::c_comment:
+            return escaping(lm::e_escape_html);
+        case context_t::c_lt:
+            c.state_ = context_t::c_tag_name;
+            c.closing_ = false;
+            c.tag_ = "?";
+            return escaping(lm::e_escape_unquoted);
+        case context_t::c_tag_name:
+            c.tag_ += "?";
+            return escaping(lm::e_escape_unquoted);
+        case context_t::c_tag:
+        case context_t::c_after_name:
+            c.state_ = context_t::c_attr_name;
+            c.attr_ = "?";
+            return escaping(lm::e_escape_unquoted);
+        case context_t::c_attr_name:
+            c.attr_ += "?";
+            return escaping(lm::e_escape_unquoted);
+        case context_t::c_before_value:
+            start_value(c, 0);
+            return scan_value(c);
+        case context_t::c_value:
+        {
+            if (is_url_attr(c.attr_))
+            {
+                if (c.query_)
+                    return escaping(lm::e_escape_query);
+                return escaping(c.scheme_ ? lm::e_escape_url : lm::e_escape_url_path);
+            }
+            bool js = is_js_attr(c.attr_);
+            //unquoted, a space would end the attribute
+            if (!c.quote_)
+                return escaping(lm::e_escape_unquoted);
+            if (c.attr_ == "style")
+                return escaping(lm::e_escape_css);
+            if (!js)
+                return escaping(lm::e_escape);
+            c.after_ = 0;
+            if (c.code_ == context_t::k_code)
+                return escaping(lm::e_escape_js, "&quot;");
+            return escaping(lm::e_escape_js);
+        }
+        case context_t::c_raw:
+            c.match_ = 0;
+            c.after_ = 0;
+            if (c.tag_ == "style")
+                return escaping(lm::e_escape_css);
+            if (c.code_ == context_t::k_code)
+                return escaping(lm::e_escape_js, "\"");
+            return escaping(lm::e_escape_js);
+        case context_t::c_unknown:
+            break;
+    }
+    return escaping(lm::e_escape);
+}
+static bool has_escape(const expr_t &expr)
+{
+    lm::escape_t kind;
+    if (expr.type_ == expr_t::e_call && lm::find_escape(expr.str_, kind))
+        return true;
+    for (size_t i = 0; i < expr.args_.size(); ++i)
+    {
+        if (has_escape(expr.args_[i]))
+            return true;
+    }
+    return false;
+}
+//tags of the same element, ready for an attribute either way
+static context_t join(const context_t &a, const context_t &b)
+{
+    if (!(a != b))
+        return a;
+    //a url with its scheme decided on one path only, a value after it
+    //is checked
+    context_t scheme = b;
+    scheme.scheme_ = a.scheme_;
+    if (a.scheme_ != b.scheme_ && !(a != scheme))
+    {
+        scheme.scheme_ = true;
+        return scheme;
+    }
+    context_t tag = a;
+    tag.state_ = context_t::c_tag;
+    tag.attr_.clear();
+    bool a_tag = a.state_ == context_t::c_tag || a.state_ == context_t::c_attr_name ||
+                 a.state_ == context_t::c_after_name;
+    bool b_tag = b.state_ == context_t::c_tag || b.state_ == context_t::c_attr_name ||
+                 b.state_ == context_t::c_after_name;
+    if (a_tag && b_tag && a.tag_ == b.tag_ && a.closing_ == b.closing_)
+        return tag;
+    context_t unknown;
+    unknown.state_ = context_t::c_unknown;
+    return unknown;
+}
+// a macro body is scanned from the context of its calls. a call not in
+// text gets a copy of the macro for its context, name__n, defined next
+// to the macro, as each include is pasted where it is.
+struct macros_t
+{
+    macros_t()
+        :copies_(0)
+    {
+    }
+    std::string origin(const std::string &name) const
+    {
+        std::map<std::string, std::string>::const_iterator it = origin_.find(name);
+        return it == origin_.end() ? name : it->second;
+    }
+    //a scan over again, the copies stay
+    void clear()
+    {
+        exit_.clear();
+        defs_.clear();
+        visible_.clear();
+        renames_.clear();
+        added_.clear();
+    }
+
+    //the context each copy is for, and the macro it copies
+    std::map<std::string, context_t> entry_;
+    std::map<std::string, std::string> origin_;
+    int copies_;
+
+    //the context after each macro, the macros defined so far and their copies
+    std::map<std::string, context_t> exit_;
+    std::map<std::string, const node_t *> defs_;
+    std::map<std::string, std::vector<std::string> > visible_;
+    //calls to rename, copies to add after their macro
+    std::map<const node_t *, std::string> renames_;
+    std::map<const node_t *, nodes_t> added_;
+};
+static context_t scan_contexts(const nodes_t &nodes, context_t in,
+                               escapings_t &escapings, macros_t &macros);
+static context_t scan_macro(const node_t &node, escapings_t &escapings, macros_t &macros)
+{
+    std::string name = macros.origin(node.str_);
+    context_t entry;
+    if (name == node.str_)
+    {
+        macros.defs_[name] = &node;
+        macros.visible_[name].clear();
+    }
+    else
+    {
+        entry = macros.entry_[node.str_];
+        std::vector<std::string> &copies = macros.visible_[name];
+        if (std::find(copies.begin(), copies.end(), node.str_) == copies.end())
+            copies.push_back(node.str_);
+    }
+    return macros.exit_[node.str_] = scan_contexts(node.bodies_[0], entry, escapings, macros);
+}
+//the context after the call
+static context_t scan_call(const node_t &node, const context_t &in, macros_t &macros)
+{
+    std::string name = macros.origin(node.str_);
+    std::string target = name;
+    if (in != context_t())
+    {
+        std::vector<std::string> &copies = macros.visible_[name];
+        target.clear();
+        for (size_t i = 0; i < copies.size() && target.empty(); ++i)
+        {
+            if (!(macros.entry_[copies[i]] != in))
+                target = copies[i];
+        }
+        std::map<std::string, const node_t *>::const_iterator def = macros.defs_.find(name);
+        if (target.empty() && def != macros.defs_.end())
+        {
+            char buffer[32];
+            sprintf(buffer, "__%d", ++macros.copies_);
+            target = name + buffer;
+            node_t copy = *def->second;
+            copy.str_ = target;
+            macros.added_[def->second].push_back(copy);
+            macros.entry_[target] = in;
+            macros.origin_[target] = name;
+            copies.push_back(target);
+        }
+    }
+    //the last round of a loop decides
+    if (!target.empty() && target != node.str_)
+        macros.renames_[&node] = target;
+    else
+        macros.renames_.erase(&node);
+    std::map<std::string, context_t>::const_iterator it = macros.exit_.find(target);
+    if (it != macros.exit_.end())
+        return it->second;
+    //a copy scanned next time
+    context_t unknown;
+    unknown.state_ = context_t::c_unknown;
+    return unknown;
+}
+static context_t scan_contexts(const nodes_t &nodes, context_t in,
+                               escapings_t &escapings, macros_t &macros)
+{
+    for (size_t n = 0; n < nodes.size(); ++n)
+    {
+        const node_t &node = nodes[n];
+        if (node.type_ == node_t::e_literal)
+        {
+            for (size_t i = 0; i < node.str_.size(); ++i)
+                scan_char(in, node.str_[i]);
+        }
+        else if (node.type_ == node_t::e_emit)
+        {
+            context_t before = in;
+            escaping_t e = scan_value(in);
+            if (has_escape(node.expr_))
+                escapings[&node] = e;
+            //a constant, like a translation, goes on as the text it becomes
+            lm::escape_t kind;
+            const expr_t &expr = node.expr_;
+            if (expr.type_ == expr_t::e_call && lm::find_escape(expr.str_, kind) &&
+                expr.args_[0].type_ == expr_t::e_string)
+            {
+                std::string text = e.quote_ + lm::escape(e.kind_, expr.args_[0].str_) + e.quote_;
+                in = before;
+                for (size_t i = 0; i < text.size(); ++i)
+                    scan_char(in, text[i]);
+            }
+        }
+        else if (node.type_ == node_t::e_if || node.type_ == node_t::e_switch)
+        {
+            context_t out = scan_contexts(node.bodies_[0], in, escapings, macros);
+            for (size_t i = 1; i < node.bodies_.size(); ++i)
+                out = join(out, scan_contexts(node.bodies_[i], in, escapings, macros));
+            //no else, no default
+            if (node.bodies_.size() == node.conds_.size())
+                out = join(out, in);
+            in = out;
+        }
+        else if (node.type_ == node_t::e_for)
+        {
+            //a round starts where the loop or the last round left
+            context_t round = in;
+            context_t out;
+            do
+            {
+                out = scan_contexts(node.bodies_[0], round, escapings, macros);
+                context_t next = join(in, out);
+                if (!(next != round))
+                    break;
+                round = next;
+            } while (true);
+            if (node.bodies_.size() > 1)
+                out = join(out, scan_contexts(node.bodies_[1], in, escapings, macros));
+            else
+                out = join(out, in);
+            in = out;
+        }
+        else if (node.type_ == node_t::e_macro)
+            scan_macro(node, escapings, macros);
+        else if (node.type_ == node_t::e_call)
+            in = scan_call(node, in, macros);
+        else
+        {
+            for (size_t i = 0; i < node.bodies_.size(); ++i)
+                in = scan_contexts(node.bodies_[i], in, escapings, macros);
+        }
+    }
+    return in;
+}
+static void set_escape(expr_t &expr, lm::escape_t kind)
+{
+    lm::escape_t old;
+    if (expr.type_ == expr_t::e_call && lm::find_escape(expr.str_, old))
+        expr.str_ = lm::escape_name(kind);
+    for (size_t i = 0; i < expr.args_.size(); ++i)
+        set_escape(expr.args_[i], kind);
+}
+static void apply_escapings(nodes_t &nodes, const escapings_t &escapings)
+{
+    nodes_t result;
+    for (size_t i = 0; i < nodes.size(); ++i)
+    {
+        node_t &node = nodes[i];
+        for (size_t j = 0; j < node.bodies_.size(); ++j)
+            apply_escapings(node.bodies_[j], escapings);
+        escapings_t::const_iterator it = escapings.find(&node);
+        if (it == escapings.end())
+        {
+            result.push_back(node);
+            continue;
+        }
+        const escaping_t &e = it->second;
+        node_t quote(node_t::e_literal);
+        quote.str_ = e.quote_;
+        if (!e.quote_.empty())
+            result.push_back(quote);
+        result.push_back(node);
+        set_escape(result.back().expr_, e.kind_);
+        if (!e.quote_.empty())
+            result.push_back(quote);
+    }
+    nodes.swap(result);
+}
+static void specialize_macros(nodes_t &nodes, const macros_t &macros)
+{
+    nodes_t result;
+    for (size_t i = 0; i < nodes.size(); ++i)
+    {
+        node_t &node = nodes[i];
+        for (size_t j = 0; j < node.bodies_.size(); ++j)
+            specialize_macros(node.bodies_[j], macros);
+        std::map<const node_t *, std::string>::const_iterator name = macros.renames_.find(&node);
+        if (name != macros.renames_.end())
+            node.str_ = name->second;
+        std::map<const node_t *, nodes_t>::const_iterator added = macros.added_.find(&node);
+        result.push_back(node);
+        if (added != macros.added_.end())
+            result.insert(result.end(), added->second.begin(), added->second.end());
+    }
+    nodes.swap(result);
+}
+static void find_calls(const nodes_t &nodes, std::set<std::string> &called)
+{
+    for (size_t i = 0; i < nodes.size(); ++i)
+    {
+        if (nodes[i].type_ == node_t::e_call)
+            called.insert(nodes[i].str_);
+        for (size_t j = 0; j < nodes[i].bodies_.size(); ++j)
+            find_calls(nodes[i].bodies_[j], called);
+    }
+}
+static void remove_copies(nodes_t &nodes, const std::set<std::string> &unused)
+{
+    nodes_t result;
+    for (size_t i = 0; i < nodes.size(); ++i)
+    {
+        node_t &node = nodes[i];
+        if (node.type_ == node_t::e_macro && unused.count(node.str_))
+            continue;
+        for (size_t j = 0; j < node.bodies_.size(); ++j)
+            remove_copies(node.bodies_[j], unused);
+        result.push_back(node);
+    }
+    nodes.swap(result);
+}
+//copies made for the context of a loop round before the last
+static bool remove_copies(nodes_t &nodes, macros_t &macros)
+{
+    std::set<std::string> called;
+    find_calls(nodes, called);
+    std::set<std::string> unused;
+    std::map<std::string, std::string>::iterator it = macros.origin_.begin();
+    while (it != macros.origin_.end())
+    {
+        if (called.count(it->first))
+            ++it;
+        else
+        {
+            unused.insert(it->first);
+            macros.entry_.erase(it->first);
+            macros.origin_.erase(it++);
+        }
+    }
+    if (!unused.empty())
+        remove_copies(nodes, unused);
+    return !unused.empty();
+}
+void escape_contexts(nodes_t &nodes)
+{
+    escapings_t escapings;
+    macros_t macros;
+    //until each call has the copy of its context
+    do
+    {
+        escapings.clear();
+        macros.clear();
+        scan_contexts(nodes, context_t(), escapings, macros);
+        if (!macros.renames_.empty() || !macros.added_.empty())
+            specialize_macros(nodes, macros);
+        else if (!remove_copies(nodes, macros))
+            break;
+    } while (true);
+    apply_escapings(nodes, escapings);
+}
+
+static std::string quote(const std::string &str)
+{
+    std::string buffer("\"");
+    for (size_t i = 0; i < str.size(); ++i)
+    {
+        char ch = str[i];
+        if (ch == '"' || ch == '\\')
+            buffer.push_back('\\');
+        if (ch == '\n')
+            buffer += "\\n";
+        else if (ch == '\r')
+            buffer += "\\r";
+        else if (ch == '\t')
+            buffer += "\\t";
+        else
+            buffer.push_back(ch);
+    }
+    return buffer + "\"";
+}
+static std::string dump_expr(const expr_t &expr)
+{
+    std::string buffer;
+    switch (expr.type_)
+    {
+        case expr_t::e_variable:
+            return expr.str_ + ":" + expr.type_str_;
+        case expr_t::e_string:
+            return quote(expr.str_);
+        case expr_t::e_number:
+            return expr.str_;
+        case expr_t::e_call:
+            buffer = expr.str_ + "(";
+            for (size_t i = 0; i < expr.args_.size(); ++i)
+                buffer += (i ? ", " : "") + dump_expr(expr.args_[i]);
+            return buffer + ")";
+        case expr_t::e_test:
+            return "(" + dump_expr(expr.args_[0]) + " is not " + expr.str_ + ")";
+        case expr_t::e_compare:
+            return "(" + dump_expr(expr.args_[0]) + " " + expr.str_ + " " +
+                   dump_expr(expr.args_[1]) + ")";
+        case expr_t::e_and:
+        case expr_t::e_or:
+            buffer = "(";
+            for (size_t i = 0; i < expr.args_.size(); ++i)
+            {
+                if (i)
+                    buffer += expr.type_ == expr_t::e_and ? " and " : " or ";
+                buffer += dump_expr(expr.args_[i]);
+            }
+            return buffer + ")";
+        case expr_t::e_not:
+            return "not " + dump_expr(expr.args_[0]);
+    }
+    return "?";
+}
+static std::string dump_nodes(const nodes_t &nodes, const std::string &indent)
+{
+    std::string buffer;
+    for (size_t i = 0; i < nodes.size(); ++i)
+    {
+        const node_t &node = nodes[i];
+        std::string inner = indent + "  ";
+        switch (node.type_)
+        {
+            case node_t::e_literal:
+                buffer += indent + "literal " + quote(node.str_) + br;
+                break;
+            case node_t::e_emit:
+                buffer += indent + "emit " + dump_expr(node.expr_) + br;
+                break;
+            case node_t::e_if:
+                for (size_t j = 0; j < node.bodies_.size(); ++j)
+                {
+                    if (j < node.conds_.size())
+                        buffer += indent + (j ? "elif " : "if ") +
+                                  dump_expr(node.conds_[j]) + br;
+                    else
+                        buffer += indent + "else" + br;
+                    buffer += dump_nodes(node.bodies_[j], inner);
+                }
+                break;
+            case node_t::e_for:
+                buffer += indent + "for ";
+                if (node.loop_ == node_t::e_loop_map)
+                    buffer += node.key_ + ", ";
+                buffer += node.value_ + " in " + dump_expr(node.expr_) + br;
+                buffer += dump_nodes(node.bodies_[0], inner);
+                if (node.bodies_.size() > 1)
+                {
+                    buffer += indent + "empty" + br;
+                    buffer += dump_nodes(node.bodies_[1], inner);
+                }
+                break;
+            case node_t::e_block:
+                buffer += indent + "block " + node.str_ + br;
+                buffer += dump_nodes(node.bodies_[0], inner);
+                break;
+            case node_t::e_include:
+                buffer += indent + "include " + quote(node.str_) + br;
+                buffer += dump_nodes(node.bodies_[0], inner);
+                break;
+            case node_t::e_switch:
+                buffer += indent + "switch " + dump_expr(node.expr_) + br;
+                for (size_t j = 0; j < node.bodies_.size(); ++j)
+                {
+                    if (j < node.conds_.size())
+                    {
+                        buffer += indent + "case ";
+                        for (size_t k = 0; k < node.conds_[j].args_.size(); ++k)
+                            buffer += (k ? ", " : "") + dump_expr(node.conds_[j].args_[k]);
+                        buffer += br;
+                    }
+                    else
+                        buffer += indent + "default" + br;
+                    buffer += dump_nodes(node.bodies_[j], inner);
+                }
+                break;
+            case node_t::e_cold:
+                buffer += indent + "cold" + br;
+                buffer += dump_nodes(node.bodies_[0], inner);
+                break;
+            case node_t::e_trans:
+                buffer += indent + "trans " + quote(node.str_) + br;
+                buffer += dump_nodes(node.bodies_[0], inner);
+                break;
+            case node_t::e_let:
+                buffer += indent + "let " + node.value_ + ":" + node.value_type_ +
+                          " = " + dump_expr(node.expr_) + br;
+                break;
+            case node_t::e_macro:
+            case node_t::e_call:
+                buffer += indent;
+                buffer += node.type_ == node_t::e_macro ? "macro " : "call ";
+                buffer += node.str_ + "(";
+                for (size_t j = 0; j < node.args_.size(); ++j)
+                    buffer += (j ? ", " : "") + dump_expr(node.args_[j]);
+                buffer += ")" + br;
+                if (node.type_ == node_t::e_macro)
+                    buffer += dump_nodes(node.bodies_[0], inner);
+                break;
+        }
+    }
+    return buffer;
+}
+std::string dump_ir(const nodes_t &nodes)
+{
+    return dump_nodes(nodes, "");
+}
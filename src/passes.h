@@ -0,0 +1,59 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <map>
+#include "ir.h"
+
+// optimization passes over the parse tree, run in order between the
+// parser and the backends. a pass rewrites the tree in place and must
+// keep the rendered output the same.
+struct pass_t
+{
+    const char *name_;
+    void (*run_)(nodes_t &nodes);
+};
+
+class pass_manager
+{
+public:
+    pass_manager();
+
+    void add(const char *name, void (*run)(nodes_t &nodes));
+    //dump, when not NULL, gets the tree after each pass
+    void run(nodes_t &nodes, std::string *dump) const;
+private:
+    std::vector<pass_t> passes_;
+};
+
+std::string dump_ir(const nodes_t &nodes);
+
+//numbers the counted nodes, the same way in the instrumented build and
+//in the one reading its profile. returns the number of counters.
+size_t number_sites(nodes_t &nodes);
+//the counters of an instrumented build onto the numbered nodes. switch cases are tested most taken
+//first, bodies of more than min_nodes nodes that run less than 1% of
+//the times their node is reached become cold regions.
+void apply_profile(nodes_t &nodes, const std::vector<unsigned long long> &counts,
+                   size_t min_nodes);
+
+//parameter `name` replaced by a constant, for template variants.
+//fold-constants then removes what the constant decides.
+void bind_constant(nodes_t &nodes, const std::string &name, const expr_t &value);
+//a constant list of strings, loops over it are unrolled
+void bind_constant(nodes_t &nodes, const std::string &name,
+                   const std::vector<std::string> &items);
+
+//html whitespace collapsed, and dropped between tags. pre, textarea,
+//script and style keep theirs. by default, and for {% spaceless %}.
+void minify_html(nodes_t &nodes);
+
+//{{ }} values escaped for where they are in the html: text, attribute,
+//url, javascript or css, see lemon_escape.hpp. a macro called outside
+//of text gets a copy for the context of the call.
+void escape_contexts(nodes_t &nodes);
+
+//the message of a {% blocktrans %} body, its {{ }} as %(a.b)s
+std::string trans_message(const nodes_t &body);
+//{% trans %} nodes replaced by their translation in messages, else by
+//their source text. returns the number translated.
+size_t translate(nodes_t &nodes, const std::map<std::string, std::string> &messages);
@@ -0,0 +1,78 @@
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include "source_cache.h"
+#include "hash.h"
+
+bool source_cache::get(const std::string &file_path, std::string &data)
+{
+    mutex_.lock();
+    std::map<std::string, std::string>::iterator it = files_.find(file_path);
+    if (it != files_.end())
+    {
+        data = it->second;
+        mutex_.unlock();
+        return true;
+    }
+    mutex_.unlock();
+
+    //read outside the lock, the first reader wins a race
+    std::ifstream file(file_path.c_str());
+    if (!file.good())
+        return false;
+    std::ostringstream buffer;
+    buffer << file.rdbuf();
+    data = buffer.str();
+
+    mutex_.lock();
+    files_.insert(std::make_pair(file_path, data));
+    mutex_.unlock();
+    return true;
+}
+void source_cache::erase(const std::string &file_path)
+{
+    mutex_.lock();
+    files_.erase(file_path);
+    std::map<std::string, tree>::iterator it = trees_.begin();
+    while (it != trees_.end())
+    {
+        const std::vector<std::string> &inputs = it->second.inputs_;
+        if (std::find(inputs.begin(), inputs.end(), file_path) != inputs.end())
+            trees_.erase(it++);
+        else
+            ++it;
+    }
+    mutex_.unlock();
+}
+bool source_cache::get_tree(const std::string &key, tree &t)
+{
+    mutex_.lock();
+    std::map<std::string, tree>::iterator it = trees_.find(key);
+    if (it == trees_.end())
+    {
+        mutex_.unlock();
+        return false;
+    }
+    t = it->second;
+    mutex_.unlock();
+
+    for (size_t i = 0; i < t.inputs_.size(); ++i)
+    {
+        std::string data;
+        if (!get(t.inputs_[i], data) || fnv1a(data) != t.hashes_[i])
+            return false;
+    }
+    return true;
+}
+void source_cache::put_tree(const std::string &key, const tree &t)
+{
+    mutex_.lock();
+    trees_[key] = t;
+    mutex_.unlock();
+}
+void source_cache::clear_trees()
+{
+    mutex_.lock();
+    trees_.clear();
+    mutex_.unlock();
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include <map>
+#include <string>
+#include <vector>
+#include "acl_cpp/lib_acl.hpp"
+#include "ir.h"
+
+// file contents shared by every compilation of a batch.
+// headers, included and base templates are read from disk once, and
+// included and base templates are parsed once per set of bindings.
+// in watch mode both stay between rebuilds, but for what changed.
+class source_cache
+{
+public:
+    //an included or base template parsed in the bindings of its key
+    struct tree
+    {
+        tree()
+            :first_iterator_(0),
+             iterators_(0)
+        {
+
+        }
+        nodes_t nodes_;
+        //files the parse read and their hashes, checked on a hit
+        std::vector<std::string> inputs_;
+        std::vector<unsigned long long> hashes_;
+        //macros it defined, see lemon::write_fields()
+        std::string macros_;
+        //the parser's iterator count before, and the iterators it took
+        int first_iterator_;
+        int iterators_;
+    };
+    bool get(const std::string &file_path, std::string &data);
+    //the file and the trees that read it, after it changed
+    void erase(const std::string &file_path);
+    //a copy of the tree, false when there is none or one of its
+    //inputs changed since
+    bool get_tree(const std::string &key, tree &t);
+    void put_tree(const std::string &key, const tree &t);
+    //after the headers changed, the types in the trees are stale
+    void clear_trees();
+private:
+    acl::thread_mutex mutex_;
+    std::map<std::string, std::string> files_;
+    std::map<std::string, tree> trees_;
+};
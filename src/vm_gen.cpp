@@ -0,0 +1,443 @@
+#include <map>
+#include <stdexcept>
+#include <iostream>
+#include <fstream>
+#include "acl_cpp/lib_acl.hpp"
+#include "lemon.h"
+#include "lemon_vm.hpp"
+#include "ir.h"
+#include "source_cache.h"
+
+#define br std::string("\n")
+
+using namespace lm::vm;
+
+//lowers the parse tree to registers and jumps. parameters own the
+//first registers, loop variables and cursors are stacked above them
+//and every statement frees the temporaries it used.
+struct vm_gen
+{
+    vm_gen(builder &prog)
+        :prog_(prog),
+         top_(0)
+    {
+
+    }
+    int alloc()
+    {
+        if (top_ > 255)
+            throw std::runtime_error("template needs too many registers");
+        int r = top_++;
+        if (top_ > prog_.registers_)
+            prog_.registers_ = top_;
+        return r;
+    }
+    void bind(const std::string &name, int r)
+    {
+        scope_.push_back(std::make_pair(name, r));
+    }
+    int lookup(const std::string &name)
+    {
+        for (size_t i = scope_.size(); i > 0; --i)
+        {
+            if (scope_[i - 1].first == name)
+                return scope_[i - 1].second;
+        }
+        throw std::runtime_error("not find variable " + name);
+        return 0;
+    }
+    size_t emit(op_t op, int a, int b, unsigned int c)
+    {
+        instr_t in;
+        in.op_ = (unsigned char)op;
+        in.a_ = (unsigned char)a;
+        in.b_ = (unsigned short)b;
+        in.c_ = c;
+        prog_.code_.push_back(in);
+        return prog_.code_.size() - 1;
+    }
+    void patch(size_t at)
+    {
+        prog_.code_[at].c_ = (unsigned int)prog_.code_.size();
+    }
+    int cmp_op(const std::string &op)
+    {
+        if (op == "==")
+            return cmp_eq;
+        if (op == "!=")
+            return cmp_neq;
+        if (op == "<")
+            return cmp_less;
+        if (op == "<=")
+            return cmp_le;
+        if (op == ">")
+            return cmp_gt;
+        if (op == ">=")
+            return cmp_ge;
+        throw std::runtime_error("unknown operator " + op);
+        return 0;
+    }
+
+    int gen_variable(const expr_t &expr)
+    {
+        size_t pos = expr.str_.find('.');
+        int r = lookup(expr.str_.substr(0, pos));
+        if (pos == std::string::npos)
+            return r;
+
+        //a.b.c walks the fields in one register
+        int dst = alloc();
+        size_t index = 0;
+        while (pos != std::string::npos)
+        {
+            size_t next = expr.str_.find('.', pos + 1);
+            std::string name = expr.str_.substr(pos + 1, next == std::string::npos ?
+                                                std::string::npos : next - pos - 1);
+            emit(op_field, dst, r, prog_.symbol(expr.types_[index++], name));
+            r = dst;
+            pos = next;
+        }
+        return dst;
+    }
+    int gen_call(const expr_t &expr)
+    {
+        int b = gen_expr(expr.args_[0]);
+        int a = alloc();
+        lm::escape_t kind;
+        if (lm::find_escape(expr.str_, kind))
+            emit(op_escape, a, b, kind);
+        else if (expr.str_ == "default")
+            emit(op_default, a, b, prog_.literal(expr.args_[1].str_));
+        else if (expr.str_ == "length")
+            emit(op_length, a, b, 0);
+        else if (expr.str_ == "to_string")
+            emit(op_to_string, a, b, 0);
+        else
+            throw std::runtime_error("unknown filter " + expr.str_);
+        return a;
+    }
+    int gen_expr(const expr_t &expr)
+    {
+        int a;
+        int b;
+        switch (expr.type_)
+        {
+            case expr_t::e_variable:
+                return gen_variable(expr);
+            case expr_t::e_string:
+                a = alloc();
+                emit(op_str, a, 0, prog_.literal(expr.str_));
+                return a;
+            case expr_t::e_number:
+                a = alloc();
+                emit(op_num, a, 0, prog_.number(expr.str_));
+                return a;
+            case expr_t::e_call:
+                return gen_call(expr);
+            case expr_t::e_test:
+                b = gen_expr(expr.args_[0]);
+                a = alloc();
+                emit(expr.str_ == "zero" ? op_test_zero : op_test_empty, a, b, 0);
+                return a;
+            case expr_t::e_compare:
+            {
+                b = gen_expr(expr.args_[0]);
+                int c = gen_expr(expr.args_[1]);
+                a = alloc();
+                emit(op_cmp, a, b, (cmp_op(expr.str_) << 16) | c);
+                return a;
+            }
+            case expr_t::e_and:
+            case expr_t::e_or:
+                a = gen_expr(expr.args_[0]);
+                for (size_t i = 1; i < expr.args_.size(); ++i)
+                {
+                    b = gen_expr(expr.args_[i]);
+                    int dst = alloc();
+                    emit(expr.type_ == expr_t::e_and ? op_and : op_or, dst, a, b);
+                    a = dst;
+                }
+                return a;
+            case expr_t::e_not:
+                b = gen_expr(expr.args_[0]);
+                a = alloc();
+                emit(op_not, a, b, 0);
+                return a;
+        }
+        throw std::runtime_error("unknown expression");
+        return 0;
+    }
+    void gen_emit(const expr_t &expr)
+    {
+        //print straight from the view model, no temporary string
+        if (expr.type_ == expr_t::e_call &&
+            expr.args_[0].type_ == expr_t::e_variable)
+        {
+            lm::escape_t kind;
+            if (lm::find_escape(expr.str_, kind))
+            {
+                emit(op_emit_escape, gen_expr(expr.args_[0]), 0, kind);
+                return;
+            }
+            if (expr.str_ == "to_string")
+            {
+                emit(op_emit, gen_expr(expr.args_[0]), 0, 0);
+                return;
+            }
+        }
+        emit(op_emit, gen_expr(expr), 0, 0);
+    }
+    void gen_if(const node_t &node)
+    {
+        std::vector<size_t> ends;
+        for (size_t i = 0; i < node.bodies_.size(); ++i)
+        {
+            size_t next = 0;
+            if (i < node.conds_.size())
+            {
+                int top = top_;
+                int cond = gen_expr(node.conds_[i]);
+                top_ = top;
+                next = emit(op_jump_false, cond, 0, 0);
+            }
+            gen(node.bodies_[i]);
+            if (i + 1 < node.bodies_.size())
+                ends.push_back(emit(op_jump, 0, 0, 0));
+            if (i < node.conds_.size())
+                patch(next);
+        }
+        for (size_t i = 0; i < ends.size(); ++i)
+            patch(ends[i]);
+    }
+    //the subject is computed once, then compared to each constant
+    void gen_switch(const node_t &node)
+    {
+        int subject = gen_expr(node.expr_);
+        std::vector<size_t> ends;
+        for (size_t i = 0; i < node.bodies_.size(); ++i)
+        {
+            size_t next = 0;
+            if (i < node.conds_.size())
+            {
+                int top = top_;
+                int cond = -1;
+                const std::vector<expr_t> &labels = node.conds_[i].args_;
+                for (size_t j = 0; j < labels.size(); ++j)
+                {
+                    int label = gen_expr(labels[j]);
+                    int test = alloc();
+                    emit(op_cmp, test, subject, (cmp_eq << 16) | label);
+                    if (cond >= 0)
+                    {
+                        int dst = alloc();
+                        emit(op_or, dst, cond, test);
+                        test = dst;
+                    }
+                    cond = test;
+                }
+                top_ = top;
+                next = emit(op_jump_false, cond, 0, 0);
+            }
+            gen(node.bodies_[i]);
+            if (i + 1 < node.bodies_.size())
+                ends.push_back(emit(op_jump, 0, 0, 0));
+            if (i < node.conds_.size())
+                patch(next);
+        }
+        for (size_t i = 0; i < ends.size(); ++i)
+            patch(ends[i]);
+    }
+    void gen_for(const node_t &node)
+    {
+        int top = top_;
+        size_t scope = scope_.size();
+
+        int items = gen_expr(node.expr_);
+        int cursor = alloc();
+        int value = alloc();
+        op_t next = op_next;
+        if (node.loop_ == node_t::e_loop_map)
+        {
+            next = op_next_kv;
+            bind(node.key_, value);
+            bind(node.value_, alloc());
+        }
+        else
+            bind(node.value_, value);
+
+        emit(op_iter, cursor, items, 0);
+        size_t loop = emit(next, cursor, value, 0);
+        gen(node.bodies_[0]);
+        emit(op_jump, 0, 0, (unsigned int)loop);
+        patch(loop);
+        emit(op_end, cursor, 0, 0);
+
+        scope_.resize(scope);
+        if (node.bodies_.size() > 1)
+        {
+            int test = alloc();
+            emit(op_test_empty, test, items, 0);
+            size_t skip = emit(op_jump_true, test, 0, 0);
+            gen(node.bodies_[1]);
+            patch(skip);
+        }
+        top_ = top;
+    }
+    //macros are expanded at the call, the parameters bound to the
+    //registers of the arguments
+    void gen_call(const node_t &node)
+    {
+        const node_t &macro = *macros_[node.str_];
+        std::vector<int> args;
+        for (size_t i = 0; i < node.args_.size(); ++i)
+            args.push_back(gen_expr(node.args_[i]));
+
+        std::vector<std::pair<std::string, int> > scope;
+        scope.swap(scope_);
+        for (size_t i = 0; i < macro.args_.size(); ++i)
+            bind(macro.args_[i].str_, args[i]);
+        gen(macro.bodies_[0]);
+        scope_.swap(scope);
+    }
+    //values bound by e_let keep their registers to the end of the body
+    void gen(const nodes_t &nodes)
+    {
+        int base = top_;
+        size_t scope = scope_.size();
+        for (size_t i = 0; i < nodes.size(); ++i)
+        {
+            const node_t &node = nodes[i];
+            int top = top_;
+            if (node.type_ == node_t::e_literal)
+                emit(op_text, 0, 0, prog_.literal(node.str_));
+            else if (node.type_ == node_t::e_emit)
+                gen_emit(node.expr_);
+            else if (node.type_ == node_t::e_let)
+            {
+                bind(node.value_, gen_expr(node.expr_));
+                continue;
+            }
+            else if (node.type_ == node_t::e_if)
+                gen_if(node);
+            else if (node.type_ == node_t::e_switch)
+                gen_switch(node);
+            else if (node.type_ == node_t::e_for)
+                gen_for(node);
+            else if (node.type_ == node_t::e_macro)
+                macros_[node.str_] = &node;
+            else if (node.type_ == node_t::e_call)
+                gen_call(node);
+            else
+                gen(node.bodies_[0]);
+            top_ = top;
+        }
+        scope_.resize(scope);
+        top_ = base;
+    }
+
+    builder &prog_;
+    int top_;
+    std::vector<std::pair<std::string, int> > scope_;
+    std::map<std::string, const node_t *> macros_;
+};
+
+std::string lemon::gen_program(const nodes_t &nodes)
+{
+    builder prog;
+    vm_gen gen(prog);
+
+    prog.name_ = prog.str(template_.interface_.name_);
+    for (size_t i = 0; i < template_.interface_.params_.size(); ++i)
+    {
+        const field &f = template_.interface_.params_[i];
+        prog.param(to_string(f.namespaces_) + f.type_str_);
+        gen.bind(f.name_, gen.alloc());
+    }
+    gen.gen(nodes);
+    gen.emit(op_ret, 0, 0, 0);
+
+    //the template, its includes and base templates. headers are
+    //checked by linking the fields against the reflection tables
+    for (size_t i = 0; i < inputs_.size(); ++i)
+    {
+        std::string data;
+        if (sources_->get(inputs_[i], data))
+            prog.dep(inputs_[i], fnv1a(data.c_str(), data.size()));
+    }
+
+    std::string data;
+    prog.save(data);
+    return data;
+}
+
+bool lemon::gen_reflect(const std::string &file_path) const
+{
+    std::string code;
+    code += "#pragma once" + br;
+    code += "#include \"lemon_vm.hpp\"" + br;
+    for (size_t i = 0; i < headers_.size(); ++i)
+        code += "#include \"" + headers_[i] + "\"" + br;
+    code += br;
+    code += "namespace lm" + br + "{" + br;
+    code += "namespace vm" + br + "{" + br;
+
+    //declared first, fields may be of any of the classes
+    for (size_t i = 0; i < classes_.size(); ++i)
+    {
+        const class_t &cls = classes_[i];
+        std::string name = to_string(cls.namespaces_) + cls.name_;
+        code += "    template<>" + br;
+        code += "    struct reflect<" + name + " >" + br;
+        code += "    {" + br;
+        code += "        static type_t make();" + br;
+        code += "        static const type_t *type()" + br;
+        code += "        {" + br;
+        code += "            static const type_t t = make();" + br;
+        code += "            return &t;" + br;
+        code += "        }" + br;
+        code += "    };" + br;
+    }
+    for (size_t i = 0; i < classes_.size(); ++i)
+    {
+        const class_t &cls = classes_[i];
+        std::string name = to_string(cls.namespaces_) + cls.name_;
+        code += "    inline type_t reflect<" + name + " >::make()" + br;
+        code += "    {" + br;
+        code += "        type_t t = make_type(\"" + name + "\", k_object);" + br;
+        for (size_t j = 0; j < cls.variables_.size(); ++j)
+        {
+            const std::string &f = cls.variables_[j].name_;
+            code += "        t.fields_.push_back(make_field<" + name + " >(\"";
+            code += f + "\", &" + name + "::" + f + "));" + br;
+        }
+        code += "        return t;" + br;
+        code += "    }" + br;
+    }
+    code += "}" + br + "}" + br + br;
+
+    //registered by name, programs link their fields through them
+    code += "namespace" + br + "{" + br;
+    code += "    struct lm_vm_types" + br;
+    code += "    {" + br;
+    code += "        lm_vm_types()" + br;
+    code += "        {" + br;
+    for (size_t i = 0; i < classes_.size(); ++i)
+    {
+        const class_t &cls = classes_[i];
+        std::string name = to_string(cls.namespaces_) + cls.name_;
+        code += "            lm::vm::add_type(lm::vm::reflect<" + name;
+        code += " >::type());" + br;
+    }
+    code += "        }" + br;
+    code += "    } lm_vm_types_;" + br;
+    code += "}" + br;
+
+    std::ofstream file(file_path.c_str(), std::ios::out | std::ios::binary);
+    file.write(code.c_str(), code.size());
+    if (!file.good())
+    {
+        std::cout << "write file error. " << file_path << std::endl;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,188 @@
+#include <map>
+#include <algorithm>
+#include <set>
+#include <iostream>
+#ifdef __linux__
+#include <poll.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/inotify.h>
+#endif
+#include "acl_cpp/lib_acl.hpp"
+#include "lemon.h"
+#include "source_cache.h"
+
+#ifdef __linux__
+
+static std::string dir_name(const std::string &file_path)
+{
+    size_t pos = file_path.find_last_of('/');
+    if (pos == std::string::npos)
+        return ".";
+    if (pos == 0)
+        return "/";
+    return file_path.substr(0, pos);
+}
+static std::string base_name(const std::string &file_path)
+{
+    size_t pos = file_path.find_last_of('/');
+    if (pos == std::string::npos)
+        return file_path;
+    return file_path.substr(pos + 1);
+}
+static long long now_us()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+// inotify on the directories of every watched file: editors that
+// save by renaming a temp file would drop a watch on the file itself.
+struct watcher
+{
+    watcher()
+    {
+        fd_ = inotify_init();
+    }
+    ~watcher()
+    {
+        if (fd_ >= 0)
+            close(fd_);
+    }
+    void add(const std::string &file_path)
+    {
+        std::string dir = dir_name(file_path);
+        files_[dir + "/" + base_name(file_path)] = file_path;
+        if (dirs_.find(dir) != dirs_.end())
+            return;
+        int wd = inotify_add_watch(fd_, dir.c_str(),
+                                   IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE);
+        if (wd < 0)
+        {
+            std::cout << "watch error. " << dir << std::endl;
+            return;
+        }
+        dirs_[dir] = wd;
+        wds_[wd] = dir;
+    }
+    //block for changes, then collect the burst that follows them
+    std::set<std::string> wait()
+    {
+        std::set<std::string> changed;
+        int timeout = -1;
+        do
+        {
+            struct pollfd pfd;
+            pfd.fd = fd_;
+            pfd.events = POLLIN;
+            if (poll(&pfd, 1, timeout) <= 0)
+                break;
+            char buffer[4096];
+            ssize_t len = read(fd_, buffer, sizeof(buffer));
+            if (len <= 0)
+                break;
+            for (ssize_t i = 0; i < len;)
+            {
+                struct inotify_event *e = (struct inotify_event *)(buffer + i);
+                i += sizeof(struct inotify_event) + e->len;
+                if (!e->len || wds_.find(e->wd) == wds_.end())
+                    continue;
+                std::string key = wds_[e->wd] + "/" + e->name;
+                std::map<std::string, std::string>::iterator it = files_.find(key);
+                if (it != files_.end())
+                    changed.insert(it->second);
+            }
+            timeout = changed.empty() ? -1 : 50;
+        } while (true);
+        return changed;
+    }
+
+    int fd_;
+    std::map<std::string, int> dirs_;
+    std::map<int, std::string> wds_;
+    //<dir>/<name> => path as the templates spell it
+    std::map<std::string, std::string> files_;
+};
+
+bool lemon::watch(const std::vector<std::string> &templates, int threads)
+{
+    watcher w;
+    if (w.fd_ < 0)
+    {
+        std::cout << "inotify_init error" << std::endl;
+        return false;
+    }
+    //input => templates depending on it
+    std::map<std::string, std::set<std::string> > users;
+    std::vector<std::string> dirty(templates);
+
+    do
+    {
+        long long begin = now_us();
+        parse_templates(dirty, threads);
+        long long cost = now_us() - begin;
+        std::cout << "rebuilt " << dirty.size() << " templates in "
+                  << cost / 1000 << "." << (cost % 1000) / 100 << " ms"
+                  << std::endl;
+
+        //includes and extends may have changed with the templates
+        for (size_t i = 0; i < dirty.size(); ++i)
+        {
+            std::map<std::string, std::set<std::string> >::iterator it;
+            for (it = users.begin(); it != users.end(); ++it)
+                it->second.erase(dirty[i]);
+
+            std::vector<std::string> inputs;
+            resolve_inputs(dirty[i], inputs);
+            inputs.push_back(dirty[i]);
+            for (size_t j = 0; j < inputs.size(); ++j)
+            {
+                users[inputs[j]].insert(dirty[i]);
+                w.add(inputs[j]);
+            }
+        }
+        for (size_t i = 0; i < headers_.size(); ++i)
+            w.add(headers_[i]);
+        for (size_t i = 0; i < analyzed_files_.size(); ++i)
+            w.add(analyzed_files_[i]);
+
+        std::set<std::string> changed = w.wait();
+        if (changed.empty())
+            return false;
+
+        bool header = false;
+        std::set<std::string> rebuild;
+        std::set<std::string>::iterator it;
+        for (it = changed.begin(); it != changed.end(); ++it)
+        {
+            //the parse trees of the includes and base templates that
+            //didn't change are kept for the rebuild
+            sources_->erase(*it);
+            if (check_file_done(*it) ||
+                std::find(headers_.begin(), headers_.end(), *it) != headers_.end())
+                header = true;
+            //a base template lists every child extending it
+            std::set<std::string> &u = users[*it];
+            rebuild.insert(u.begin(), u.end());
+        }
+        if (header)
+        {
+            reload_headers();
+            rebuild.clear();
+            rebuild.insert(templates.begin(), templates.end());
+        }
+        dirty.assign(rebuild.begin(), rebuild.end());
+    } while (true);
+    return true;
+}
+
+#else
+
+bool lemon::watch(const std::vector<std::string> &, int)
+{
+    std::cout << "watch mode needs inotify, not supported here" << std::endl;
+    return false;
+}
+
+#endif
@@ -0,0 +1,103 @@
+#include "work_pool.h"
+
+work_pool::work_pool(int threads)
+{
+    next_ = 0;
+    if (threads < 1)
+        threads = 1;
+    for (int i = 0; i < threads; ++i)
+        queues_.push_back(new queue);
+}
+work_pool::~work_pool()
+{
+    for (size_t i = 0; i < queues_.size(); ++i)
+        delete queues_[i];
+}
+void work_pool::push(task *t)
+{
+    queue *q = queues_[next_++ % queues_.size()];
+    q->mutex_.lock();
+    q->tasks_.push_back(t);
+    q->mutex_.unlock();
+}
+work_pool::task *work_pool::pop(size_t index)
+{
+    task *t = NULL;
+    queue *q = queues_[index];
+
+    q->mutex_.lock();
+    if (!q->tasks_.empty())
+    {
+        t = q->tasks_.back();
+        q->tasks_.pop_back();
+    }
+    q->mutex_.unlock();
+    return t;
+}
+work_pool::task *work_pool::steal(size_t index)
+{
+    for (size_t i = 1; i < queues_.size(); ++i)
+    {
+        queue *q = queues_[(index + i) % queues_.size()];
+        task *t = NULL;
+
+        q->mutex_.lock();
+        if (!q->tasks_.empty())
+        {
+            t = q->tasks_.front();
+            q->tasks_.pop_front();
+        }
+        q->mutex_.unlock();
+        if (t)
+            return t;
+    }
+    return NULL;
+}
+void work_pool::run()
+{
+    std::vector<worker*> workers;
+
+    //the calling thread works as worker 0 and steals the tasks
+    //of any worker that failed to start.
+    for (size_t i = 1; i < queues_.size(); ++i)
+    {
+        worker *w = new worker(*this, i);
+        if (!w->start())
+        {
+            delete w;
+            continue;
+        }
+        workers.push_back(w);
+    }
+    drain(0);
+
+    for (size_t i = 0; i < workers.size(); ++i)
+    {
+        workers[i]->wait();
+        delete workers[i];
+    }
+}
+work_pool::worker::worker(work_pool &pool, size_t index)
+    :pool_(pool),
+     index_(index)
+{
+
+}
+void *work_pool::worker::run()
+{
+    pool_.drain(index_);
+    return NULL;
+}
+void work_pool::drain(size_t index)
+{
+    do
+    {
+        task *t = pop(index);
+        if (!t)
+            t = steal(index);
+        //tasks never spawn tasks, so empty queues mean done.
+        if (!t)
+            break;
+        t->run();
+    } while (true);
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include <deque>
+#include <vector>
+#include "acl_cpp/lib_acl.hpp"
+
+// fixed set of tasks run on N threads.
+// every worker owns a deque, pops from its back and steals
+// from the front of the others once its own deque is drained.
+class work_pool
+{
+public:
+    struct task
+    {
+        virtual ~task()
+        {
+
+        }
+        virtual void run() = 0;
+    };
+
+    explicit work_pool(int threads);
+    ~work_pool();
+
+    void push(task *t);
+    //block until every pushed task has run
+    void run();
+
+private:
+    struct queue
+    {
+        acl::thread_mutex mutex_;
+        std::deque<task*> tasks_;
+    };
+    class worker : public acl::thread
+    {
+    public:
+        worker(work_pool &pool, size_t index);
+    protected:
+        virtual void *run();
+    private:
+        work_pool &pool_;
+        size_t index_;
+    };
+
+    task *pop(size_t index);
+    task *steal(size_t index);
+    void drain(size_t index);
+
+    std::vector<queue*> queues_;
+    size_t next_;
+};
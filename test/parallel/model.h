@@ -0,0 +1,23 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <map>
+#include <list>
+
+namespace shop
+{
+    struct item
+    {
+        std::string name;
+        int price;
+    };
+    class user
+    {
+    public:
+        std::string name;
+        int age;
+        std::vector<item> items;
+        std::map<std::string, std::string> tags;
+        std::list<std::string> notes;
+    };
+}
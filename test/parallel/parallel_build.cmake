@@ -0,0 +1,80 @@
+# compiles a few hundred templates with -j 16 and serially, for both
+# backends, and checks the outputs are the same bytes.
+#
+# cmake -DLEMON=path/to/lemon -DSOURCE_DIR=test/parallel -DWORK_DIR=dir
+#       -P parallel_build.cmake
+
+set(templates 300)
+math(EXPR last "${templates} - 1")
+unset(ENV{LEMON_CACHE_DIR})
+
+# page i uses the shared include and base template in turns, so the
+# threads read and parse them at the same time
+function(write_page dir i)
+    math(EXPR kind "${i} % 4")
+    set(text "<!--std::string page_${i}(const shop::user &u, const std::string &title)-->\n")
+    if(kind EQUAL 0)
+        set(text "${text}<h1>{{title}} ${i}</h1>\n<ul>{% for it in u.items %}<li>{{it.name}} {{it.price}}</li>{% empty %}<li>none</li>{% endfor %}</ul>\n")
+    elseif(kind EQUAL 1)
+        set(text "${text}{% include \"inc.lm\" %}\n{% for it in u.items %}{% call card(it) %}{% endfor %}<i>${i}</i>\n")
+    elseif(kind EQUAL 2)
+        set(text "${text}{% extends base.lm %}\n{% block head %}<title>{{title}} ${i}</title>{% endblock %}\n{% block body %}{% for k, v in u.tags %}<b>{{k}}={{v}}</b>{% endfor %}{% endblock %}\n")
+    else()
+        set(text "${text}{% if u.age > ${i} %}old{% elif u.age == ${i} %}${i}{% else %}young{% endif %}\n<script>var n = \"{{u.name}}\"</script>{% for n in u.notes %}<p>{{n|default:\"-\"}}</p>{% endfor %}\n")
+    endif()
+    file(WRITE ${dir}/page_${i}.lm "${text}")
+endfunction()
+
+set(names)
+foreach(i RANGE ${last})
+    list(APPEND names page_${i}.lm)
+endforeach()
+
+foreach(backend cpp vm)
+    set(flags)
+    if(backend STREQUAL "vm")
+        set(flags --vm)
+    endif()
+    foreach(run serial parallel)
+        set(dir ${WORK_DIR}/${backend}_${run})
+        file(REMOVE_RECURSE ${dir})
+        file(MAKE_DIRECTORY ${dir})
+        foreach(file model.h base.lm inc.lm)
+            configure_file(${SOURCE_DIR}/${file} ${dir}/${file} COPYONLY)
+        endforeach()
+        foreach(i RANGE ${last})
+            write_page(${dir} ${i})
+        endforeach()
+
+        set(threads 1)
+        if(run STREQUAL "parallel")
+            set(threads 16)
+        endif()
+        execute_process(COMMAND ${LEMON} -j ${threads} ${flags} model.h ${names}
+                        WORKING_DIRECTORY ${dir}
+                        RESULT_VARIABLE result
+                        OUTPUT_VARIABLE output
+                        ERROR_VARIABLE output)
+        if(NOT result EQUAL 0)
+            message(FATAL_ERROR "lemon -j ${threads} ${flags} failed:\n${output}")
+        endif()
+    endforeach()
+
+    file(GLOB outputs RELATIVE ${WORK_DIR}/${backend}_serial
+         ${WORK_DIR}/${backend}_serial/*.lm.*)
+    list(LENGTH outputs count)
+    if(count LESS ${templates})
+        message(FATAL_ERROR "${backend}: ${count} outputs for ${templates} templates")
+    endif()
+    foreach(file ${outputs})
+        if(NOT EXISTS ${WORK_DIR}/${backend}_parallel/${file})
+            message(FATAL_ERROR "${backend}: no ${file} with -j 16")
+        endif()
+        file(READ ${WORK_DIR}/${backend}_serial/${file} serial_bytes HEX)
+        file(READ ${WORK_DIR}/${backend}_parallel/${file} parallel_bytes HEX)
+        if(NOT serial_bytes STREQUAL parallel_bytes)
+            message(FATAL_ERROR "${backend}: ${file} differs with -j 16")
+        endif()
+    endforeach()
+    message(STATUS "${backend}: ${count} outputs the same")
+endforeach()
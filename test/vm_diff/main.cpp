@@ -0,0 +1,83 @@
+// renders the same templates and models with the generated C++ and with
+// the vm, the outputs must be the same bytes.
+#include <cstdio>
+#include <cstdlib>
+#include "model.h"
+#include "reflect.hpp"
+#include "page.lm.h"
+#include "layout.lm.h"
+
+static int runs = 0;
+static int diffs = 0;
+
+static void load(lm::vm::program &prog, const char *file_path)
+{
+    std::string error;
+    if (!prog.open(file_path) || !prog.link(error))
+    {
+        printf("%s: %s\n", file_path, error.empty() ? "open failed" : error.c_str());
+        exit(1);
+    }
+}
+static void check(const char *name, const std::string &cpp,
+                  lm::vm::program &prog, const shop::user &u, const std::string &title)
+{
+    std::vector<lm::vm::arg_t> args;
+    args.push_back(lm::vm::arg(u));
+    args.push_back(lm::vm::arg(title));
+    std::string vm;
+    runs++;
+    if (!prog.render(args, vm) || vm != cpp)
+    {
+        diffs++;
+        printf("%s differs\n--cpp--\n%s\n--vm--\n%s\n", name, cpp.c_str(), vm.c_str());
+    }
+}
+static shop::user make_user(int k)
+{
+    static const char *names[] = {"", "bob", "ann", "<b>o'\"b&</b>", "\xe4\xbd\xa0\xe5\xa5\xbd </script>"};
+    shop::user u;
+    u.name = names[k % 5];
+    u.bio = lm::safe_string(k % 2 ? "<em>bio</em>" : "");
+    u.age = 15 + k * 3 % 50;
+    u.admin = k % 7 == 0;
+    for (int i = 0; i < k % 4; i++)
+    {
+        shop::item it;
+        it.name = "item<" + lm::$to_string(i) + ">";
+        it.price = i * 7 - 5;
+        u.items.push_back(it);
+    }
+    if (k % 3)
+    {
+        u.tags["a&b"] = "x<y";
+        u.tags["empty"] = "";
+    }
+    for (int i = 0; i < k % 3; i++)
+        u.notes.push_back("note '" + lm::$to_string(i) + "'");
+    return u;
+}
+
+int main()
+{
+    lm::vm::program page_vm;
+    lm::vm::program layout_vm;
+    load(page_vm, "page.lm.lmc");
+    load(layout_vm, "layout.lm.lmc");
+
+    for (int k = 0; k < 40; k++)
+    {
+        shop::user u = make_user(k);
+        std::string title = k % 3 == 1 ? "T\"it<le>" : k % 3 ? " JavaScript:alert(1)" : "";
+        std::string html = page(u, title);
+        if (html.find("src=\" JavaScript") != std::string::npos)
+        {
+            diffs++;
+            printf("javascript: url not filtered\n%s\n", html.c_str());
+        }
+        check("page", html, page_vm, u, title);
+        check("layout", layout(u, title), layout_vm, u, title);
+    }
+    printf("%d renders, %d diffs\n", runs, diffs);
+    return diffs != 0;
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <map>
+#include <list>
+#include "lemon.hpp"
+
+namespace shop
+{
+    struct item
+    {
+        std::string name;
+        int price;
+    };
+    class user
+    {
+    public:
+        std::string name;
+        lm::safe_string bio;
+        int age;
+        bool admin;
+        std::vector<item> items;
+        std::map<std::string, std::string> tags;
+        std::list<std::string> notes;
+    };
+}